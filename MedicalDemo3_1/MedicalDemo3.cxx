@@ -7,18 +7,17 @@
 #include <array>
 #include <vector>
 #include <algorithm>
+#include <cmath>
 #include <vtkObject.h>
 #include <vtkSmartPointer.h>
 #include <vtkActor.h>
 #include <vtkCamera.h>
 #include <vtkImageActor.h>
-#include <vtkImageMapToColors.h>
 #include <vtkImageMapper3D.h>
 #include <vtkLookupTable.h>
 #include <vtkMetaImageReader.h>
 #include <vtkNamedColors.h>
 #include <vtkNew.h>
-#include <vtkOutlineFilter.h>
 #include <vtkPolyDataMapper.h>
 #include <vtkProperty.h>
 #include <vtkRenderWindow.h>
@@ -40,6 +39,8 @@
 #include <vtkTransform.h>
 #include <vtkTransformFilter.h>
 #include <vtkPlaneSource.h>
+#include <vtkCommand.h>
+#include <vtkMatrix4x4.h>
 
 // vtkFlyingEdges3D was introduced in VTK >= 8.2
 #if VTK_MAJOR_VERSION >= 9 || (VTK_MAJOR_VERSION >= 8 && VTK_MINOR_VERSION >= 2)
@@ -72,9 +73,8 @@ public:
 	{
 		int clickPos[2];
 		this->Interactor->GetEventPosition(clickPos);
-		vtkSmartPointer<vtkPropPicker> picker = vtkSmartPointer<vtkPropPicker>::New();
-		picker->Pick(clickPos[0], clickPos[1], 0, this->Renderer);
-		this->m_pTarget = vtkActor::SafeDownCast(picker->GetActor());
+		m_Picker->Pick(clickPos[0], clickPos[1], 0, this->Renderer);
+		this->m_pTarget = vtkActor::SafeDownCast(m_Picker->GetActor());
 
 		if (this->m_pTarget)
 		{
@@ -251,6 +251,7 @@ private:
 	vtkSmartPointer<vtkTransform> translationX = nullptr;
 	vtkSmartPointer<vtkTransform> translationY = nullptr;
 	vtkSmartPointer<vtkTransform> translationZ = nullptr;
+	vtkNew<vtkPropPicker> m_Picker;	// reused by every click
 	vtkActor* m_pTarget = nullptr;
 	vtkActor* m_pActorX = nullptr;
 	vtkActor* m_pActorY = nullptr;
@@ -272,6 +273,93 @@ private:
 
 vtkStandardNewMacro(vtkCustomInteractorStyle);
 
+// Keeps the face tessellation proportional to the faces' size on screen.
+// Before each frame the three corners of every plane are projected, and
+// each in-plane edge gets one cell per PixelsPerCell pixels (at least one,
+// at most MaxResolution).  A face is re-tessellated only when its target
+// leaves the band [resolution / Hysteresis, resolution * Hysteresis], so
+// small camera moves do not rebuild the geometry every frame.
+class vtkPlaneTessellationCallback : public vtkCommand
+{
+public:
+	static vtkPlaneTessellationCallback* New() { return new vtkPlaneTessellationCallback; }
+
+	// actors[i] draws planeSources[i]; its matrix maps the plane to world space.
+	void SetFaces(vtkRenderer* renderer, const std::vector<vtkActor*>& actors,
+		const std::vector<vtkPlaneSource*>& planeSources)
+	{
+		this->Renderer = renderer;
+		this->Actors = actors;
+		this->PlaneSources = planeSources;
+		renderer->AddObserver(vtkCommand::StartEvent, this);
+	}
+
+	// Total number of quads currently generated for all faces.
+	int GetNumberOfCells() const
+	{
+		int cells = 0;
+		for (vtkPlaneSource* planeSource : this->PlaneSources)
+			cells += planeSource->GetXResolution() * planeSource->GetYResolution();
+		return cells;
+	}
+
+	virtual void Execute(vtkObject*, unsigned long, void*) override
+	{
+		vtkCamera* camera = this->Renderer->GetActiveCamera();
+		vtkMatrix4x4* projection = camera->GetCompositeProjectionTransformMatrix(
+			this->Renderer->GetTiledAspectRatio(), -1, 1);
+		const int* size = this->Renderer->GetSize();
+		for (size_t i = 0; i < this->PlaneSources.size(); i++) {
+			vtkPlaneSource* planeSource = this->PlaneSources[i];
+			double corners[3][4], display[3][2];
+			planeSource->GetOrigin(corners[0]);
+			planeSource->GetPoint1(corners[1]);
+			planeSource->GetPoint2(corners[2]);
+			bool behindEye = false;
+			for (int c = 0; c < 3; c++) {
+				corners[c][3] = 1.0;
+				this->Actors[i]->GetMatrix()->MultiplyPoint(corners[c], corners[c]);
+				projection->MultiplyPoint(corners[c], corners[c]);
+				if (corners[c][3] <= 0) {
+					behindEye = true;
+					break;
+				}
+				display[c][0] = 0.5 * size[0] * corners[c][0] / corners[c][3];
+				display[c][1] = 0.5 * size[1] * corners[c][1] / corners[c][3];
+			}
+			int target[2] = { this->MaxResolution, this->MaxResolution };
+			if (!behindEye) {
+				// Point1 - Origin is the X resolution edge, Point2 - Origin the Y edge.
+				for (int e = 0; e < 2; e++) {
+					double pixels = std::hypot(display[e + 1][0] - display[0][0], display[e + 1][1] - display[0][1]);
+					double cells = std::ceil(pixels / (this->PixelsPerCell * this->Coarsening));
+					target[e] = (int)std::min(std::max(cells, 1.0), (double)this->MaxResolution);
+				}
+			}
+			int current[2] = { planeSource->GetXResolution(), planeSource->GetYResolution() };
+			bool update = false;
+			for (int e = 0; e < 2; e++)
+				update = update || target[e] > current[e] * this->Hysteresis || target[e] * this->Hysteresis < current[e]
+				|| ((target[e] == 1 || target[e] == this->MaxResolution) && target[e] != current[e]);
+			if (update) {
+				planeSource->SetResolution(target[0], target[1]);
+				this->Updates++;
+			}
+		}
+	}
+
+	double	PixelsPerCell = 8.0;	// screen pixels per cell edge
+	double	Coarsening = 1.0;		// multiplies PixelsPerCell while interacting
+	double	Hysteresis = 1.5;		// relative change needed to re-tessellate
+	int		MaxResolution = 128;
+	long	Updates = 0;			// number of faces re-tessellated so far
+
+private:
+	vtkRenderer*					Renderer = nullptr;
+	std::vector<vtkActor*>			Actors;
+	std::vector<vtkPlaneSource*>	PlaneSources;
+};
+
 int test4(int argc, char* argv[]);
 int main(int argc, char* argv[])
 {
@@ -359,6 +447,11 @@ int test4(int argc, char* argv[])
 	style->SetPlanes(ActorList[0].Get(), ActorList[1].Get(), ActorList[2].Get());
 	iren->SetInteractorStyle(style);
 
+	// Plane resolution follows each plane's size on screen.
+	vtkNew<vtkPlaneTessellationCallback> tessellation;
+	tessellation->SetFaces(aRenderer, std::vector<vtkActor*>(ActorList.begin(), ActorList.end()),
+		std::vector<vtkPlaneSource*>(planes.begin(), planes.end()));
+
 	// interact with data
 	iren->Initialize();
 	iren->Start();
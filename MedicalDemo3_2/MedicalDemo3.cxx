@@ -7,18 +7,24 @@
 #include <array>
 #include <vector>
 #include <algorithm>
+#include <cmath>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
+#include <string>
 #include <vtkObject.h>
 #include <vtkSmartPointer.h>
 #include <vtkActor.h>
 #include <vtkCamera.h>
 #include <vtkImageActor.h>
-#include <vtkImageMapToColors.h>
 #include <vtkImageMapper3D.h>
 #include <vtkLookupTable.h>
 #include <vtkMetaImageReader.h>
 #include <vtkNamedColors.h>
 #include <vtkNew.h>
-#include <vtkOutlineFilter.h>
 #include <vtkPolyDataMapper.h>
 #include <vtkProperty.h>
 #include <vtkRenderWindow.h>
@@ -31,6 +37,7 @@
 #include <vtkVertexGlyphFilter.h>
 #include <vtkImageData.h>
 #include <vtkObjectFactory.h>
+#include <vtkPropCollection.h>
 #include <vtkPropPicker.h>
 #include <vtkCellPicker.h>
 #include <vtkCellData.h>
@@ -41,6 +48,12 @@
 #include <vtkTransform.h>
 #include <vtkTransformFilter.h>
 #include <vtkPlaneSource.h>
+#include <vtkCallbackCommand.h>
+#include <vtkCommand.h>
+#include <vtkMath.h>
+#include <vtkMatrix4x4.h>
+#include <vtkSMPTools.h>
+#include <vtkTexture.h>
 
 // vtkFlyingEdges3D was introduced in VTK >= 8.2
 #if VTK_MAJOR_VERSION >= 9 || (VTK_MAJOR_VERSION >= 8 && VTK_MINOR_VERSION >= 2)
@@ -83,9 +96,8 @@ public:
 		if (this->CurrentStyle == this->ActorStyle) {
 			int clickPos[2];
 			this->Interactor->GetEventPosition(clickPos);
-			vtkSmartPointer<vtkPropPicker> picker = vtkSmartPointer<vtkPropPicker>::New();
-			picker->Pick(clickPos[0], clickPos[1], 0, this->Renderer);
-			this->m_pTarget = vtkActor::SafeDownCast(picker->GetActor());
+			m_Picker->Pick(clickPos[0], clickPos[1], 0, this->Renderer);
+			this->m_pTarget = vtkActor::SafeDownCast(m_Picker->GetActor());
 
 			if (this->m_pTarget)
 			{
@@ -120,9 +132,8 @@ public:
 		if (this->CurrentStyle == this->ActorStyle) {
 			int clickPos[2];
 			this->Interactor->GetEventPosition(clickPos);
-			vtkSmartPointer<vtkPropPicker> picker = vtkSmartPointer<vtkPropPicker>::New();
-			picker->Pick(clickPos[0], clickPos[1], 0, this->Renderer);
-			this->m_pTarget = vtkActor::SafeDownCast(picker->GetActor());
+			m_Picker->Pick(clickPos[0], clickPos[1], 0, this->Renderer);
+			this->m_pTarget = vtkActor::SafeDownCast(m_Picker->GetActor());
 
 			if (this->m_pTarget)
 			{
@@ -384,6 +395,7 @@ private:
 	vtkSmartPointer<vtkInteractorStyleTrackballCamera> CameraStyle;
 	vtkSmartPointer<vtkInteractorStyle> CurrentStyle;
 	vtkSmartPointer<vtkRenderer>	Renderer = nullptr;
+	vtkNew<vtkPropPicker>			m_Picker;	// shared by both pick paths
 	vtkActor*						m_pTarget = nullptr;
 	std::array<vtkSmartPointer<vtkTransform>, NUMOFPLANES>	translations = { nullptr };
 	std::vector<vtkActor*>			m_pActors;
@@ -398,6 +410,1030 @@ vtkStandardNewMacro(vtkCustomInteractorStyle);
 
 
 
+// Draws the semi-transparent box faces back to front without depth peeling.
+// The faces are the sides of a convex box, so a face whose outward normal
+// points away from the camera is never in front of one that points toward
+// it: the faces are ordered back faces first, then by decreasing distance,
+// and re-added to the renderer in that order before each frame.
+// Frame times are accumulated per mode so the sort can be compared with
+// depth peeling ('t' cycles the modes).
+class vtkFaceSortCallback : public vtkCommand
+{
+public:
+	enum Mode { Sorted, DepthPeeling, Unsorted, NumberOfModes };
+
+	static vtkFaceSortCallback* New() { return new vtkFaceSortCallback; }
+
+	void SetFaces(vtkRenderer* renderer, const std::vector<vtkActor*>& actors,
+		const std::vector<vtkPlaneSource*>& planeSources)
+	{
+		this->Renderer = renderer;
+		this->Actors = actors;
+		this->PlaneSources = planeSources;
+		this->Order.resize(actors.size());
+		this->Keys.resize(actors.size());
+		for (size_t i = 0; i < actors.size(); i++)
+			this->Order[i] = (int)i;
+		renderer->AddObserver(vtkCommand::StartEvent, this);
+		renderer->AddObserver(vtkCommand::EndEvent, this);
+	}
+
+	void SetMode(int mode)
+	{
+		this->CurrentMode = mode;
+		this->Renderer->SetUseDepthPeeling(mode == DepthPeeling);
+		this->Renderer->SetMaximumNumberOfPeels(8);
+		this->Renderer->SetOcclusionRatio(0.0);
+		std::cout << "Translucency: " << ModeName(mode) << std::endl;
+	}
+
+	void NextMode()
+	{
+		for (int mode = 0; mode < NumberOfModes; mode++) {
+			if (this->Frames[mode] > 0)
+				std::cout << "  " << ModeName(mode) << ": " << 1000 * this->Seconds[mode] / this->Frames[mode]
+				<< " ms/frame over " << this->Frames[mode] << " frames" << std::endl;
+		}
+		this->SetMode((this->CurrentMode + 1) % NumberOfModes);
+	}
+
+	static const char* ModeName(int mode)
+	{
+		static const char* names[NumberOfModes] = { "sorted faces", "depth peeling", "unsorted" };
+		return names[mode];
+	}
+
+	virtual void Execute(vtkObject*, unsigned long eventId, void*) override
+	{
+		if (eventId == vtkCommand::EndEvent) {
+			this->Seconds[this->CurrentMode] += std::chrono::duration<double>(std::chrono::steady_clock::now() - this->FrameStart).count();
+			this->Frames[this->CurrentMode]++;
+			return;
+		}
+		this->FrameStart = std::chrono::steady_clock::now();
+		if (this->CurrentMode == Sorted)
+			this->SortFaces();
+	}
+
+private:
+	void SortFaces()
+	{
+		double eye[3];
+		this->Renderer->GetActiveCamera()->GetPosition(eye);
+
+		double boxCenter[3] = { 0, 0, 0 };
+		const size_t numFaces = this->Actors.size();
+		for (size_t i = 0; i < numFaces; i++) {
+			double* center = this->Actors[i]->GetCenter();
+			for (int n = 0; n < 3; n++)
+				boxCenter[n] += center[n] / numFaces;
+		}
+
+		for (size_t i = 0; i < numFaces; i++) {
+			double center[3], normal[3], world[3];
+			std::copy(this->Actors[i]->GetCenter(), this->Actors[i]->GetCenter() + 3, center);
+			this->PlaneSources[i]->GetNormal(normal);
+			vtkMatrix4x4* matrix = this->Actors[i]->GetMatrix();
+			for (int r = 0; r < 3; r++)
+				world[r] = matrix->GetElement(r, 0) * normal[0] + matrix->GetElement(r, 1) * normal[1] +
+				matrix->GetElement(r, 2) * normal[2];
+			double toEye[3], outward[3];
+			vtkMath::Subtract(eye, center, toEye);
+			vtkMath::Subtract(center, boxCenter, outward);
+			double facing = vtkMath::Dot(world, toEye);
+			if (vtkMath::Dot(world, outward) < 0)
+				facing = -facing;
+			this->Keys[i].first = facing > 0 ? 1 : 0;
+			this->Keys[i].second = -vtkMath::Dot(toEye, toEye);
+		}
+
+		std::sort(this->Order.begin(), this->Order.end(),
+			[this](int a, int b) { return this->Keys[a] < this->Keys[b]; });
+		this->ReorderProps();
+	}
+
+	// Puts the faces in Order into the slots of the renderer's prop list
+	// that faces hold now (the styles re-add dragged faces, so these move).
+	// Removing and re-adding the faces instead would release their graphics
+	// resources every frame.
+	void ReorderProps()
+	{
+		vtkPropCollection* props = this->Renderer->GetViewProps();
+		this->Slots.clear();
+		vtkCollectionSimpleIterator it;
+		props->InitTraversal(it);
+		int slot = 0;
+		while (vtkProp* prop = props->GetNextProp(it)) {
+			auto face = std::find(this->Actors.begin(), this->Actors.end(), prop);
+			if (face != this->Actors.end())
+				this->Slots.emplace_back(slot, (int)(face - this->Actors.begin()));
+			slot++;
+		}
+		if (this->Slots.size() != this->Actors.size())
+			return;
+		for (size_t n = 0; n < this->Slots.size(); n++)
+			if (this->Slots[n].second != this->Order[n])
+				props->ReplaceItem(this->Slots[n].first, this->Actors[this->Order[n]]);
+	}
+
+	vtkRenderer*					Renderer = nullptr;
+	std::vector<vtkActor*>			Actors;
+	std::vector<vtkPlaneSource*>	PlaneSources;
+	std::vector<int>				Order;
+	std::vector<std::pair<int, double>>	Keys;
+	std::vector<std::pair<int, int>>	Slots;			// prop list slot and the face in it
+	int								CurrentMode = Sorted;
+	double							Seconds[NumberOfModes]{ 0, 0, 0 };
+	long							Frames[NumberOfModes]{ 0, 0, 0 };
+	std::chrono::steady_clock::time_point	FrameStart;
+};
+
+// Keeps the face tessellation proportional to the faces' size on screen.
+// Before each frame the three corners of every plane are projected, and
+// each in-plane edge gets one cell per PixelsPerCell pixels (at least one,
+// at most MaxResolution).  A face is re-tessellated only when its target
+// leaves the band [resolution / Hysteresis, resolution * Hysteresis], so
+// small camera moves do not rebuild the geometry every frame.
+class vtkPlaneTessellationCallback : public vtkCommand
+{
+public:
+	static vtkPlaneTessellationCallback* New() { return new vtkPlaneTessellationCallback; }
+
+	// actors[i] draws planeSources[i]; its matrix maps the plane to world space.
+	void SetFaces(vtkRenderer* renderer, const std::vector<vtkActor*>& actors,
+		const std::vector<vtkPlaneSource*>& planeSources)
+	{
+		this->Renderer = renderer;
+		this->Actors = actors;
+		this->PlaneSources = planeSources;
+		renderer->AddObserver(vtkCommand::StartEvent, this);
+	}
+
+	// Total number of quads currently generated for all faces.
+	int GetNumberOfCells() const
+	{
+		int cells = 0;
+		for (vtkPlaneSource* planeSource : this->PlaneSources)
+			cells += planeSource->GetXResolution() * planeSource->GetYResolution();
+		return cells;
+	}
+
+	virtual void Execute(vtkObject*, unsigned long, void*) override
+	{
+		vtkCamera* camera = this->Renderer->GetActiveCamera();
+		vtkMatrix4x4* projection = camera->GetCompositeProjectionTransformMatrix(
+			this->Renderer->GetTiledAspectRatio(), -1, 1);
+		const int* size = this->Renderer->GetSize();
+		for (size_t i = 0; i < this->PlaneSources.size(); i++) {
+			vtkPlaneSource* planeSource = this->PlaneSources[i];
+			double corners[3][4], display[3][2];
+			planeSource->GetOrigin(corners[0]);
+			planeSource->GetPoint1(corners[1]);
+			planeSource->GetPoint2(corners[2]);
+			bool behindEye = false;
+			for (int c = 0; c < 3; c++) {
+				corners[c][3] = 1.0;
+				this->Actors[i]->GetMatrix()->MultiplyPoint(corners[c], corners[c]);
+				projection->MultiplyPoint(corners[c], corners[c]);
+				if (corners[c][3] <= 0) {
+					behindEye = true;
+					break;
+				}
+				display[c][0] = 0.5 * size[0] * corners[c][0] / corners[c][3];
+				display[c][1] = 0.5 * size[1] * corners[c][1] / corners[c][3];
+			}
+			int target[2] = { this->MaxResolution, this->MaxResolution };
+			if (!behindEye) {
+				// Point1 - Origin is the X resolution edge, Point2 - Origin the Y edge.
+				for (int e = 0; e < 2; e++) {
+					double pixels = std::hypot(display[e + 1][0] - display[0][0], display[e + 1][1] - display[0][1]);
+					double cells = std::ceil(pixels / (this->PixelsPerCell * this->Coarsening));
+					target[e] = (int)std::min(std::max(cells, 1.0), (double)this->MaxResolution);
+				}
+			}
+			int current[2] = { planeSource->GetXResolution(), planeSource->GetYResolution() };
+			bool update = false;
+			for (int e = 0; e < 2; e++)
+				update = update || target[e] > current[e] * this->Hysteresis || target[e] * this->Hysteresis < current[e]
+				|| ((target[e] == 1 || target[e] == this->MaxResolution) && target[e] != current[e]);
+			if (update) {
+				planeSource->SetResolution(target[0], target[1]);
+				this->Updates++;
+			}
+		}
+	}
+
+	double	PixelsPerCell = 8.0;	// screen pixels per cell edge
+	double	Coarsening = 1.0;		// multiplies PixelsPerCell while interacting
+	double	Hysteresis = 1.5;		// relative change needed to re-tessellate
+	int		MaxResolution = 128;
+	long	Updates = 0;			// number of faces re-tessellated so far
+
+private:
+	vtkRenderer*					Renderer = nullptr;
+	std::vector<vtkActor*>			Actors;
+	std::vector<vtkPlaneSource*>	PlaneSources;
+};
+
+// A single-component volume read from a MetaImage file and kept as floats,
+// x fastest, for the CPU projections below.  The value range of every
+// BlockSize^3 block of voxels is kept alongside.
+struct FloatVolume
+{
+	static const int BlockSize = 8;
+
+	bool Load(const std::string& fileName)
+	{
+		vtkNew<vtkMetaImageReader> reader;
+		if (!reader->CanReadFile(fileName.c_str()))
+			return false;
+		reader->SetFileName(fileName.c_str());
+		reader->Update();
+		vtkImageData* image = reader->GetOutput();
+		if (image->GetNumberOfScalarComponents() != 1)
+			return false;
+		image->GetDimensions(Dims);
+		const size_t count = (size_t)Dims[0] * Dims[1] * Dims[2];
+		Voxels.resize(count);
+		switch (image->GetScalarType()) {
+			vtkTemplateMacro(CopyVoxels(static_cast<const VTK_TT*>(image->GetScalarPointer()), count));
+		default:
+			return false;
+		}
+		auto range = std::minmax_element(Voxels.begin(), Voxels.end());
+		Range[0] = *range.first;
+		Range[1] = *range.second;
+		this->BuildBlockRanges();
+		return true;
+	}
+
+	// Index into BlockMin / BlockMax of the block numbered block[j] along
+	// each axis j.
+	size_t BlockIndex(const int block[3]) const
+	{
+		return (size_t)block[0] + (size_t)Blocks[0] * (block[1] + (size_t)Blocks[1] * block[2]);
+	}
+
+	vtkIdType Stride(int axis) const
+	{
+		return axis == 0 ? 1 : axis == 1 ? (vtkIdType)Dims[0] : (vtkIdType)Dims[0] * Dims[1];
+	}
+
+	template <class T>
+	void CopyVoxels(const T* scalars, size_t count)
+	{
+		vtkSMPTools::For(0, (vtkIdType)count, [&](vtkIdType first, vtkIdType last) {
+			for (vtkIdType n = first; n < last; n++)
+				Voxels[n] = (float)scalars[n];
+		});
+	}
+
+	void BuildBlockRanges()
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (int j = 0; j < 3; j++)
+			Blocks[j] = (Dims[j] + BlockSize - 1) / BlockSize;
+		BlockMin.assign((size_t)Blocks[0] * Blocks[1] * Blocks[2], VTK_FLOAT_MAX);
+		BlockMax.assign(BlockMin.size(), -VTK_FLOAT_MAX);
+		vtkSMPTools::For(0, Blocks[2], [&](vtkIdType firstSlab, vtkIdType lastSlab) {
+			for (vtkIdType bz = firstSlab; bz < lastSlab; bz++) {
+				const int z1 = std::min((int)bz * BlockSize + BlockSize, Dims[2]);
+				for (int z = (int)bz * BlockSize; z < z1; z++) {
+					for (int y = 0; y < Dims[1]; y++) {
+						const float* row = Voxels.data() + ((size_t)z * Dims[1] + y) * Dims[0];
+						const size_t first = (size_t)Blocks[0] * (y / BlockSize + (size_t)Blocks[1] * bz);
+						for (int bx = 0; bx < Blocks[0]; bx++) {
+							const int x1 = std::min(bx * BlockSize + BlockSize, Dims[0]);
+							float lo = BlockMin[first + bx], hi = BlockMax[first + bx];
+							for (int x = bx * BlockSize; x < x1; x++) {
+								lo = std::min(lo, row[x]);
+								hi = std::max(hi, row[x]);
+							}
+							BlockMin[first + bx] = lo;
+							BlockMax[first + bx] = hi;
+						}
+					}
+				}
+			}
+		});
+		BlockMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	std::vector<float>	Voxels;
+	int					Dims[3]{ 0, 0, 0 };
+	double				Range[2]{ 0, 1 };
+	int					Blocks[3]{ 0, 0, 0 };	// blocks along each axis
+	std::vector<float>	BlockMin, BlockMax;		// value range of each block
+	double				BlockMilliseconds = 0;
+};
+
+// Thick-slab projections of a volume onto the box faces.  A face shows the
+// maximum, minimum or mean of the slices [First, Last] along its normal,
+// one texel per voxel.  Output rows are split across threads.  When the
+// face's rows run along x, every slice contributes one contiguous voxel row
+// per output row, so the inner loops are element-wise max / min / add over
+// floats that the compiler vectorizes; other faces reduce each pixel's run
+// of voxels eight lanes at a time.
+// A moved face only visits the slices that left or entered its slab: the
+// mean keeps a running sum per pixel, and the minimum and maximum fold the
+// entering slices in, recomputing a pixel from the whole slab only when a
+// leaving slice held its extreme value.
+// A full MIP or MinIP passes over blocks of the volume whose value range
+// cannot change the pixels they lie under.
+class SlabProjector
+{
+public:
+	enum Mode { Maximum, Minimum, Mean, NumberOfModes };
+
+	struct Slab
+	{
+		int		Axis = 2;					// projection axis
+		int		U = 0, V = 1;				// volume axes along output rows and columns
+		int		Extent[4]{ 0, -1, 0, -1 };	// voxels covered: u0, u1, v0, v1
+		int		First = 0, Last = -1;		// slices currently reduced, inclusive
+		int		Mode = -1;
+		vtkSmartPointer<vtkImageData>	Image;	// float projection
+		std::vector<double>				Sums;	// running sums in Mean mode
+	};
+
+	static const char* ModeName(int mode)
+	{
+		static const char* names[NumberOfModes] = { "MIP", "MinIP", "mean" };
+		return names[mode];
+	}
+
+	void SetVolume(const FloatVolume* volume) { m_Volume = volume; }
+	const FloatVolume* GetVolume() const { return m_Volume; }
+
+
+	// Voxel index along axis for a fraction of the volume's extent.
+	int ToVoxel(int axis, double fraction) const
+	{
+		fraction = std::min(std::max(fraction, 0.0), 1.0);
+		return (int)std::lround(fraction * (m_Volume->Dims[axis] - 1));
+	}
+
+	void InitializeSlab(Slab& slab, int axis, int u, int v, const int extent[4]) const
+	{
+		slab.Axis = axis;
+		slab.U = u;
+		slab.V = v;
+		std::copy(extent, extent + 4, slab.Extent);
+		slab.First = 0;
+		slab.Last = -1;
+		slab.Mode = -1;
+		slab.Image = vtkSmartPointer<vtkImageData>::New();
+		slab.Image->SetDimensions(extent[1] - extent[0] + 1, extent[3] - extent[2] + 1, 1);
+		slab.Image->AllocateScalars(VTK_FLOAT, 1);
+	}
+
+	// Brings slab to slices [first, last] in mode; false if it already was.
+	bool Project(Slab& slab, int first, int last, int mode)
+	{
+		first = std::min(std::max(first, 0), m_Volume->Dims[slab.Axis] - 1);
+		last = std::min(std::max(last, first), m_Volume->Dims[slab.Axis] - 1);
+		if (first == slab.First && last == slab.Last && mode == slab.Mode)
+			return false;
+		auto start = std::chrono::steady_clock::now();
+		const bool overlap = mode == slab.Mode && first <= slab.Last && last >= slab.First;
+		const int changed = std::abs(first - slab.First) + std::abs(last - slab.Last);
+		if (overlap && changed < last - first + 1) {
+			this->Update(slab, first, last);
+			this->IncrementalUpdates++;
+		}
+		else {
+			slab.Mode = mode;
+			if (mode == Mean)
+				slab.Sums.resize((size_t)(slab.Extent[1] - slab.Extent[0] + 1) * (slab.Extent[3] - slab.Extent[2] + 1));
+			else
+				std::vector<double>().swap(slab.Sums);
+			this->Compute(slab, first, last);
+			this->FullUpdates++;
+		}
+		slab.First = first;
+		slab.Last = last;
+		slab.Image->Modified();
+		this->Milliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		return true;
+	}
+
+	// Share of the voxels under full MIP / MinIP computes that block ranges
+	// let them skip, and the time that saved at the rate the rest were read.
+	double GetSkippedFraction() const
+	{
+		const double total = (double)m_ReadVoxels + m_SkippedVoxels;
+		return total > 0 ? m_SkippedVoxels / total : 0;
+	}
+	double GetSkippedMilliseconds() const
+	{
+		return m_ReadVoxels > 0 ? this->BlockMilliseconds * m_SkippedVoxels / m_ReadVoxels : 0;
+	}
+
+	long	FullUpdates = 0;			// slabs reduced from scratch
+	long	IncrementalUpdates = 0;		// slabs updated from the slices that changed
+	double	Milliseconds = 0;			// time spent in both
+	double	BlockMilliseconds = 0;		// time spent in full MIP / MinIP computes
+
+private:
+	static float Maximum2(float a, float b) { return a < b ? b : a; }
+	static float Minimum2(float a, float b) { return b < a ? b : a; }
+	static double Add(double a, double b) { return a + b; }
+
+	// First voxel of output row r in the given slice.
+	const float* RowStart(const Slab& slab, int r, int slice) const
+	{
+		return m_Volume->Voxels.data() + slab.Extent[0] * m_Volume->Stride(slab.U) + (slab.Extent[2] + r) * m_Volume->Stride(slab.V)
+			+ slice * m_Volume->Stride(slab.Axis);
+	}
+
+	// Reduces count voxels step apart; eight independent lanes keep the
+	// loads and min / max / add pipelined.
+	template <class T, class Op>
+	static T ReduceRun(const float* voxel, vtkIdType step, int count, T init, Op op)
+	{
+		T lanes[8];
+		std::fill(lanes, lanes + 8, init);
+		int k = 0;
+		for (; k + 8 <= count; k += 8)
+			for (int l = 0; l < 8; l++)
+				lanes[l] = op(lanes[l], (T)voxel[(k + l) * step]);
+		for (; k < count; k++)
+			lanes[0] = op(lanes[0], (T)voxel[k * step]);
+		for (int l = 1; l < 8; l++)
+			lanes[0] = op(lanes[0], lanes[l]);
+		return lanes[0];
+	}
+
+	float ReducePixel(const Slab& slab, const float* voxel, int count) const
+	{
+		const vtkIdType step = m_Volume->Stride(slab.Axis);
+		switch (slab.Mode) {
+		case Maximum:
+			return ReduceRun(voxel, step, count, -VTK_FLOAT_MAX, Maximum2);
+		case Minimum:
+			return ReduceRun(voxel, step, count, VTK_FLOAT_MAX, Minimum2);
+		default:
+			return (float)(ReduceRun(voxel, step, count, 0.0, Add) / count);
+		}
+	}
+
+	void Compute(Slab& slab, int first, int last)
+	{
+		if (slab.Mode != Mean) {
+			auto start = std::chrono::steady_clock::now();
+			if (slab.U == 0)
+				this->ComputeInBlocks<true>(slab, first, last);
+			else
+				this->ComputeInBlocks<false>(slab, first, last);
+			this->BlockMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			return;
+		}
+		const int width = slab.Extent[1] - slab.Extent[0] + 1;
+		const int rows = slab.Extent[3] - slab.Extent[2] + 1;
+		const int count = last - first + 1;
+		const vtkIdType sliceStep = m_Volume->Stride(slab.Axis), pixelStep = m_Volume->Stride(slab.U);
+		float* image = static_cast<float*>(slab.Image->GetScalarPointer());
+		vtkSMPTools::For(0, rows, [&](vtkIdType firstRow, vtkIdType lastRow) {
+			for (vtkIdType r = firstRow; r < lastRow; r++) {
+				float* out = image + r * width;
+				const float* row = this->RowStart(slab, (int)r, first);
+				double* sums = slab.Sums.data() + r * width;
+				if (slab.U != 0) {
+					for (int i = 0; i < width; i++) {
+						sums[i] = ReduceRun(row + i * pixelStep, sliceStep, count, 0.0, Add);
+						out[i] = (float)(sums[i] / count);
+					}
+					continue;
+				}
+				std::fill(sums, sums + width, 0.0);
+				for (int k = 0; k < count; k++, row += sliceStep)
+					for (int i = 0; i < width; i++)
+						sums[i] += row[i];
+				for (int i = 0; i < width; i++)
+					out[i] = (float)(sums[i] / count);
+			}
+		});
+	}
+
+	// Folds count slices into out[i0, i1); the loop over voxels adjacent
+	// in memory runs innermost.
+	template <bool Contiguous, class Op>
+	static void ReduceTile(float* out, const float* voxels, int i0, int i1, int count, vtkIdType sliceStep, vtkIdType pixelStep, Op op)
+	{
+		if (Contiguous) {
+			for (int k = 0; k < count; k++, voxels += sliceStep)
+				for (int i = i0; i < i1; i++)
+					out[i] = op(out[i], voxels[i]);
+			return;
+		}
+		for (int i = i0; i < i1; i++) {
+			const float* voxel = voxels + i * pixelStep;
+			float value = out[i];
+			for (int k = 0; k < count; k++)
+				value = op(value, voxel[k * sliceStep]);
+			out[i] = value;
+		}
+	}
+
+	// MIP and MinIP from scratch, a tile of BlockSize pixels by BlockSize
+	// slices at a time.  A tile is skipped when its block's range cannot
+	// raise (lower) any of its pixels past what the slices before it gave,
+	// which leaves the result exactly that of reading every voxel.
+	template <bool Contiguous>
+	void ComputeInBlocks(Slab& slab, int first, int last)
+	{
+		const FloatVolume& volume = *m_Volume;
+		const int B = FloatVolume::BlockSize;
+		const int width = slab.Extent[1] - slab.Extent[0] + 1;
+		const int rows = slab.Extent[3] - slab.Extent[2] + 1;
+		const bool maximum = slab.Mode == Maximum;
+		const vtkIdType sliceStep = volume.Stride(slab.Axis), pixelStep = Contiguous ? 1 : volume.Stride(slab.U);
+		float* image = static_cast<float*>(slab.Image->GetScalarPointer());
+		vtkSMPTools::For(0, rows, [&](vtkIdType firstRow, vtkIdType lastRow) {
+			uint64_t read = 0, skipped = 0;
+			for (vtkIdType r = firstRow; r < lastRow; r++) {
+				float* out = image + r * width;
+				const float* row = this->RowStart(slab, (int)r, first);
+				for (int i = 0; i < width; i++)
+					out[i] = row[i * pixelStep];
+				read += width;
+				int block[3];
+				block[slab.V] = (slab.Extent[2] + (int)r) / B;
+				for (int k0 = first + 1; k0 <= last;) {
+					const int k1 = std::min(last + 1, (k0 / B + 1) * B);
+					block[slab.Axis] = k0 / B;
+					for (int i0 = 0; i0 < width;) {
+						const int u = slab.Extent[0] + i0;
+						const int i1 = std::min(width, i0 + (u / B + 1) * B - u);
+						block[slab.U] = u / B;
+						const size_t b = volume.BlockIndex(block);
+						const uint64_t tile = (uint64_t)(i1 - i0) * (k1 - k0);
+						// The weakest pixel of the run bounds what the block can change.
+						if (maximum) {
+							const float least = *std::min_element(out + i0, out + i1);
+							if (volume.BlockMax[b] <= least)
+								skipped += tile;
+							else {
+								ReduceTile<Contiguous>(out, row + (k0 - first) * sliceStep, i0, i1, k1 - k0, sliceStep, pixelStep, Maximum2);
+								read += tile;
+							}
+						}
+						else {
+							const float most = *std::max_element(out + i0, out + i1);
+							if (volume.BlockMin[b] >= most)
+								skipped += tile;
+							else {
+								ReduceTile<Contiguous>(out, row + (k0 - first) * sliceStep, i0, i1, k1 - k0, sliceStep, pixelStep, Minimum2);
+								read += tile;
+							}
+						}
+						i0 = i1;
+					}
+					k0 = k1;
+				}
+			}
+			m_ReadVoxels += read;
+			m_SkippedVoxels += skipped;
+		});
+	}
+
+	// Moves the slab from [slab.First, slab.Last] to the overlapping range
+	// [first, last] by visiting only the slices that differ.
+	void Update(Slab& slab, int first, int last)
+	{
+		std::vector<int> leaving, entering;
+		for (int k = slab.First; k < first; k++)
+			leaving.push_back(k);
+		for (int k = last + 1; k <= slab.Last; k++)
+			leaving.push_back(k);
+		for (int k = first; k < slab.First; k++)
+			entering.push_back(k);
+		for (int k = slab.Last + 1; k <= last; k++)
+			entering.push_back(k);
+
+		if (slab.U == 0)
+			this->UpdateRows<true>(slab, leaving, entering, first, last - first + 1);
+		else
+			this->UpdateRows<false>(slab, leaving, entering, first, last - first + 1);
+	}
+
+	// With Contiguous the pixel step is a compile-time 1, so the loops over
+	// a row vectorize.
+	template <bool Contiguous>
+	void UpdateRows(Slab& slab, const std::vector<int>& leaving, const std::vector<int>& entering, int first, int count)
+	{
+		const int width = slab.Extent[1] - slab.Extent[0] + 1;
+		const int rows = slab.Extent[3] - slab.Extent[2] + 1;
+		const vtkIdType sliceStep = m_Volume->Stride(slab.Axis), pixelStep = Contiguous ? 1 : m_Volume->Stride(slab.U);
+		float* image = static_cast<float*>(slab.Image->GetScalarPointer());
+		vtkSMPTools::For(0, rows, [&](vtkIdType firstRow, vtkIdType lastRow) {
+			std::vector<unsigned char> stale(width);
+			for (vtkIdType r = firstRow; r < lastRow; r++) {
+				float* out = image + r * width;
+				const float* row = this->RowStart(slab, (int)r, 0);
+				if (slab.Mode == Mean) {
+					double* sums = slab.Sums.data() + r * width;
+					for (int k : leaving) {
+						const float* voxels = row + k * sliceStep;
+						for (int i = 0; i < width; i++)
+							sums[i] -= voxels[i * pixelStep];
+					}
+					for (int k : entering) {
+						const float* voxels = row + k * sliceStep;
+						for (int i = 0; i < width; i++)
+							sums[i] += voxels[i * pixelStep];
+					}
+					for (int i = 0; i < width; i++)
+						out[i] = (float)(sums[i] / count);
+					continue;
+				}
+				// A leaving voxel equal to the current extreme may have been it.
+				std::fill(stale.begin(), stale.end(), 0);
+				const bool maximum = slab.Mode == Maximum;
+				for (int k : leaving) {
+					const float* voxels = row + k * sliceStep;
+					if (maximum)
+						for (int i = 0; i < width; i++)
+							stale[i] |= (unsigned char)(voxels[i * pixelStep] >= out[i]);
+					else
+						for (int i = 0; i < width; i++)
+							stale[i] |= (unsigned char)(voxels[i * pixelStep] <= out[i]);
+				}
+				for (int k : entering) {
+					const float* voxels = row + k * sliceStep;
+					if (maximum)
+						for (int i = 0; i < width; i++)
+							out[i] = Maximum2(out[i], voxels[i * pixelStep]);
+					else
+						for (int i = 0; i < width; i++)
+							out[i] = Minimum2(out[i], voxels[i * pixelStep]);
+				}
+				for (int i = 0; i < width; i++)
+					if (stale[i])
+						out[i] = this->ReducePixel(slab, row + i * pixelStep + first * sliceStep, count);
+			}
+		});
+	}
+
+	const FloatVolume*	m_Volume = nullptr;
+	std::atomic<uint64_t>	m_ReadVoxels{ 0 }, m_SkippedVoxels{ 0 };
+};
+
+// Textures every face with a slab of the volume centred on the face's
+// current position along its normal, re-projected before each frame in
+// which a face moved.  The box bounds are mapped onto the volume's extent.
+class vtkSlabProjectionCallback : public vtkCommand
+{
+public:
+	static vtkSlabProjectionCallback* New() { return new vtkSlabProjectionCallback; }
+
+	void SetFaces(vtkRenderer* renderer, const std::vector<vtkActor*>& actors,
+		const std::vector<vtkPlaneSource*>& planeSources, const double bounds[6], SlabProjector* projector)
+	{
+		this->Actors = actors;
+		this->PlaneSources = planeSources;
+		std::copy(bounds, bounds + 6, this->Bounds);
+		this->Projector = projector;
+		const double* range = projector->GetVolume()->Range;
+		this->Lookup->SetTableRange(range[0], range[1]);
+		this->Lookup->SetHueRange(0, 0);
+		this->Lookup->SetSaturationRange(0, 0);
+		this->Lookup->SetValueRange(0, 1);
+		this->Lookup->Build();
+		this->Slabs.resize(actors.size());
+		this->Textures.resize(actors.size());
+		for (size_t i = 0; i < actors.size(); i++) {
+			double origin[3], point1[3], point2[3];
+			planeSources[i]->GetOrigin(origin);
+			planeSources[i]->GetPoint1(point1);
+			planeSources[i]->GetPoint2(point2);
+			// Texture s runs along Point1 - Origin and t along Point2 - Origin.
+			int u = LargestAxis(origin, point1), v = LargestAxis(origin, point2);
+			int axis = 3 - u - v;
+			int extent[4] = { this->ToVoxel(u, origin[u]), this->ToVoxel(u, point1[u]),
+				this->ToVoxel(v, origin[v]), this->ToVoxel(v, point2[v]) };
+			projector->InitializeSlab(this->Slabs[i], axis, u, v, extent);
+			this->Textures[i] = vtkSmartPointer<vtkTexture>::New();
+			this->Textures[i]->SetInputData(this->Slabs[i].Image);
+			this->Textures[i]->SetLookupTable(this->Lookup);
+			this->Textures[i]->MapColorScalarsThroughLookupTableOn();
+			this->Textures[i]->InterpolateOn();
+			actors[i]->SetTexture(this->Textures[i]);
+		}
+		renderer->AddObserver(vtkCommand::StartEvent, this);
+	}
+
+	void SetThickness(int slices)
+	{
+		this->Thickness = std::max(slices, 1);
+		this->PrintStatus();
+	}
+	int GetThickness() const { return this->Thickness; }
+
+	void SetMode(int mode)
+	{
+		this->Mode = mode;
+		this->PrintStatus();
+	}
+
+	void NextMode()
+	{
+		const SlabProjector* p = this->Projector;
+		long updates = p->FullUpdates + p->IncrementalUpdates;
+		if (updates > 0)
+			std::cout << "  " << p->FullUpdates << " full / " << p->IncrementalUpdates << " incremental slab updates, "
+			<< p->Milliseconds / updates << " ms each" << std::endl;
+		if (p->BlockMilliseconds > 0)
+			std::cout << "  " << 100 * p->GetSkippedFraction() << "% of MIP / MinIP voxels skipped by block ranges, about "
+			<< p->GetSkippedMilliseconds() << " ms saved, extrapolated linearly (ranges of " << p->GetVolume()->BlockMin.size() << " blocks in "
+			<< p->GetVolume()->BlockMilliseconds << " ms)" << std::endl;
+		this->SetMode((this->Mode + 1) % SlabProjector::NumberOfModes);
+	}
+
+	virtual void Execute(vtkObject*, unsigned long, void*) override
+	{
+		for (size_t i = 0; i < this->Slabs.size(); i++) {
+			SlabProjector::Slab& slab = this->Slabs[i];
+			double center[4] = { 0, 0, 0, 1 };
+			this->PlaneSources[i]->GetCenter(center);
+			this->Actors[i]->GetMatrix()->MultiplyPoint(center, center);
+			int first = this->ToVoxel(slab.Axis, center[slab.Axis]) - (this->Thickness - 1) / 2;
+			this->Projector->Project(slab, first, first + this->Thickness - 1, this->Mode);
+		}
+	}
+
+private:
+	static int LargestAxis(const double* from, const double* to)
+	{
+		int axis = 0;
+		for (int j = 1; j < 3; j++)
+			if (std::abs(to[j] - from[j]) > std::abs(to[axis] - from[axis]))
+				axis = j;
+		return axis;
+	}
+
+	int ToVoxel(int axis, double coordinate) const
+	{
+		return this->Projector->ToVoxel(axis,
+			(coordinate - this->Bounds[2 * axis]) / (this->Bounds[2 * axis + 1] - this->Bounds[2 * axis]));
+	}
+
+	void PrintStatus() const
+	{
+		std::cout << "Slab: " << SlabProjector::ModeName(this->Mode) << " over " << this->Thickness << " slices" << std::endl;
+	}
+
+	std::vector<vtkActor*>			Actors;
+	std::vector<vtkPlaneSource*>	PlaneSources;
+	std::vector<SlabProjector::Slab>	Slabs;
+	std::vector<vtkSmartPointer<vtkTexture>>	Textures;
+	vtkNew<vtkLookupTable>			Lookup;
+	SlabProjector*					Projector = nullptr;
+	double							Bounds[6]{ 0, 0, 0, 0, 0, 0 };
+	int								Thickness = 1;
+	int								Mode = SlabProjector::Maximum;
+};
+
+// Trilinear reslicing of the volume onto arbitrarily oriented planes.  A
+// plane is given in voxel coordinates by its origin and the steps du, dv
+// between neighbouring output pixels.  Each pixel's position relative to the
+// origin, i * du + j * dv, is cached as an integer voxel and a fraction per
+// axis; as long as du and dv stay the same, moving the plane (along its
+// normal, or anywhere) adds the origin's fraction to the cached one with a
+// carry, so no pixel is transformed again.  A rotation rebuilds the cache
+// in the same pass that samples it.  Rows are split across threads.
+class ObliqueReslicer
+{
+public:
+	struct Sample
+	{
+		int		Voxel[3];
+		float	Fraction[3];
+	};
+
+	struct Slice
+	{
+		int		Size[2]{ 0, 0 };
+		double	Origin[3]{ 0, 0, 0 };
+		double	Steps[2][3]{ { 0, 0, 0 }, { 0, 0, 0 } };	// du, dv
+		std::vector<Sample>				Samples;
+		vtkSmartPointer<vtkImageData>	Image;	// float reslice
+	};
+
+	void SetVolume(const FloatVolume* volume) { m_Volume = volume; }
+	const FloatVolume* GetVolume() const { return m_Volume; }
+
+	// Resamples slice at the given pose; false if the pose did not change.
+	bool Reslice(Slice& slice, const int size[2], const double origin[3], const double du[3], const double dv[3])
+	{
+		const double* steps[2] = { du, dv };
+		bool sameSize = size[0] == slice.Size[0] && size[1] == slice.Size[1];
+		bool sameSteps = sameSize;
+		for (int e = 0; e < 2 && sameSteps; e++)
+			for (int j = 0; j < 3; j++)
+				sameSteps = sameSteps && std::abs(steps[e][j] - slice.Steps[e][j]) < 1e-9;
+		bool sameOrigin = true;
+		for (int j = 0; j < 3; j++)
+			sameOrigin = sameOrigin && std::abs(origin[j] - slice.Origin[j]) < 1e-9;
+		if (sameSteps && sameOrigin && slice.Image)
+			return false;
+
+		auto start = std::chrono::steady_clock::now();
+		if (!sameSize || !slice.Image) {
+			slice.Image = vtkSmartPointer<vtkImageData>::New();
+			slice.Image->SetDimensions(size[0], size[1], 1);
+			slice.Image->AllocateScalars(VTK_FLOAT, 1);
+			slice.Samples.resize((size_t)size[0] * size[1]);
+			std::copy(size, size + 2, slice.Size);
+		}
+		std::copy(origin, origin + 3, slice.Origin);
+		for (int e = 0; e < 2; e++)
+			std::copy(steps[e], steps[e] + 3, slice.Steps[e]);
+
+		if (sameSteps) {
+			this->Resample<false>(slice);
+			this->Shifts++;
+		}
+		else {
+			this->Resample<true>(slice);
+			this->Rebuilds++;
+		}
+		slice.Image->Modified();
+		this->Milliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		return true;
+	}
+
+	long	Rebuilds = 0;		// reslices that recomputed the cached positions
+	long	Shifts = 0;			// reslices that reused them
+	double	Milliseconds = 0;	// time spent in both
+
+private:
+	template <bool Rebuild>
+	void Resample(Slice& slice)
+	{
+		const FloatVolume& volume = *m_Volume;
+		const int width = slice.Size[0];
+		const int* dims = volume.Dims;
+		const vtkIdType strideY = volume.Stride(1), strideZ = volume.Stride(2);
+		const float* voxels = volume.Voxels.data();
+		const float background = (float)volume.Range[0];
+		int base[3];
+		float baseFraction[3];
+		for (int j = 0; j < 3; j++) {
+			double whole = std::floor(slice.Origin[j]);
+			base[j] = (int)whole;
+			baseFraction[j] = (float)(slice.Origin[j] - whole);
+		}
+		float* image = static_cast<float*>(slice.Image->GetScalarPointer());
+		vtkSMPTools::For(0, slice.Size[1], [&](vtkIdType firstRow, vtkIdType lastRow) {
+			for (vtkIdType r = firstRow; r < lastRow; r++) {
+				Sample* samples = slice.Samples.data() + r * width;
+				if (Rebuild) {
+					for (int i = 0; i < width; i++) {
+						for (int j = 0; j < 3; j++) {
+							double q = i * slice.Steps[0][j] + r * slice.Steps[1][j];
+							double whole = std::floor(q);
+							samples[i].Voxel[j] = (int)whole;
+							samples[i].Fraction[j] = (float)(q - whole);
+						}
+					}
+				}
+				float* out = image + r * width;
+				for (int i = 0; i < width; i++) {
+					int x[3];
+					float f[3];
+					bool inside = true;
+					for (int j = 0; j < 3; j++) {
+						x[j] = samples[i].Voxel[j] + base[j];
+						f[j] = samples[i].Fraction[j] + baseFraction[j];
+						if (f[j] >= 1.0f) {
+							f[j] -= 1.0f;
+							x[j]++;
+						}
+						// A sample exactly on the last voxel plane, where the
+						// faces at the box's upper bounds sit, interpolates
+						// from the cell below it.
+						if (x[j] == dims[j] - 1 && f[j] == 0.0f && x[j] > 0) {
+							x[j]--;
+							f[j] = 1.0f;
+						}
+						inside = inside && x[j] >= 0 && x[j] < dims[j] - 1;
+					}
+					if (!inside) {
+						out[i] = background;
+						continue;
+					}
+					const float* v = voxels + x[0] + x[1] * strideY + x[2] * strideZ;
+					float c00 = v[0] + f[0] * (v[1] - v[0]);
+					float c10 = v[strideY] + f[0] * (v[strideY + 1] - v[strideY]);
+					float c01 = v[strideZ] + f[0] * (v[strideZ + 1] - v[strideZ]);
+					float c11 = v[strideY + strideZ] + f[0] * (v[strideY + strideZ + 1] - v[strideY + strideZ]);
+					float c0 = c00 + f[1] * (c10 - c00);
+					float c1 = c01 + f[1] * (c11 - c01);
+					out[i] = c0 + f[2] * (c1 - c0);
+				}
+			}
+		});
+	}
+
+	const FloatVolume*	m_Volume = nullptr;
+};
+
+// Textures every face with the volume resliced on the face's actual pose:
+// its plane source corners go through the actor's matrix, UserTransform
+// included, before each frame, and a face is resampled only if that moved
+// it.  The box bounds are mapped onto the volume's extent.
+class vtkObliqueResliceCallback : public vtkCommand
+{
+public:
+	static vtkObliqueResliceCallback* New() { return new vtkObliqueResliceCallback; }
+
+	void SetFaces(vtkRenderer* renderer, const std::vector<vtkActor*>& actors,
+		const std::vector<vtkPlaneSource*>& planeSources, const double bounds[6], ObliqueReslicer* reslicer)
+	{
+		this->Actors = actors;
+		this->PlaneSources = planeSources;
+		std::copy(bounds, bounds + 6, this->Bounds);
+		this->Reslicer = reslicer;
+		const double* range = reslicer->GetVolume()->Range;
+		this->Lookup->SetTableRange(range[0], range[1]);
+		this->Lookup->SetHueRange(0, 0);
+		this->Lookup->SetSaturationRange(0, 0);
+		this->Lookup->SetValueRange(0, 1);
+		this->Lookup->Build();
+		this->Slices.resize(actors.size());
+		this->Textures.resize(actors.size());
+		for (size_t i = 0; i < actors.size(); i++) {
+			this->Textures[i] = vtkSmartPointer<vtkTexture>::New();
+			this->Textures[i]->SetLookupTable(this->Lookup);
+			this->Textures[i]->MapColorScalarsThroughLookupTableOn();
+			this->Textures[i]->InterpolateOn();
+			actors[i]->SetTexture(this->Textures[i]);
+		}
+		renderer->AddObserver(vtkCommand::StartEvent, this);
+	}
+
+	void PrintStatistics() const
+	{
+		const ObliqueReslicer* r = this->Reslicer;
+		long reslices = r->Rebuilds + r->Shifts;
+		std::cout << "Reslice: " << r->Rebuilds << " rotated / " << r->Shifts << " moved faces";
+		if (reslices > 0)
+			std::cout << ", " << r->Milliseconds / reslices << " ms each";
+		std::cout << std::endl;
+	}
+
+	virtual void Execute(vtkObject*, unsigned long, void*) override
+	{
+		for (size_t i = 0; i < this->Slices.size(); i++) {
+			double corners[3][4];
+			this->PlaneSources[i]->GetOrigin(corners[0]);
+			this->PlaneSources[i]->GetPoint1(corners[1]);
+			this->PlaneSources[i]->GetPoint2(corners[2]);
+			vtkMatrix4x4* matrix = this->Actors[i]->GetMatrix();
+			for (int c = 0; c < 3; c++) {
+				corners[c][3] = 1.0;
+				matrix->MultiplyPoint(corners[c], corners[c]);
+				this->ToVoxel(corners[c]);
+			}
+			// One output pixel per voxel along each edge, so the texture
+			// keeps the resolution of the data whatever the orientation.
+			int size[2];
+			double steps[2][3];
+			for (int e = 0; e < 2; e++) {
+				double edge[3];
+				vtkMath::Subtract(corners[e + 1], corners[0], edge);
+				size[e] = std::min(std::max((int)std::lround(vtkMath::Norm(edge)) + 1, 2), this->MaxSize);
+				for (int j = 0; j < 3; j++)
+					steps[e][j] = edge[j] / (size[e] - 1);
+			}
+			ObliqueReslicer::Slice& slice = this->Slices[i];
+			bool newImage = slice.Image == nullptr || size[0] != slice.Size[0] || size[1] != slice.Size[1];
+			if (this->Reslicer->Reslice(slice, size, corners[0], steps[0], steps[1]) && newImage)
+				this->Textures[i]->SetInputData(slice.Image);
+		}
+	}
+
+	int		MaxSize = 1024;		// output pixels per face edge at most
+
+private:
+	// World coordinates to continuous voxel indices.
+	void ToVoxel(double* point) const
+	{
+		for (int j = 0; j < 3; j++)
+			point[j] = (point[j] - this->Bounds[2 * j]) / (this->Bounds[2 * j + 1] - this->Bounds[2 * j])
+			* (this->Reslicer->GetVolume()->Dims[j] - 1);
+	}
+
+	std::vector<vtkActor*>			Actors;
+	std::vector<vtkPlaneSource*>	PlaneSources;
+	std::vector<ObliqueReslicer::Slice>	Slices;
+	std::vector<vtkSmartPointer<vtkTexture>>	Textures;
+	vtkNew<vtkLookupTable>			Lookup;
+	ObliqueReslicer*				Reslicer = nullptr;
+	double							Bounds[6]{ 0, 0, 0, 0, 0, 0 };
+};
+
 int test4(int argc, char* argv[]);
 int main(int argc, char* argv[])
 {
@@ -408,8 +1444,96 @@ int main(int argc, char* argv[])
 
 static unsigned char bkg[4] = { 51, 77, 102, 255 };
 
+static void FaceSortKeyPress(vtkObject* caller, unsigned long, void* clientData, void*)
+{
+	vtkRenderWindowInteractor* iren = vtkRenderWindowInteractor::SafeDownCast(caller);
+	std::string key = iren->GetKeySym();
+	if (key == "t") // Press 't' to cycle the translucency modes
+	{
+		static_cast<vtkFaceSortCallback*>(clientData)->NextMode();
+		iren->Render();
+	}
+}
+
+static void ResliceKeyPress(vtkObject* caller, unsigned long, void* clientData, void*)
+{
+	vtkRenderWindowInteractor* iren = vtkRenderWindowInteractor::SafeDownCast(caller);
+	std::string key = iren->GetKeySym();
+	if (key == "o") // Press 'o' to print reslicing statistics
+		static_cast<vtkObliqueResliceCallback*>(clientData)->PrintStatistics();
+}
+
+static void SlabKeyPress(vtkObject* caller, unsigned long, void* clientData, void*)
+{
+	vtkRenderWindowInteractor* iren = vtkRenderWindowInteractor::SafeDownCast(caller);
+	vtkSlabProjectionCallback* slabs = static_cast<vtkSlabProjectionCallback*>(clientData);
+	std::string key = iren->GetKeySym();
+	if (key == "x") // Press 'x' to cycle MIP / MinIP / mean
+		slabs->NextMode();
+	else if (key == "bracketright") // ']' doubles the slab thickness, '[' halves it
+		slabs->SetThickness(slabs->GetThickness() * 2);
+	else if (key == "bracketleft")
+		slabs->SetThickness(slabs->GetThickness() / 2);
+	else
+		return;
+	iren->Render();
+}
+
+struct DemoOptions
+{
+	std::string	volumeFile;					// --volume <file.mhd>: data projected onto the faces
+	int			slabThickness = 1;			// --slab <slices>: thickness of each face's slab
+	int			slabMode = SlabProjector::Maximum;	// --slab-mode <max|min|mean>
+	bool		reslice = false;			// --reslice: show the volume on each face's actual pose instead
+};
+
+// Reads an option value; false unless all of text is an int.
+static bool ParseNumber(const char* text, int& value)
+{
+	char* end = nullptr;
+	errno = 0;
+	const long number = std::strtol(text, &end, 10);
+	value = (int)number;
+	return end != text && *end == '\0' && errno == 0 && number >= INT_MIN && number <= INT_MAX;
+}
+
+static bool ParseOptions(int argc, char* argv[], DemoOptions& options)
+{
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		bool valid = true;
+		if (arg == "--volume" && hasValue)
+			options.volumeFile = argv[++i];
+		else if (arg == "--slab" && hasValue) {
+			valid = ParseNumber(argv[++i], options.slabThickness);
+			options.slabThickness = std::max(1, options.slabThickness);
+		}
+		else if (arg == "--reslice")
+			options.reslice = true;
+		else if (arg == "--slab-mode" && hasValue) {
+			std::string mode = argv[++i];
+			options.slabMode = mode == "min" ? SlabProjector::Minimum :
+				mode == "mean" ? SlabProjector::Mean : SlabProjector::Maximum;
+		}
+		else {
+			std::cerr << "Unknown option " << arg << std::endl;
+			return false;
+		}
+		if (!valid) {
+			std::cerr << "Bad value for " << arg << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
 int test4(int argc, char* argv[])
 {
+	DemoOptions options;
+	if (!ParseOptions(argc, argv, options))
+		return EXIT_FAILURE;
+
 	vtkObject::GlobalWarningDisplayOff();
 
 	vtkNew<vtkNamedColors> colors;
@@ -425,6 +1549,9 @@ int test4(int argc, char* argv[])
 
 	aRenderer->SetBackground(colors->GetColor3d("BkgColor").GetData());
 	renWin->SetSize(640, 480);
+	// Depth peeling, one of the translucency modes, needs alpha planes and no MSAA.
+	renWin->SetAlphaBitPlanes(1);
+	renWin->SetMultiSamples(0);
 
 	std::array<vtkNew<vtkPlaneSource>, NUMOFPLANES> planes;
 	std::array<vtkNew<vtkPolyDataMapper>, NUMOFPLANES> polyDataMapperList;
@@ -522,6 +1649,50 @@ int test4(int argc, char* argv[])
 	style->SetPlanes(actors);
 	iren->SetInteractorStyle(style);
 
+	std::vector<vtkPlaneSource*>	planeSources(planes.begin(), planes.end());
+	// Order the translucent faces back to front each frame instead of peeling.
+	vtkNew<vtkFaceSortCallback> faceSort;
+	faceSort->SetFaces(aRenderer, actors, planeSources);
+	faceSort->SetMode(vtkFaceSortCallback::Sorted);
+	vtkNew<vtkCallbackCommand> faceSortKeys;
+	faceSortKeys->SetCallback(FaceSortKeyPress);
+	faceSortKeys->SetClientData(faceSort);
+	iren->AddObserver(vtkCommand::KeyPressEvent, faceSortKeys);
+
+	// Face resolution follows each face's size on screen.
+	vtkNew<vtkPlaneTessellationCallback> tessellation;
+	tessellation->SetFaces(aRenderer, actors, planeSources);
+
+	// Each face shows a thick slab of the volume around its position, or
+	// with --reslice the volume cut along the face wherever it is turned.
+	FloatVolume volume;
+	SlabProjector projector;
+	ObliqueReslicer reslicer;
+	vtkNew<vtkSlabProjectionCallback> slabs;
+	vtkNew<vtkObliqueResliceCallback> reslices;
+	vtkNew<vtkCallbackCommand> volumeKeys;
+	if (!options.volumeFile.empty()) {
+		if (!volume.Load(options.volumeFile)) {
+			std::cerr << "Cannot read volume " << options.volumeFile << std::endl;
+			return EXIT_FAILURE;
+		}
+		if (options.reslice) {
+			reslicer.SetVolume(&volume);
+			reslices->SetFaces(aRenderer, actors, planeSources, pBounds, &reslicer);
+			volumeKeys->SetCallback(ResliceKeyPress);
+			volumeKeys->SetClientData(reslices);
+		}
+		else {
+			projector.SetVolume(&volume);
+			slabs->SetFaces(aRenderer, actors, planeSources, pBounds, &projector);
+			slabs->SetThickness(options.slabThickness);
+			slabs->SetMode(options.slabMode);
+			volumeKeys->SetCallback(SlabKeyPress);
+			volumeKeys->SetClientData(slabs);
+		}
+		iren->AddObserver(vtkCommand::KeyPressEvent, volumeKeys);
+	}
+
 	// interact with data
 	iren->Initialize();
 	iren->Start();
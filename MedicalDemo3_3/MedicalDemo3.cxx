@@ -7,18 +7,20 @@
 #include <array>
 #include <vector>
 #include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <chrono>
+#include <string>
 #include <vtkObject.h>
 #include <vtkSmartPointer.h>
 #include <vtkActor.h>
 #include <vtkCamera.h>
 #include <vtkImageActor.h>
-#include <vtkImageMapToColors.h>
 #include <vtkImageMapper3D.h>
 #include <vtkLookupTable.h>
 #include <vtkMetaImageReader.h>
 #include <vtkNamedColors.h>
 #include <vtkNew.h>
-#include <vtkOutlineFilter.h>
 #include <vtkPolyDataMapper.h>
 #include <vtkProperty.h>
 #include <vtkRenderWindow.h>
@@ -31,6 +33,7 @@
 #include <vtkVertexGlyphFilter.h>
 #include <vtkImageData.h>
 #include <vtkObjectFactory.h>
+#include <vtkPropCollection.h>
 #include <vtkPropPicker.h>
 #include <vtkCellPicker.h>
 #include <vtkCellData.h>
@@ -41,6 +44,12 @@
 #include <vtkTransform.h>
 #include <vtkTransformFilter.h>
 #include <vtkPlaneSource.h>
+#include <vtkCallbackCommand.h>
+#include <vtkCommand.h>
+#include <vtkMath.h>
+#include <vtkMatrix4x4.h>
+#include <vtkSMPTools.h>
+#include <vtkTexture.h>
 
 // vtkFlyingEdges3D was introduced in VTK >= 8.2
 #if VTK_MAJOR_VERSION >= 9 || (VTK_MAJOR_VERSION >= 8 && VTK_MINOR_VERSION >= 2)
@@ -76,9 +85,8 @@ public:
 	{
 		int clickPos[2];
 		this->Interactor->GetEventPosition(clickPos);
-		vtkSmartPointer<vtkPropPicker> picker = vtkSmartPointer<vtkPropPicker>::New();
-		picker->Pick(clickPos[0], clickPos[1], 0, this->Renderer);
-		this->m_pTarget = vtkActor::SafeDownCast(picker->GetActor());
+		m_Picker->Pick(clickPos[0], clickPos[1], 0, this->Renderer);
+		this->m_pTarget = vtkActor::SafeDownCast(m_Picker->GetActor());
 
 		if (this->m_pTarget)
 		{
@@ -303,6 +311,7 @@ private:
 	vtkSmartPointer<vtkCustomInteractorStyleCamera> CameraStyle;
 	vtkSmartPointer<vtkInteractorStyle> CurrentStyle;
 	vtkSmartPointer<vtkRenderer>	Renderer = nullptr;
+	vtkNew<vtkPropPicker>			m_Picker;
 	vtkActor*						m_pTarget = nullptr;
 	std::array<vtkSmartPointer<vtkTransform>, NUMOFPLANES>	translations = { nullptr };
 	std::vector<vtkActor*>			m_pActors;
@@ -358,6 +367,518 @@ vtkStandardNewMacro(vtkCustomInteractorStyleCamera);
 
 
 
+// Draws the semi-transparent box faces back to front without depth peeling.
+// The faces are the sides of a convex box, so a face whose outward normal
+// points away from the camera is never in front of one that points toward
+// it: the faces are ordered back faces first, then by decreasing distance,
+// and re-added to the renderer in that order before each frame.
+// Frame times are accumulated per mode so the sort can be compared with
+// depth peeling ('t' cycles the modes).
+class vtkFaceSortCallback : public vtkCommand
+{
+public:
+	enum Mode { Sorted, DepthPeeling, Unsorted, NumberOfModes };
+
+	static vtkFaceSortCallback* New() { return new vtkFaceSortCallback; }
+
+	void SetFaces(vtkRenderer* renderer, const std::vector<vtkActor*>& actors,
+		const std::vector<vtkPlaneSource*>& planeSources)
+	{
+		this->Renderer = renderer;
+		this->Actors = actors;
+		this->PlaneSources = planeSources;
+		this->Order.resize(actors.size());
+		this->Keys.resize(actors.size());
+		for (size_t i = 0; i < actors.size(); i++)
+			this->Order[i] = (int)i;
+		renderer->AddObserver(vtkCommand::StartEvent, this);
+		renderer->AddObserver(vtkCommand::EndEvent, this);
+	}
+
+	void SetMode(int mode)
+	{
+		this->CurrentMode = mode;
+		this->Renderer->SetUseDepthPeeling(mode == DepthPeeling);
+		this->Renderer->SetMaximumNumberOfPeels(8);
+		this->Renderer->SetOcclusionRatio(0.0);
+		std::cout << "Translucency: " << ModeName(mode) << std::endl;
+	}
+
+	void NextMode()
+	{
+		for (int mode = 0; mode < NumberOfModes; mode++) {
+			if (this->Frames[mode] > 0)
+				std::cout << "  " << ModeName(mode) << ": " << 1000 * this->Seconds[mode] / this->Frames[mode]
+				<< " ms/frame over " << this->Frames[mode] << " frames" << std::endl;
+		}
+		this->SetMode((this->CurrentMode + 1) % NumberOfModes);
+	}
+
+	static const char* ModeName(int mode)
+	{
+		static const char* names[NumberOfModes] = { "sorted faces", "depth peeling", "unsorted" };
+		return names[mode];
+	}
+
+	virtual void Execute(vtkObject*, unsigned long eventId, void*) override
+	{
+		if (eventId == vtkCommand::EndEvent) {
+			this->Seconds[this->CurrentMode] += std::chrono::duration<double>(std::chrono::steady_clock::now() - this->FrameStart).count();
+			this->Frames[this->CurrentMode]++;
+			return;
+		}
+		this->FrameStart = std::chrono::steady_clock::now();
+		if (this->CurrentMode == Sorted)
+			this->SortFaces();
+	}
+
+private:
+	void SortFaces()
+	{
+		double eye[3];
+		this->Renderer->GetActiveCamera()->GetPosition(eye);
+
+		double boxCenter[3] = { 0, 0, 0 };
+		const size_t numFaces = this->Actors.size();
+		for (size_t i = 0; i < numFaces; i++) {
+			double* center = this->Actors[i]->GetCenter();
+			for (int n = 0; n < 3; n++)
+				boxCenter[n] += center[n] / numFaces;
+		}
+
+		for (size_t i = 0; i < numFaces; i++) {
+			double center[3], normal[3], world[3];
+			std::copy(this->Actors[i]->GetCenter(), this->Actors[i]->GetCenter() + 3, center);
+			this->PlaneSources[i]->GetNormal(normal);
+			vtkMatrix4x4* matrix = this->Actors[i]->GetMatrix();
+			for (int r = 0; r < 3; r++)
+				world[r] = matrix->GetElement(r, 0) * normal[0] + matrix->GetElement(r, 1) * normal[1] +
+				matrix->GetElement(r, 2) * normal[2];
+			double toEye[3], outward[3];
+			vtkMath::Subtract(eye, center, toEye);
+			vtkMath::Subtract(center, boxCenter, outward);
+			double facing = vtkMath::Dot(world, toEye);
+			if (vtkMath::Dot(world, outward) < 0)
+				facing = -facing;
+			this->Keys[i].first = facing > 0 ? 1 : 0;
+			this->Keys[i].second = -vtkMath::Dot(toEye, toEye);
+		}
+
+		std::sort(this->Order.begin(), this->Order.end(),
+			[this](int a, int b) { return this->Keys[a] < this->Keys[b]; });
+		this->ReorderProps();
+	}
+
+	// Puts the faces in Order into the slots of the renderer's prop list
+	// that faces hold now (the styles re-add dragged faces, so these move).
+	// Removing and re-adding the faces instead would release their graphics
+	// resources every frame.
+	void ReorderProps()
+	{
+		vtkPropCollection* props = this->Renderer->GetViewProps();
+		this->Slots.clear();
+		vtkCollectionSimpleIterator it;
+		props->InitTraversal(it);
+		int slot = 0;
+		while (vtkProp* prop = props->GetNextProp(it)) {
+			auto face = std::find(this->Actors.begin(), this->Actors.end(), prop);
+			if (face != this->Actors.end())
+				this->Slots.emplace_back(slot, (int)(face - this->Actors.begin()));
+			slot++;
+		}
+		if (this->Slots.size() != this->Actors.size())
+			return;
+		for (size_t n = 0; n < this->Slots.size(); n++)
+			if (this->Slots[n].second != this->Order[n])
+				props->ReplaceItem(this->Slots[n].first, this->Actors[this->Order[n]]);
+	}
+
+	vtkRenderer*					Renderer = nullptr;
+	std::vector<vtkActor*>			Actors;
+	std::vector<vtkPlaneSource*>	PlaneSources;
+	std::vector<int>				Order;
+	std::vector<std::pair<int, double>>	Keys;
+	std::vector<std::pair<int, int>>	Slots;			// prop list slot and the face in it
+	int								CurrentMode = Sorted;
+	double							Seconds[NumberOfModes]{ 0, 0, 0 };
+	long							Frames[NumberOfModes]{ 0, 0, 0 };
+	std::chrono::steady_clock::time_point	FrameStart;
+};
+
+// Keeps the face tessellation proportional to the faces' size on screen.
+// Before each frame the three corners of every plane are projected, and
+// each in-plane edge gets one cell per PixelsPerCell pixels (at least one,
+// at most MaxResolution).  A face is re-tessellated only when its target
+// leaves the band [resolution / Hysteresis, resolution * Hysteresis], so
+// small camera moves do not rebuild the geometry every frame.
+class vtkPlaneTessellationCallback : public vtkCommand
+{
+public:
+	static vtkPlaneTessellationCallback* New() { return new vtkPlaneTessellationCallback; }
+
+	// actors[i] draws planeSources[i]; its matrix maps the plane to world space.
+	void SetFaces(vtkRenderer* renderer, const std::vector<vtkActor*>& actors,
+		const std::vector<vtkPlaneSource*>& planeSources)
+	{
+		this->Renderer = renderer;
+		this->Actors = actors;
+		this->PlaneSources = planeSources;
+		renderer->AddObserver(vtkCommand::StartEvent, this);
+	}
+
+	// Total number of quads currently generated for all faces.
+	int GetNumberOfCells() const
+	{
+		int cells = 0;
+		for (vtkPlaneSource* planeSource : this->PlaneSources)
+			cells += planeSource->GetXResolution() * planeSource->GetYResolution();
+		return cells;
+	}
+
+	virtual void Execute(vtkObject*, unsigned long, void*) override
+	{
+		vtkCamera* camera = this->Renderer->GetActiveCamera();
+		vtkMatrix4x4* projection = camera->GetCompositeProjectionTransformMatrix(
+			this->Renderer->GetTiledAspectRatio(), -1, 1);
+		const int* size = this->Renderer->GetSize();
+		for (size_t i = 0; i < this->PlaneSources.size(); i++) {
+			vtkPlaneSource* planeSource = this->PlaneSources[i];
+			double corners[3][4], display[3][2];
+			planeSource->GetOrigin(corners[0]);
+			planeSource->GetPoint1(corners[1]);
+			planeSource->GetPoint2(corners[2]);
+			bool behindEye = false;
+			for (int c = 0; c < 3; c++) {
+				corners[c][3] = 1.0;
+				this->Actors[i]->GetMatrix()->MultiplyPoint(corners[c], corners[c]);
+				projection->MultiplyPoint(corners[c], corners[c]);
+				if (corners[c][3] <= 0) {
+					behindEye = true;
+					break;
+				}
+				display[c][0] = 0.5 * size[0] * corners[c][0] / corners[c][3];
+				display[c][1] = 0.5 * size[1] * corners[c][1] / corners[c][3];
+			}
+			int target[2] = { this->MaxResolution, this->MaxResolution };
+			if (!behindEye) {
+				// Point1 - Origin is the X resolution edge, Point2 - Origin the Y edge.
+				for (int e = 0; e < 2; e++) {
+					double pixels = std::hypot(display[e + 1][0] - display[0][0], display[e + 1][1] - display[0][1]);
+					double cells = std::ceil(pixels / (this->PixelsPerCell * this->Coarsening));
+					target[e] = (int)std::min(std::max(cells, 1.0), (double)this->MaxResolution);
+				}
+			}
+			int current[2] = { planeSource->GetXResolution(), planeSource->GetYResolution() };
+			bool update = false;
+			for (int e = 0; e < 2; e++)
+				update = update || target[e] > current[e] * this->Hysteresis || target[e] * this->Hysteresis < current[e]
+				|| ((target[e] == 1 || target[e] == this->MaxResolution) && target[e] != current[e]);
+			if (update) {
+				planeSource->SetResolution(target[0], target[1]);
+				this->Updates++;
+			}
+		}
+	}
+
+	double	PixelsPerCell = 8.0;	// screen pixels per cell edge
+	double	Coarsening = 1.0;		// multiplies PixelsPerCell while interacting
+	double	Hysteresis = 1.5;		// relative change needed to re-tessellate
+	int		MaxResolution = 128;
+	long	Updates = 0;			// number of faces re-tessellated so far
+
+private:
+	vtkRenderer*					Renderer = nullptr;
+	std::vector<vtkActor*>			Actors;
+	std::vector<vtkPlaneSource*>	PlaneSources;
+};
+
+// A single-component volume read from a MetaImage file and kept as floats,
+// x fastest, for the reslicing below.
+struct FloatVolume
+{
+	bool Load(const std::string& fileName)
+	{
+		vtkNew<vtkMetaImageReader> reader;
+		if (!reader->CanReadFile(fileName.c_str()))
+			return false;
+		reader->SetFileName(fileName.c_str());
+		reader->Update();
+		vtkImageData* image = reader->GetOutput();
+		if (image->GetNumberOfScalarComponents() != 1)
+			return false;
+		image->GetDimensions(Dims);
+		const size_t count = (size_t)Dims[0] * Dims[1] * Dims[2];
+		Voxels.resize(count);
+		switch (image->GetScalarType()) {
+			vtkTemplateMacro(CopyVoxels(static_cast<const VTK_TT*>(image->GetScalarPointer()), count));
+		default:
+			return false;
+		}
+		auto range = std::minmax_element(Voxels.begin(), Voxels.end());
+		Range[0] = *range.first;
+		Range[1] = *range.second;
+		return true;
+	}
+
+	vtkIdType Stride(int axis) const
+	{
+		return axis == 0 ? 1 : axis == 1 ? (vtkIdType)Dims[0] : (vtkIdType)Dims[0] * Dims[1];
+	}
+
+	template <class T>
+	void CopyVoxels(const T* scalars, size_t count)
+	{
+		vtkSMPTools::For(0, (vtkIdType)count, [&](vtkIdType first, vtkIdType last) {
+			for (vtkIdType n = first; n < last; n++)
+				Voxels[n] = (float)scalars[n];
+		});
+	}
+
+	std::vector<float>	Voxels;
+	int					Dims[3]{ 0, 0, 0 };
+	double				Range[2]{ 0, 1 };
+};
+
+// Trilinear reslicing of the volume onto arbitrarily oriented planes.  A
+// plane is given in voxel coordinates by its origin and the steps du, dv
+// between neighbouring output pixels.  Each pixel's position relative to the
+// origin, i * du + j * dv, is cached as an integer voxel and a fraction per
+// axis; as long as du and dv stay the same, moving the plane (along its
+// normal, or anywhere) adds the origin's fraction to the cached one with a
+// carry, so no pixel is transformed again.  A rotation rebuilds the cache
+// in the same pass that samples it.  Rows are split across threads.
+class ObliqueReslicer
+{
+public:
+	struct Sample
+	{
+		int		Voxel[3];
+		float	Fraction[3];
+	};
+
+	struct Slice
+	{
+		int		Size[2]{ 0, 0 };
+		double	Origin[3]{ 0, 0, 0 };
+		double	Steps[2][3]{ { 0, 0, 0 }, { 0, 0, 0 } };	// du, dv
+		std::vector<Sample>				Samples;
+		vtkSmartPointer<vtkImageData>	Image;	// float reslice
+	};
+
+	void SetVolume(const FloatVolume* volume) { m_Volume = volume; }
+	const FloatVolume* GetVolume() const { return m_Volume; }
+
+	// Resamples slice at the given pose; false if the pose did not change.
+	bool Reslice(Slice& slice, const int size[2], const double origin[3], const double du[3], const double dv[3])
+	{
+		const double* steps[2] = { du, dv };
+		bool sameSize = size[0] == slice.Size[0] && size[1] == slice.Size[1];
+		bool sameSteps = sameSize;
+		for (int e = 0; e < 2 && sameSteps; e++)
+			for (int j = 0; j < 3; j++)
+				sameSteps = sameSteps && std::abs(steps[e][j] - slice.Steps[e][j]) < 1e-9;
+		bool sameOrigin = true;
+		for (int j = 0; j < 3; j++)
+			sameOrigin = sameOrigin && std::abs(origin[j] - slice.Origin[j]) < 1e-9;
+		if (sameSteps && sameOrigin && slice.Image)
+			return false;
+
+		auto start = std::chrono::steady_clock::now();
+		if (!sameSize || !slice.Image) {
+			slice.Image = vtkSmartPointer<vtkImageData>::New();
+			slice.Image->SetDimensions(size[0], size[1], 1);
+			slice.Image->AllocateScalars(VTK_FLOAT, 1);
+			slice.Samples.resize((size_t)size[0] * size[1]);
+			std::copy(size, size + 2, slice.Size);
+		}
+		std::copy(origin, origin + 3, slice.Origin);
+		for (int e = 0; e < 2; e++)
+			std::copy(steps[e], steps[e] + 3, slice.Steps[e]);
+
+		if (sameSteps) {
+			this->Resample<false>(slice);
+			this->Shifts++;
+		}
+		else {
+			this->Resample<true>(slice);
+			this->Rebuilds++;
+		}
+		slice.Image->Modified();
+		this->Milliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		return true;
+	}
+
+	long	Rebuilds = 0;		// reslices that recomputed the cached positions
+	long	Shifts = 0;			// reslices that reused them
+	double	Milliseconds = 0;	// time spent in both
+
+private:
+	template <bool Rebuild>
+	void Resample(Slice& slice)
+	{
+		const FloatVolume& volume = *m_Volume;
+		const int width = slice.Size[0];
+		const int* dims = volume.Dims;
+		const vtkIdType strideY = volume.Stride(1), strideZ = volume.Stride(2);
+		const float* voxels = volume.Voxels.data();
+		const float background = (float)volume.Range[0];
+		int base[3];
+		float baseFraction[3];
+		for (int j = 0; j < 3; j++) {
+			double whole = std::floor(slice.Origin[j]);
+			base[j] = (int)whole;
+			baseFraction[j] = (float)(slice.Origin[j] - whole);
+		}
+		float* image = static_cast<float*>(slice.Image->GetScalarPointer());
+		vtkSMPTools::For(0, slice.Size[1], [&](vtkIdType firstRow, vtkIdType lastRow) {
+			for (vtkIdType r = firstRow; r < lastRow; r++) {
+				Sample* samples = slice.Samples.data() + r * width;
+				if (Rebuild) {
+					for (int i = 0; i < width; i++) {
+						for (int j = 0; j < 3; j++) {
+							double q = i * slice.Steps[0][j] + r * slice.Steps[1][j];
+							double whole = std::floor(q);
+							samples[i].Voxel[j] = (int)whole;
+							samples[i].Fraction[j] = (float)(q - whole);
+						}
+					}
+				}
+				float* out = image + r * width;
+				for (int i = 0; i < width; i++) {
+					int x[3];
+					float f[3];
+					bool inside = true;
+					for (int j = 0; j < 3; j++) {
+						x[j] = samples[i].Voxel[j] + base[j];
+						f[j] = samples[i].Fraction[j] + baseFraction[j];
+						if (f[j] >= 1.0f) {
+							f[j] -= 1.0f;
+							x[j]++;
+						}
+						// A sample exactly on the last voxel plane, where the
+						// faces at the box's upper bounds sit, interpolates
+						// from the cell below it.
+						if (x[j] == dims[j] - 1 && f[j] == 0.0f && x[j] > 0) {
+							x[j]--;
+							f[j] = 1.0f;
+						}
+						inside = inside && x[j] >= 0 && x[j] < dims[j] - 1;
+					}
+					if (!inside) {
+						out[i] = background;
+						continue;
+					}
+					const float* v = voxels + x[0] + x[1] * strideY + x[2] * strideZ;
+					float c00 = v[0] + f[0] * (v[1] - v[0]);
+					float c10 = v[strideY] + f[0] * (v[strideY + 1] - v[strideY]);
+					float c01 = v[strideZ] + f[0] * (v[strideZ + 1] - v[strideZ]);
+					float c11 = v[strideY + strideZ] + f[0] * (v[strideY + strideZ + 1] - v[strideY + strideZ]);
+					float c0 = c00 + f[1] * (c10 - c00);
+					float c1 = c01 + f[1] * (c11 - c01);
+					out[i] = c0 + f[2] * (c1 - c0);
+				}
+			}
+		});
+	}
+
+	const FloatVolume*	m_Volume = nullptr;
+};
+
+// Textures every face with the volume resliced on the face's actual pose:
+// its plane source corners go through the actor's matrix, UserTransform
+// included, before each frame, and a face is resampled only if that moved
+// it.  The box bounds are mapped onto the volume's extent.
+class vtkObliqueResliceCallback : public vtkCommand
+{
+public:
+	static vtkObliqueResliceCallback* New() { return new vtkObliqueResliceCallback; }
+
+	void SetFaces(vtkRenderer* renderer, const std::vector<vtkActor*>& actors,
+		const std::vector<vtkPlaneSource*>& planeSources, const double bounds[6], ObliqueReslicer* reslicer)
+	{
+		this->Actors = actors;
+		this->PlaneSources = planeSources;
+		std::copy(bounds, bounds + 6, this->Bounds);
+		this->Reslicer = reslicer;
+		const double* range = reslicer->GetVolume()->Range;
+		this->Lookup->SetTableRange(range[0], range[1]);
+		this->Lookup->SetHueRange(0, 0);
+		this->Lookup->SetSaturationRange(0, 0);
+		this->Lookup->SetValueRange(0, 1);
+		this->Lookup->Build();
+		this->Slices.resize(actors.size());
+		this->Textures.resize(actors.size());
+		for (size_t i = 0; i < actors.size(); i++) {
+			this->Textures[i] = vtkSmartPointer<vtkTexture>::New();
+			this->Textures[i]->SetLookupTable(this->Lookup);
+			this->Textures[i]->MapColorScalarsThroughLookupTableOn();
+			this->Textures[i]->InterpolateOn();
+			actors[i]->SetTexture(this->Textures[i]);
+		}
+		renderer->AddObserver(vtkCommand::StartEvent, this);
+	}
+
+	void PrintStatistics() const
+	{
+		const ObliqueReslicer* r = this->Reslicer;
+		long reslices = r->Rebuilds + r->Shifts;
+		std::cout << "Reslice: " << r->Rebuilds << " rotated / " << r->Shifts << " moved faces";
+		if (reslices > 0)
+			std::cout << ", " << r->Milliseconds / reslices << " ms each";
+		std::cout << std::endl;
+	}
+
+	virtual void Execute(vtkObject*, unsigned long, void*) override
+	{
+		for (size_t i = 0; i < this->Slices.size(); i++) {
+			double corners[3][4];
+			this->PlaneSources[i]->GetOrigin(corners[0]);
+			this->PlaneSources[i]->GetPoint1(corners[1]);
+			this->PlaneSources[i]->GetPoint2(corners[2]);
+			vtkMatrix4x4* matrix = this->Actors[i]->GetMatrix();
+			for (int c = 0; c < 3; c++) {
+				corners[c][3] = 1.0;
+				matrix->MultiplyPoint(corners[c], corners[c]);
+				this->ToVoxel(corners[c]);
+			}
+			// One output pixel per voxel along each edge, so the texture
+			// keeps the resolution of the data whatever the orientation.
+			int size[2];
+			double steps[2][3];
+			for (int e = 0; e < 2; e++) {
+				double edge[3];
+				vtkMath::Subtract(corners[e + 1], corners[0], edge);
+				size[e] = std::min(std::max((int)std::lround(vtkMath::Norm(edge)) + 1, 2), this->MaxSize);
+				for (int j = 0; j < 3; j++)
+					steps[e][j] = edge[j] / (size[e] - 1);
+			}
+			ObliqueReslicer::Slice& slice = this->Slices[i];
+			bool newImage = slice.Image == nullptr || size[0] != slice.Size[0] || size[1] != slice.Size[1];
+			if (this->Reslicer->Reslice(slice, size, corners[0], steps[0], steps[1]) && newImage)
+				this->Textures[i]->SetInputData(slice.Image);
+		}
+	}
+
+	int		MaxSize = 1024;		// output pixels per face edge at most
+
+private:
+	// World coordinates to continuous voxel indices.
+	void ToVoxel(double* point) const
+	{
+		for (int j = 0; j < 3; j++)
+			point[j] = (point[j] - this->Bounds[2 * j]) / (this->Bounds[2 * j + 1] - this->Bounds[2 * j])
+			* (this->Reslicer->GetVolume()->Dims[j] - 1);
+	}
+
+	std::vector<vtkActor*>			Actors;
+	std::vector<vtkPlaneSource*>	PlaneSources;
+	std::vector<ObliqueReslicer::Slice>	Slices;
+	std::vector<vtkSmartPointer<vtkTexture>>	Textures;
+	vtkNew<vtkLookupTable>			Lookup;
+	ObliqueReslicer*				Reslicer = nullptr;
+	double							Bounds[6]{ 0, 0, 0, 0, 0, 0 };
+};
+
 int test4(int argc, char* argv[]);
 int main(int argc, char* argv[])
 {
@@ -368,8 +889,51 @@ int main(int argc, char* argv[])
 
 static unsigned char bkg[4] = { 51, 77, 102, 255 };
 
+static void FaceSortKeyPress(vtkObject* caller, unsigned long, void* clientData, void*)
+{
+	vtkRenderWindowInteractor* iren = vtkRenderWindowInteractor::SafeDownCast(caller);
+	std::string key = iren->GetKeySym();
+	if (key == "t") // Press 't' to cycle the translucency modes
+	{
+		static_cast<vtkFaceSortCallback*>(clientData)->NextMode();
+		iren->Render();
+	}
+}
+
+static void ResliceKeyPress(vtkObject* caller, unsigned long, void* clientData, void*)
+{
+	vtkRenderWindowInteractor* iren = vtkRenderWindowInteractor::SafeDownCast(caller);
+	std::string key = iren->GetKeySym();
+	if (key == "o") // Press 'o' to print reslicing statistics
+		static_cast<vtkObliqueResliceCallback*>(clientData)->PrintStatistics();
+}
+
+struct DemoOptions
+{
+	std::string	volumeFile;					// --volume <file.mhd>: resliced onto each face's pose
+};
+
+static bool ParseOptions(int argc, char* argv[], DemoOptions& options)
+{
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--volume" && hasValue)
+			options.volumeFile = argv[++i];
+		else {
+			std::cerr << "Unknown option " << arg << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
 int test4(int argc, char* argv[])
 {
+	DemoOptions options;
+	if (!ParseOptions(argc, argv, options))
+		return EXIT_FAILURE;
+
 	vtkObject::GlobalWarningDisplayOff();
 
 	vtkNew<vtkNamedColors> colors;
@@ -385,6 +949,9 @@ int test4(int argc, char* argv[])
 
 	aRenderer->SetBackground(colors->GetColor3d("BkgColor").GetData());
 	renWin->SetSize(640, 480);
+	// Depth peeling, one of the translucency modes, needs alpha planes and no MSAA.
+	renWin->SetAlphaBitPlanes(1);
+	renWin->SetMultiSamples(0);
 
 	std::array<vtkNew<vtkPlaneSource>, NUMOFPLANES> planes;
 	std::array<vtkNew<vtkPolyDataMapper>, NUMOFPLANES> polyDataMapperList;
@@ -482,6 +1049,37 @@ int test4(int argc, char* argv[])
 	style->SetPlanes(actors);
 	iren->SetInteractorStyle(style);
 
+	std::vector<vtkPlaneSource*>	planeSources(planes.begin(), planes.end());
+	// Order the translucent faces back to front each frame instead of peeling.
+	vtkNew<vtkFaceSortCallback> faceSort;
+	faceSort->SetFaces(aRenderer, actors, planeSources);
+	faceSort->SetMode(vtkFaceSortCallback::Sorted);
+	vtkNew<vtkCallbackCommand> faceSortKeys;
+	faceSortKeys->SetCallback(FaceSortKeyPress);
+	faceSortKeys->SetClientData(faceSort);
+	iren->AddObserver(vtkCommand::KeyPressEvent, faceSortKeys);
+
+	// Face resolution follows each face's size on screen.
+	vtkNew<vtkPlaneTessellationCallback> tessellation;
+	tessellation->SetFaces(aRenderer, actors, planeSources);
+
+	// Each face shows the volume cut along it, following drags and rotations.
+	FloatVolume volume;
+	ObliqueReslicer reslicer;
+	vtkNew<vtkObliqueResliceCallback> reslices;
+	vtkNew<vtkCallbackCommand> resliceKeys;
+	if (!options.volumeFile.empty()) {
+		if (!volume.Load(options.volumeFile)) {
+			std::cerr << "Cannot read volume " << options.volumeFile << std::endl;
+			return EXIT_FAILURE;
+		}
+		reslicer.SetVolume(&volume);
+		reslices->SetFaces(aRenderer, actors, planeSources, pBounds, &reslicer);
+		resliceKeys->SetCallback(ResliceKeyPress);
+		resliceKeys->SetClientData(reslices);
+		iren->AddObserver(vtkCommand::KeyPressEvent, resliceKeys);
+	}
+
 	// interact with data
 	iren->Initialize();
 	iren->Start();
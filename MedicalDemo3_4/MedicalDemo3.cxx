@@ -5,25 +5,62 @@
 //
 
 #include <array>
+#include <atomic>
 #include <vector>
 #include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <random>
+#include <string>
+#include <thread>
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Taken before the VTK headers below define their module initializers, so
+// the startup report can tell library loading from factory registration.
+static const std::chrono::steady_clock::time_point librariesLoadedTime = std::chrono::steady_clock::now();
+
 #include <vtkObject.h>
 #include <vtkSmartPointer.h>
 #include <vtkActor.h>
+#include <vtkActorCollection.h>
 #include <vtkCamera.h>
 #include <vtkImageActor.h>
-#include <vtkImageMapToColors.h>
 #include <vtkImageMapper3D.h>
 #include <vtkLookupTable.h>
 #include <vtkMetaImageReader.h>
 #include <vtkNamedColors.h>
 #include <vtkNew.h>
-#include <vtkOutlineFilter.h>
 #include <vtkPolyDataMapper.h>
 #include <vtkProperty.h>
 #include <vtkRenderWindow.h>
 #include <vtkRenderWindowInteractor.h>
 #include <vtkRenderer.h>
+#include <vtkRendererCollection.h>
 #include <vtkStripper.h>
 #include <vtkVersion.h>
 #include <vtkInteractorStyleTrackballActor.h>
@@ -31,16 +68,37 @@
 #include <vtkVertexGlyphFilter.h>
 #include <vtkImageData.h>
 #include <vtkObjectFactory.h>
+#include <vtkPropCollection.h>
 #include <vtkPropPicker.h>
 #include <vtkCellPicker.h>
 #include <vtkCellData.h>
 #include <vtkDoubleArray.h>
+#include <vtkExtractVOI.h>
 #include <vtkFloatArray.h>
+#include <vtkFixedPointVolumeRayCastMapper.h>
 #include <vtkShortArray.h>
 #include <vtkPointData.h>
-#include <vtkTransform.h>
 #include <vtkTransformFilter.h>
 #include <vtkPlaneSource.h>
+#include <vtkCallbackCommand.h>
+#include <vtkCommand.h>
+#include <vtkMath.h>
+#include <vtkMatrix4x4.h>
+#include <vtkMatrixToLinearTransform.h>
+#include <vtkPoints.h>
+#include <vtkPolyData.h>
+#include <vtkPointGaussianMapper.h>
+#include <vtkColorTransferFunction.h>
+#include <vtkPiecewiseFunction.h>
+#include <vtkVolume.h>
+#include <vtkVolumeCollection.h>
+#include <vtkVolumeProperty.h>
+#include <vtkMultiBlockDataGroupFilter.h>
+#include <vtkTransformPolyDataFilter.h>
+#include <vtkSMPTools.h>
+#include <vtkPNGWriter.h>
+#include <vtkWindowToImageFilter.h>
+#include <vtkUnsignedCharArray.h>
 
 
 
@@ -57,791 +115,5584 @@
 #include <vtkMarchingCubes.h>
 #endif
 
+// vtkCompositePolyDataMapper2 is deprecated from VTK 9.3, where
+// vtkCompositePolyDataMapper took over its per-block attributes.
+#if VTK_MAJOR_VERSION >= 10 || (VTK_MAJOR_VERSION == 9 && VTK_MINOR_VERSION >= 3)
+#include <vtkCompositePolyDataMapper.h>
+typedef vtkCompositePolyDataMapper vtkFaceBlockMapper;
+#else
+#include <vtkCompositePolyDataMapper2.h>
+typedef vtkCompositePolyDataMapper2 vtkFaceBlockMapper;
+#endif
+
+// Every module initializer in this file has run by now.
+static const std::chrono::steady_clock::time_point factoriesRegisteredTime = std::chrono::steady_clock::now();
+
 
-static int		length = 0;
-static double	total_vector[6][3];
-static double	pColor[3] = { 0.0, 0.0, 0.0 };
 const double	increamentXYZ = 1;
 const int		NUMOFPLANES = 6;
 const double	offset = 10;
-const double    epsilon = 1e-16;
-
-class vtkCustomInteractorStyleCamera;
+const double	faceColor[3] = { 1.0, 1.0, 1.0 };
+const double	highlightColor[3] = { 1.0, 0.55, 0.0 };
+const double	hoverColor[3] = { 1.0, 0.85, 0.6 };
 
-class vtkCustomInteractorStyle : public vtkInteractorStyleTrackballActor
+// Heap accounting for --alloc-stats.  Every operator new in the process is
+// counted (VTK objects included, since vtkStandardNewMacro allocates through
+// it), and the interactor style charges the counts to the phase of
+// interaction it is handling.  Scopes nest: a render inside a drag is charged
+// to Render, not to Drag, because VTK's pipeline and OpenGL state allocate
+// outside the event handlers' control.
+namespace AllocationStats
 {
-public:
-	static vtkCustomInteractorStyle* New();
-	vtkTypeMacro(vtkCustomInteractorStyle, vtkInteractorStyleTrackballActor);
-	virtual void OnLeftButtonDown() override
+	enum Phase { Hover, Press, Drag, Release, Render, NumberOfPhases };
+
+	// Drag events before this are not steady state: the first moves of a
+	// drag may still grow caches and lists.
+	const int	WarmUpEvents = 2;
+
+	struct Totals
 	{
-		int clickPos[2];
-		this->Interactor->GetEventPosition(clickPos);
-		vtkSmartPointer<vtkPropPicker> picker = vtkSmartPointer<vtkPropPicker>::New();
-		picker->Pick(clickPos[0], clickPos[1], 0, this->Renderer);
-		this->m_pTarget = vtkActor::SafeDownCast(picker->GetActor());
+		uint64_t	events = 0;
+		uint64_t	allocations = 0;
+		uint64_t	bytes = 0;
+		uint64_t	eventsThatAllocated = 0;
+		uint64_t	allocationsWithNested = 0;	// renders inside the event included
+	};
 
-		if (this->m_pTarget)
-		{
-			this->Interactor->GetEventPosition(this->LastPos);
+	static std::atomic<bool>		Enabled(false);
+	static std::atomic<uint64_t>	Allocations(0);
+	static std::atomic<uint64_t>	Bytes(0);
+	static Totals					PhaseTotals[NumberOfPhases];
+	static uint64_t					SteadyDragEventsThatAllocated = 0;
+	static uint64_t					SteadyHoverEventsThatAllocated = 0;
+	static int						DragEvents = 0;
+	static int						HoverEvents = 0;
 
-			for (int i = 0; i < NUMOFPLANES; i++)
-			{
-				if (this->m_pTarget == m_pActors[i])
-				{
-					m_Moving[i] = true;
-					std::cout << i << " has been selected " << std::endl;
-				}
-				else {
-					m_Moving[i] = false;
-				}
-			}
-		}
-		else {
-			//vtkInteractorStyleTrackballActor::OnLeftButtonDown();
-		}
+	static const char* PhaseName(int phase)
+	{
+		static const char* names[NumberOfPhases] = { "hover", "press", "drag", "release", "render" };
+		return names[phase];
 	}
 
+	// Cleared by threads of the demo's own, such as the pipeline thread,
+	// whose allocations would otherwise be charged to whatever event the
+	// interactor is handling at the time.
+	static thread_local bool		CountThisThread = true;
 
-	virtual void OnMouseMove() override
+	static void Count(size_t size)
 	{
-		int i = 0;
-		for (; i < NUMOFPLANES; i++) {
-			if (m_Moving[i]) {
-				//std::cout << " i = " << i << std::endl;
-				break;
-			}
+		if (Enabled.load(std::memory_order_relaxed) && CountThisThread) {
+			Allocations.fetch_add(1, std::memory_order_relaxed);
+			Bytes.fetch_add(size, std::memory_order_relaxed);
 		}
+	}
 
-		if (i < NUMOFPLANES)
+	// Charges what is allocated during its lifetime, less what nested scopes
+	// took, to one phase.
+	class Scope
+	{
+	public:
+		explicit Scope(Phase phase) : PhaseCharged(phase), Parent(Current)
 		{
+			if (!Enabled)
+				return;
+			Current = this;
+			if (phase == Press)
+				DragEvents = 0;
+			this->StartAllocations = Allocations;
+			this->StartBytes = Bytes;
+		}
 
-			vtkCamera* camera = this->Renderer->GetActiveCamera();
-			if (!camera) {
-				std::cerr << "Camera is null" << std::endl;
+		~Scope()
+		{
+			if (!Enabled || Current != this)
 				return;
+			Current = this->Parent;
+			uint64_t allocations = Allocations - this->StartAllocations;
+			uint64_t bytes = Bytes - this->StartBytes;
+			if (this->Parent) {
+				this->Parent->NestedAllocations += allocations;
+				this->Parent->NestedBytes += bytes;
 			}
+			Totals& totals = PhaseTotals[this->PhaseCharged];
+			totals.allocationsWithNested += allocations;
+			allocations -= this->NestedAllocations;
+			bytes -= this->NestedBytes;
 
-			this->Interactor->GetRenderWindow()->Render();
+			totals.events++;
+			totals.allocations += allocations;
+			totals.bytes += bytes;
+			totals.eventsThatAllocated += allocations > 0 ? 1 : 0;
+			if (this->PhaseCharged == Drag && ++DragEvents > WarmUpEvents && allocations > 0) {
+				if (SteadyDragEventsThatAllocated++ == 0)
+					std::cerr << "allocation: drag event " << DragEvents << " allocated " << allocations
+						<< " blocks (" << bytes << " bytes) outside rendering" << std::endl;
+			}
+			if (this->PhaseCharged == Hover && ++HoverEvents > WarmUpEvents && allocations > 0) {
+				if (SteadyHoverEventsThatAllocated++ == 0)
+					std::cerr << "allocation: hover event " << HoverEvents << " allocated " << allocations
+						<< " blocks (" << bytes << " bytes) outside rendering" << std::endl;
+			}
+		}
 
-			double	new_pick_point[4] = { 0 };
-			double	old_pick_point[4] = { 0 };
-			double	motion_vector[3] = { 0 };
-			int		currPos[2];
+	private:
+		static Scope*	Current;
+		Phase			PhaseCharged;
+		Scope*			Parent;
+		uint64_t		StartAllocations = 0;
+		uint64_t		StartBytes = 0;
+		uint64_t		NestedAllocations = 0;
+		uint64_t		NestedBytes = 0;
+	};
+	Scope* Scope::Current = nullptr;
 
-			this->Interactor->GetEventPosition(currPos);
+	// The first columns leave out renders nested in an event; "with render"
+	// counts them too.
+	static void Print()
+	{
+		std::printf("%-8s %8s %12s %12s %10s %12s\n", "phase", "events", "allocs/event", "bytes/event", "allocating", "with render");
+		for (int p = 0; p < NumberOfPhases; p++) {
+			const Totals& totals = PhaseTotals[p];
+			double events = (double)std::max<uint64_t>(totals.events, 1);
+			std::printf("%-8s %8llu %12.2f %12.1f %10llu %12.2f\n", PhaseName(p), (unsigned long long)totals.events,
+				totals.allocations / events, totals.bytes / events, (unsigned long long)totals.eventsThatAllocated,
+				totals.allocationsWithNested / events);
+		}
+		std::printf("steady-state events that allocated outside rendering: %llu drag, %llu hover\n",
+			(unsigned long long)SteadyDragEventsThatAllocated, (unsigned long long)SteadyHoverEventsThatAllocated);
+	}
+}
 
-			double  displayCurrPos[3] = { currPos[0], currPos[1], 0 };
-			double  displayLastPos[3] = { LastPos[0], LastPos[1], 0 };
-			this->Renderer->SetDisplayPoint(displayCurrPos);
-			this->Renderer->DisplayToWorld();
-			this->Renderer->GetWorldPoint(new_pick_point);
+// The counting allocator behind AllocationStats.  On ELF platforms it also
+// replaces operator new for the VTK shared libraries; Windows DLLs keep their
+// own, so there only the demo's allocations are seen.  The benchmark build
+// keeps the standard allocator, so its timings are not skewed.
+#ifndef MEDICALDEMO3_BENCHMARK
+void* operator new(std::size_t size)
+{
+	AllocationStats::Count(size);
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
 
-			this->Renderer->SetDisplayPoint(displayLastPos);
-			this->Renderer->DisplayToWorld();
-			this->Renderer->GetWorldPoint(old_pick_point);
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
 
-			int j;
-			if (new_pick_point[3] == 0.0) {
-				std::cerr << "Invalid world coordinates! w component of new_pick_point is zero. " << std::endl;
-				return;
-			}
-			else {
-				for (int n = 0; n < 3; n++)
-					new_pick_point[n] /= new_pick_point[3];
-			}
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+#endif
 
-			if (old_pick_point[3] == 0.0) {
-				std::cerr << "Invalid world coordinates! w component of old_pick_point is zero. " << std::endl;
-				return;
-			}
-			else {
-				for (int n = 0; n < 3; n++)
-					old_pick_point[n] /= old_pick_point[3];
-			}
-			for (int n = 0; n < 3; n++) {
-				motion_vector[n] = new_pick_point[n] - old_pick_point[n];
-			}
+// Lock-free ring of Capacity - 1 items between exactly one producer thread
+// and one consumer thread.  Each side owns one index and only reads the
+// other's, so neither ever waits: Push fails when the ring is full and Pop
+// when it is empty.  The indices sit on their own cache lines, and each
+// side keeps a copy of the other's index to read the shared one only when
+// the copy says the ring is full or empty.
+template <class T, size_t Capacity>
+class SPSCQueue
+{
+public:
+	// Producer side.
+	bool Push(const T& item)
+	{
+		size_t tail = m_Tail.load(std::memory_order_relaxed);
+		size_t next = (tail + 1) % Capacity;
+		if (next == m_HeadSeen) {
+			m_HeadSeen = m_Head.load(std::memory_order_acquire);
+			if (next == m_HeadSeen)
+				return false;
+		}
+		m_Items[tail] = item;
+		m_Tail.store(next, std::memory_order_release);
+		return true;
+	}
 
-			double	origin[3] = { 0 };
-			double  pt1[3] = { 0 };
-			double  pt2[3] = { 0 };
+	// Consumer side.
+	bool Pop(T& item)
+	{
+		size_t head = m_Head.load(std::memory_order_relaxed);
+		if (head == m_TailSeen) {
+			m_TailSeen = m_Tail.load(std::memory_order_acquire);
+			if (head == m_TailSeen)
+				return false;
+		}
+		item = m_Items[head];
+		m_Head.store((head + 1) % Capacity, std::memory_order_release);
+		return true;
+	}
 
-			double*  pBounds = nullptr;
-			bool flagOrigDown;
-			bool flagPt1Down;
-			bool flagPt2Down;
-			bool flagOrigUp;
-			bool flagPt1Up;
-			bool flagPt2Up;
-			bool flagDown;
-			bool flagUp;
+	// Consumer side.
+	bool IsEmpty() const
+	{
+		return m_Head.load(std::memory_order_relaxed) == m_Tail.load(std::memory_order_acquire);
+	}
 
-			if ((this->m_pTarget == m_pActors[i]) && (this->m_Moving[i])) {
-				if (!translations[i]) {
-					translations[i] = vtkSmartPointer<vtkTransform>::New();
-				}
-				switch (i) {
-				case 0:
-					j = 2;
-					if (motion_vector[j] > 0) {
-						total_vector[i][j] += increamentXYZ;
-					}
-					else if (motion_vector[j] < 0) {
-						total_vector[i][j] -= increamentXYZ;
-					}
-					if (total_vector[i][j] > m_bounds[2 * j + 1] - m_bounds[2 * j])
-						total_vector[i][j] = m_bounds[2 * j + 1] - m_bounds[2 * j];
-					else if (total_vector[i][j] < 0)
-						total_vector[i][j] = 0;
-					translations[i]->Identity();
-					translations[i]->Translate(0, 0, total_vector[i][j]);
-					for (int n = 0; n < 6; n++) {
-						if (n == 0 || n == 1) continue;
-						m_pPlaneSources[n]->GetOrigin(origin);
-						m_pPlaneSources[n]->GetPoint1(pt1);
-						m_pPlaneSources[n]->GetPoint2(pt2);
-
-						flagOrigUp = abs(origin[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagPt1Up = abs(pt1[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagPt2Up = abs(pt2[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagOrigDown = abs(origin[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagPt1Down = abs(pt1[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagPt2Down = abs(pt2[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagDown = flagOrigDown && flagPt1Down && flagPt2Down;
-						flagUp = flagOrigUp && flagPt1Up && flagPt2Up;
-
-						if (flagDown)
-						{
-							pt2[j] = m_bounds[2 * j] + total_vector[i][j];
-							if (pt2[j] > m_bounds[2 * j + 1] - offset)
-								pt2[j] = m_bounds[2 * j + 1] - offset;
-							else if (pt2[j] < m_bounds[2 * j] + offset)
-								pt2[j] = m_bounds[2 * j] + offset;
-						}
-						else if (flagUp) {
-							pt2[j] = m_bounds[2 * j] + total_vector[i][j];
-							if (pt2[j] > m_bounds[2 * j + 1] - offset)
-								pt2[j] = m_bounds[2 * j + 1] - offset;
-							else if (pt2[j] < m_bounds[2 * j] + offset)
-								pt2[j] = m_bounds[2 * j] + offset;
-						}
-						else {
-							if (!flagOrigDown) {
-								origin[j] = m_bounds[2 * j] + total_vector[i][j];
-								if (origin[j] > m_bounds[2 * j + 1] - offset)
-									origin[j] = m_bounds[2 * j + 1] - offset;
-								else if (origin[j] < m_bounds[2 * j] + offset)
-									origin[j] = m_bounds[2 * j] + offset;
-							}
-							if (!flagPt1Down) {
-								pt1[j] = m_bounds[2 * j] + total_vector[i][j];
-								if (pt1[j] > m_bounds[2 * j + 1] - offset)
-									pt1[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt1[j] < m_bounds[2 * j] + offset)
-									pt1[j] = m_bounds[2 * j] + offset;
-							}
-							if (!flagPt2Down) {
-								pt2[j] = m_bounds[2 * j] + total_vector[i][j];
-								if (pt2[j] > m_bounds[2 * j + 1] - offset)
-									pt2[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt2[j] < m_bounds[2 * j] + offset)
-									pt2[j] = m_bounds[2 * j] + offset;
-							}
-						}
-						m_pPlaneSources[n]->SetOrigin(origin);
-						m_pPlaneSources[n]->SetPoint1(pt1);
-						m_pPlaneSources[n]->SetPoint2(pt2);
-
-						this->Renderer->RemoveActor(m_pActors[n]);
-						vtkPolyDataMapper* mapper = vtkPolyDataMapper::SafeDownCast(m_pActors[n]->GetMapper());
-						mapper->SetInputConnection(m_pPlaneSources[n]->GetOutputPort());
-						mapper->Update();
-						this->Renderer->AddActor(m_pActors[n]);
-					}
-					break;
-				case 1:
-					j = 2;
-					if (motion_vector[j] > 0) {
-						total_vector[i][j] += increamentXYZ;
-					}
-					else if (motion_vector[j] < 0) {
-						total_vector[i][j] -= increamentXYZ;
-					}
-					if (total_vector[i][j] > 0)
-						total_vector[i][j] = 0;
-					else if (total_vector[i][j] < m_bounds[2 * j] - m_bounds[2 * j + 1])
-						total_vector[i][j] = m_bounds[2 * j] - m_bounds[2 * j + 1];
-
-					translations[i]->Identity();
-					translations[i]->Translate(0, 0, total_vector[i][j]);
-
-					for (int n = 0; n < 6; n++) {
-						if (n == 0 || n == 1) continue;
-						m_pPlaneSources[n]->GetOrigin(origin);
-						m_pPlaneSources[n]->GetPoint1(pt1);
-						m_pPlaneSources[n]->GetPoint2(pt2);
-
-						flagOrigDown = abs(origin[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagPt1Down = abs(pt1[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagPt2Down = abs(pt2[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagOrigUp = abs(origin[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagPt1Up = abs(pt1[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagPt2Up = abs(pt2[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagDown = flagOrigDown && flagPt1Down && flagPt2Down;
-						flagUp = flagOrigUp && flagPt1Up && flagPt2Up;
-
-						if (flagDown)
-						{
-							pt2[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-							if (pt2[j] > m_bounds[2 * j + 1] - offset)
-								pt2[j] = m_bounds[2 * j + 1] - offset;
-							else if (pt2[j] < m_bounds[2 * j] + offset)
-								pt2[j] = m_bounds[2 * j] + offset;
-						}
-						else if (flagUp) {
-							pt2[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-							if (pt2[j] > m_bounds[2 * j + 1] - offset)
-								pt2[j] = m_bounds[2 * j + 1] - offset;
-							else if (pt2[j] < m_bounds[2 * j] + offset)
-								pt2[j] = m_bounds[2 * j] + offset;
-						}
-						else {
-							if (!flagOrigDown) {
-								origin[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-								if (origin[j] > m_bounds[2 * j + 1] - offset)
-									origin[j] = m_bounds[2 * j + 1] - offset;
-								else if (origin[j] < m_bounds[2 * j] + offset)
-									origin[j] = m_bounds[2 * j] + offset;
-							}
-							if (!flagPt1Down) {
-								pt1[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-								if (pt1[j] > m_bounds[2 * j + 1] - offset)
-									pt1[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt1[j] < m_bounds[2 * j] + offset)
-									pt1[j] = m_bounds[2 * j] + offset;
-							}
-							if (!flagPt2Down) {
-								pt2[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-								if (pt2[j] > m_bounds[2 * j + 1] - offset)
-									pt2[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt2[j] < m_bounds[2 * j] + offset)
-									pt2[j] = m_bounds[2 * j] + offset;
-							}
-						}
-						m_pPlaneSources[n]->SetOrigin(origin);
-						m_pPlaneSources[n]->SetPoint1(pt1);
-						m_pPlaneSources[n]->SetPoint2(pt2);
-
-						this->Renderer->RemoveActor(m_pActors[n]);
-						vtkPolyDataMapper* mapper = vtkPolyDataMapper::SafeDownCast(m_pActors[n]->GetMapper());
-						mapper->SetInputConnection(m_pPlaneSources[n]->GetOutputPort());
-						mapper->Update();
-						this->Renderer->AddActor(m_pActors[n]);
-					}
-					break;
-				case 2:
-					j = 0;
-					if (motion_vector[j] > 0) {
-						total_vector[i][j] += increamentXYZ;
-					}
-					else if (motion_vector[j] < 0) {
-						total_vector[i][j] -= increamentXYZ;
-					}
-					if (total_vector[i][j] > m_bounds[2 * j + 1] - m_bounds[2 * j])
-						total_vector[i][j] = m_bounds[2 * j + 1] - m_bounds[2 * j];
-					else if (total_vector[i][j] < 0)
-						total_vector[i][j] = 0;
-					translations[i]->Identity();
-					translations[i]->Translate(total_vector[i][j], 0, 0);
-					for (int n = 0; n < 6; n++) {
-						if (n == 2 || n == 3) continue;
-						m_pPlaneSources[n]->GetOrigin(origin);
-						m_pPlaneSources[n]->GetPoint1(pt1);
-						m_pPlaneSources[n]->GetPoint2(pt2);
-
-						flagOrigUp = abs(origin[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagPt1Up = abs(pt1[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagPt2Up = abs(pt2[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagOrigDown = abs(origin[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagPt1Down = abs(pt1[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagPt2Down = abs(pt2[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagDown = flagOrigDown && flagPt1Down && flagPt2Down;
-						flagUp = flagOrigUp && flagPt1Up && flagPt2Up;
-						if (flagDown)
-						{
-							pt1[j] = m_bounds[2 * j] + total_vector[i][j];
-							if (pt1[j] > m_bounds[2 * j + 1] - offset)
-								pt1[j] = m_bounds[2 * j + 1] - offset;
-							else if (pt1[j] < m_bounds[2 * j] + offset)
-								pt1[j] = m_bounds[2 * j] + offset;
-						}
-						else if (flagUp) {
-							pt1[j] = m_bounds[2 * j] + total_vector[i][j];
-							if (pt1[j] > m_bounds[2 * j + 1] - offset)
-								pt1[j] = m_bounds[2 * j + 1] - offset;
-							else if (pt1[j] < m_bounds[2 * j] + offset)
-								pt1[j] = m_bounds[2 * j] + offset;
-						}
-						else {
-							if (!flagOrigDown) {
-								origin[j] = m_bounds[2 * j] + total_vector[i][j];
-								if (origin[j] > m_bounds[2 * j + 1] - offset)
-									origin[j] = m_bounds[2 * j + 1] - offset;
-								else if (origin[j] < m_bounds[2 * j] + offset)
-									origin[j] = m_bounds[2 * j] + offset;
-							}
-							if (!flagPt1Down) {
-								pt1[j] = m_bounds[2 * j] + total_vector[i][j];
-								if (pt1[j] > m_bounds[2 * j + 1] - offset)
-									pt1[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt1[j] < m_bounds[2 * j] + offset)
-									pt1[j] = m_bounds[2 * j] + offset;
-							}
-							if (!flagPt2Down) {
-								pt2[j] = m_bounds[2 * j] + total_vector[i][j];
-								if (pt2[j] > m_bounds[2 * j + 1] - offset)
-									pt2[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt2[j] < m_bounds[2 * j] + offset)
-									pt2[j] = m_bounds[2 * j] + offset;
-							}
-						}
-						m_pPlaneSources[n]->SetOrigin(origin);
-						m_pPlaneSources[n]->SetPoint1(pt1);
-						m_pPlaneSources[n]->SetPoint2(pt2);
-
-						this->Renderer->RemoveActor(m_pActors[n]);
-						vtkPolyDataMapper* mapper = vtkPolyDataMapper::SafeDownCast(m_pActors[n]->GetMapper());
-						mapper->SetInputConnection(m_pPlaneSources[n]->GetOutputPort());
-						mapper->Update();
-						this->Renderer->AddActor(m_pActors[n]);
-					}
-					break;
-				case 3:
-					j = 0;
-					if (motion_vector[j] > 0) {
-						total_vector[i][j] += increamentXYZ;
-					}
-					else if (motion_vector[j] < 0) {
-						total_vector[i][j] -= increamentXYZ;
-					}
-					if (total_vector[i][j] > 0)
-						total_vector[i][j] = 0;
-					else if (total_vector[i][j] < m_bounds[2 * j] - m_bounds[2 * j + 1])
-						total_vector[i][j] = m_bounds[2 * j] - m_bounds[2 * j + 1];
-					translations[i]->Identity();
-					translations[i]->Translate(total_vector[i][j], 0, 0);
-					for (int n = 0; n < 6; n++) {
-						if (n == 2 || n == 3) continue;
-						m_pPlaneSources[n]->GetOrigin(origin);
-						m_pPlaneSources[n]->GetPoint1(pt1);
-						m_pPlaneSources[n]->GetPoint2(pt2);
-
-						flagOrigDown = abs(origin[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagPt1Down = abs(pt1[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagPt2Down = abs(pt2[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagOrigUp = abs(origin[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagPt1Up = abs(pt1[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagPt2Up = abs(pt2[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagDown = flagOrigDown && flagPt1Down && flagPt2Down;
-						flagUp = flagOrigUp && flagPt1Up && flagPt2Up;
-
-						if (flagDown)
-						{
-							pt1[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-							if (pt1[j] > m_bounds[2 * j + 1] - offset)
-								pt1[j] = m_bounds[2 * j + 1] - offset;
-							else if (pt1[j] < m_bounds[2 * j] + offset)
-								pt1[j] = m_bounds[2 * j] + offset;
-						}
-						else if (flagUp) {
-							pt1[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-							if (pt1[j] > m_bounds[2 * j + 1] - offset)
-								pt1[j] = m_bounds[2 * j + 1] - offset;
-							else if (pt1[j] < m_bounds[2 * j] + offset)
-								pt1[j] = m_bounds[2 * j] + offset;
-						}
-						else {
-							if (!flagOrigDown) {
-								origin[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-								if (origin[j] > m_bounds[2 * j + 1] - offset)
-									origin[j] = m_bounds[2 * j + 1] - offset;
-								else if (origin[j] < m_bounds[2 * j] + offset)
-									origin[j] = m_bounds[2 * j] + offset;
-							}
-							if (!flagPt1Down) {
-								pt1[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-								if (pt1[j] > m_bounds[2 * j + 1] - offset)
-									pt1[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt1[j] < m_bounds[2 * j] + offset)
-									pt1[j] = m_bounds[2 * j] + offset;
-							}
-							if (!flagPt2Down) {
-								pt2[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-								if (pt2[j] > m_bounds[2 * j + 1] - offset)
-									pt2[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt2[j] < m_bounds[2 * j] + offset)
-									pt2[j] = m_bounds[2 * j] + offset;
-							}
-						}
-						m_pPlaneSources[n]->SetOrigin(origin);
-						m_pPlaneSources[n]->SetPoint1(pt1);
-						m_pPlaneSources[n]->SetPoint2(pt2);
-
-						this->Renderer->RemoveActor(m_pActors[n]);
-						vtkPolyDataMapper* mapper = vtkPolyDataMapper::SafeDownCast(m_pActors[n]->GetMapper());
-						mapper->SetInputConnection(m_pPlaneSources[n]->GetOutputPort());
-						mapper->Update();
-						this->Renderer->AddActor(m_pActors[n]);
-					}
-					break;
-				case 4:
-					j = 1;
-					if (motion_vector[j] > 0) {
-						total_vector[i][j] += increamentXYZ;
-					}
-					else if (motion_vector[j] < 0) {
-						total_vector[i][j] -= increamentXYZ;
-					}
-					if (total_vector[i][j] > m_bounds[2 * j + 1] - m_bounds[2 * j])
-						total_vector[i][j] = m_bounds[2 * j + 1] - m_bounds[2 * j];
-					else if (total_vector[i][j] < 0)
-						total_vector[i][j] = 0;
-					translations[i]->Identity();
-					translations[i]->Translate(0, total_vector[i][j], 0);
-					for (int n = 0; n < 6; n++) {
-						if (n == 4 || n == 5) continue;
-						m_pPlaneSources[n]->GetOrigin(origin);
-						m_pPlaneSources[n]->GetPoint1(pt1);
-						m_pPlaneSources[n]->GetPoint2(pt2);
-
-						flagOrigUp = abs(origin[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagPt1Up = abs(pt1[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagPt2Up = abs(pt2[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagOrigDown = abs(origin[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagPt1Down = abs(pt1[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagPt2Down = abs(pt2[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-
-						flagDown = flagOrigDown && flagPt1Down && flagPt2Down;
-						flagUp = flagOrigUp && flagPt1Up && flagPt2Up;
-
-						if (flagDown)
-						{
-							if (n == 2 || n == 3) {
-								pt1[j] = m_bounds[2 * j] + total_vector[i][j];
-								if (pt1[j] > m_bounds[2 * j + 1] - offset)
-									pt1[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt1[j] < m_bounds[2 * j] + offset)
-									pt1[j] = m_bounds[2 * j] + offset;
-							}
-							else {
-								pt2[j] = m_bounds[2 * j] + total_vector[i][j];
-								if (pt2[j] > m_bounds[2 * j + 1] - offset)
-									pt2[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt2[j] < m_bounds[2 * j] + offset)
-									pt2[j] = m_bounds[2 * j] + offset;
-							}
-						}
-						else if (flagUp) {
-							if (n == 2 || n == 3) {
-								pt1[j] = m_bounds[2 * j] + total_vector[i][j];
-								if (pt1[j] > m_bounds[2 * j + 1] - offset)
-									pt1[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt1[j] < m_bounds[2 * j] + offset)
-									pt1[j] = m_bounds[2 * j] + offset;
-							}
-							else {
-								pt2[j] = m_bounds[2 * j] + total_vector[i][j];
-								if (pt2[j] > m_bounds[2 * j + 1] - offset)
-									pt2[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt2[j] < m_bounds[2 * j] + offset)
-									pt2[j] = m_bounds[2 * j] + offset;
-							}
-						}
-						else {
-							if (!flagOrigDown) {
-								origin[j] = m_bounds[2 * j] + total_vector[i][j];
-								if (origin[j] > m_bounds[2 * j + 1] - offset)
-									origin[j] = m_bounds[2 * j + 1] - offset;
-								else if (origin[j] < m_bounds[2 * j] + offset)
-									origin[j] = m_bounds[2 * j] + offset;
-							}
-							if (!flagPt1Down) {
-								pt1[j] = m_bounds[2 * j] + total_vector[i][j];
-								if (pt1[j] > m_bounds[2 * j + 1] - offset)
-									pt1[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt1[j] < m_bounds[2 * j] + offset)
-									pt1[j] = m_bounds[2 * j] + offset;
-							}
-							if (!flagPt2Down) {
-								pt2[j] = m_bounds[2 * j] + total_vector[i][j];
-								if (pt2[j] > m_bounds[2 * j + 1] - offset)
-									pt2[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt2[j] < m_bounds[2 * j] + offset)
-									pt2[j] = m_bounds[2 * j] + offset;
-							}
-						}
-						m_pPlaneSources[n]->SetOrigin(origin);
-						m_pPlaneSources[n]->SetPoint1(pt1);
-						m_pPlaneSources[n]->SetPoint2(pt2);
-
-						this->Renderer->RemoveActor(m_pActors[n]);
-						vtkPolyDataMapper* mapper = vtkPolyDataMapper::SafeDownCast(m_pActors[n]->GetMapper());
-						mapper->SetInputConnection(m_pPlaneSources[n]->GetOutputPort());
-						mapper->Update();
-						this->Renderer->AddActor(m_pActors[n]);
-					}
-					break;
-				case 5:
-					j = 1;
-					if (motion_vector[j] > 0) {
-						total_vector[i][j] += increamentXYZ;
-					}
-					else if (motion_vector[j] < 0) {
-						total_vector[i][j] -= increamentXYZ;
-					}
-					if (total_vector[i][j] > 0)
-						total_vector[i][j] = 0;
-					else if (total_vector[i][j] < m_bounds[2 * j] - m_bounds[2 * j + 1])
-						total_vector[i][j] = m_bounds[2 * j] - m_bounds[2 * j + 1];
-					translations[i]->Identity();
-					translations[i]->Translate(0, total_vector[i][j], 0);
-					for (int n = 0; n < 6; n++) {
-						if (n == 4 || n == 5) continue;
-						m_pPlaneSources[n]->GetOrigin(origin);
-						m_pPlaneSources[n]->GetPoint1(pt1);
-						m_pPlaneSources[n]->GetPoint2(pt2);
-
-						flagOrigDown = abs(origin[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagPt1Down = abs(pt1[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagPt2Down = abs(pt2[j] - (m_bounds[2 * j] + offset)) < epsilon;
-						flagOrigUp = abs(origin[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagPt1Up = abs(pt1[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagPt2Up = abs(pt2[j] - (m_bounds[2 * j + 1] - offset)) < epsilon;
-						flagDown = flagOrigDown && flagPt1Down && flagPt2Down;
-						flagUp = flagOrigUp && flagPt1Up && flagPt2Up;
-
-						if (flagDown)
-						{
-							if (n == 2 || n == 3) {
-								pt1[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-								if (pt1[j] > m_bounds[2 * j + 1] - offset)
-									pt1[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt1[j] < m_bounds[2 * j] + offset)
-									pt1[j] = m_bounds[2 * j] + offset;
-							}
-							else {
-								pt2[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-								if (pt2[j] > m_bounds[2 * j + 1] - offset)
-									pt2[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt2[j] < m_bounds[2 * j] + offset)
-									pt2[j] = m_bounds[2 * j] + offset;
-							}
-						}
-						else if (flagUp) {
-							if (n == 2 || n == 3) {
-								pt1[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-								if (pt1[j] > m_bounds[2 * j + 1] - offset)
-									pt1[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt1[j] < m_bounds[2 * j] + offset)
-									pt1[j] = m_bounds[2 * j] + offset;
-							}
-							else {
-								pt2[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-								if (pt2[j] > m_bounds[2 * j + 1] - offset)
-									pt2[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt2[j] < m_bounds[2 * j] + offset)
-									pt2[j] = m_bounds[2 * j] + offset;
-							}
-						}
-						else {
-							if (!flagOrigDown) {
-								origin[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-								if (origin[j] > m_bounds[2 * j + 1] - offset)
-									origin[j] = m_bounds[2 * j + 1] - offset;
-								else if (origin[j] < m_bounds[2 * j] + offset)
-									origin[j] = m_bounds[2 * j] + offset;
-							}
-							if (!flagPt1Down) {
-								pt1[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-								if (pt1[j] > m_bounds[2 * j + 1] - offset)
-									pt1[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt1[j] < m_bounds[2 * j] + offset)
-									pt1[j] = m_bounds[2 * j] + offset;
-							}
-							if (!flagPt2Down) {
-								pt2[j] = m_bounds[2 * j + 1] + total_vector[i][j];
-								if (pt2[j] > m_bounds[2 * j + 1] - offset)
-									pt2[j] = m_bounds[2 * j + 1] - offset;
-								else if (pt2[j] < m_bounds[2 * j] + offset)
-									pt2[j] = m_bounds[2 * j] + offset;
-							}
-						}
-						m_pPlaneSources[n]->SetOrigin(origin);
-						m_pPlaneSources[n]->SetPoint1(pt1);
-						m_pPlaneSources[n]->SetPoint2(pt2);
-
-						this->Renderer->RemoveActor(m_pActors[n]);
-						vtkPolyDataMapper* mapper = vtkPolyDataMapper::SafeDownCast(m_pActors[n]->GetMapper());
-						mapper->SetInputConnection(m_pPlaneSources[n]->GetOutputPort());
-						mapper->Update();
-						this->Renderer->AddActor(m_pActors[n]);
-					}
-					break;
-				}
-				this->Renderer->RemoveActor(this->m_pTarget);
-				this->m_pTarget->SetUserTransform(translations[i]);
-				this->Renderer->AddActor(this->m_pTarget);
+private:
+	alignas(64) std::atomic<size_t>	m_Head{ 0 };
+	size_t							m_TailSeen = 0;		// consumer's copy of m_Tail
+	alignas(64) std::atomic<size_t>	m_Tail{ 0 };
+	size_t							m_HeadSeen = 0;		// producer's copy of m_Head
+	alignas(64) std::array<T, Capacity>	m_Items;
+};
 
-				//std::cout << i << " is moving " << std::endl;
-			}
+// Builds the box faces on a thread of its own (--pipeline-thread).  The
+// interactor never runs a face's plane source: it posts intents to an
+// SPSCQueue (a face moved to an offset, the plane under a face moved or was
+// re-tessellated, the interaction mode toggled) and carries on.  The thread
+// drains the queue, keeps only the newest plane and offset of each face,
+// runs its own vtkPlaneSource for each face whose plane changed and hands
+// the geometry back through a triple buffer per face: it fills its back
+// slot and swaps it with the middle one, and the interactor swaps the
+// middle slot for its front one when it finds a newer build there.  Each
+// side only touches the slot it holds and arrays are never changed once
+// built, so sharing them needs no lock and the interactor never waits.
+// The thread sleeps on a condition variable when there is nothing to do;
+// in actor mode, where drag steps follow each other closely, it yields for
+// SpinTime first so that the next step does not have to wake it.
+class BoxPipelineThread
+{
+public:
+	// A face as the thread built it: the geometry, the plane it was built
+	// from and the offset to draw it at.
+	struct FaceResult
+	{
+		vtkSmartPointer<vtkPolyData>	Data;
+		double		Origin[3]{ 0, 0, 0 };
+		double		Point1[3]{ 0, 0, 0 };
+		double		Point2[3]{ 0, 0, 0 };
+		double		Offset = 0;
+		uint64_t	Build = 0;		// which run of the face's plane source Data is from
+	};
 
-			//this->m_pTarget->SetPosition(pos);
-			this->Interactor->Render();
+	~BoxPipelineThread() { this->Stop(); }
 
-			this->LastPos[0] = currPos[0];
-			this->LastPos[1] = currPos[1];
-			//this->Interactor->GetLastEventPosition(this->LastPos);
-		}
-		else {
-			//vtkInteractorStyleTrackballActor::OnMouseMove();
+	// Starts the thread with faces for numberOfBoxes boxes.
+	void Start(int numberOfBoxes)
+	{
+		if (m_Thread.joinable())
+			return;
+		m_NumberOfFaces = numberOfBoxes * NUMOFPLANES;
+		m_Faces.reset(new Face[m_NumberOfFaces]);
+		for (int f = 0; f < m_NumberOfFaces; f++) {
+			m_Faces[f].Source = vtkSmartPointer<vtkPlaneSource>::New();
+			for (FaceResult& slot : m_Faces[f].Slots)
+				slot.Data = vtkSmartPointer<vtkPolyData>::New();
 		}
+		m_Waiting.assign(2 * m_NumberOfFaces + 1, Intent());
+		m_IsWaiting.assign(m_Waiting.size(), 0);
+		m_Stop = false;
+		m_Thread = std::thread(&BoxPipelineThread::Run, this);
 	}
 
-	virtual void OnLeftButtonUp() override
+	void Stop()
 	{
-		for (auto& bmove : m_Moving)
-			bmove = false;
-		//vtkInteractorStyleTrackballActor::OnLeftButtonUp();
+		if (!m_Thread.joinable())
+			return;
+		{
+			std::lock_guard<std::mutex> lock(m_WakeMutex);
+			m_Stop = true;
+		}
+		m_Wake.notify_one();
+		m_Thread.join();
 	}
 
-	void SetRenderer(vtkRenderer* renderer) {
-		this->Renderer = renderer;
-	}
-	void SetPlanes(const std::vector<vtkActor*>& pActors)
+	bool IsRunning() const { return m_Thread.joinable(); }
+
+	// Interactor side: face of box roi moved to offset.
+	void PostFaceMoved(int roi, int face, double offset)
 	{
-		int i = 0;
-		if (m_pActors.size() != pActors.size())
-			m_pActors.resize(pActors.size());
+		Intent intent;
+		intent.Kind = Intent::FaceMoved;
+		intent.Face = roi * NUMOFPLANES + face;
+		intent.Offset = offset;
+		this->Post(intent, 2 * intent.Face);
+	}
 
-		for (auto actor : pActors) {
-			m_pActors[i++] = actor;
-		}
+	// Interactor side: the plane under face of box roi, or its resolution,
+	// is now that of plane.
+	void PostPlaneMoved(int roi, int face, vtkPlaneSource* plane)
+	{
+		Intent intent;
+		intent.Kind = Intent::PlaneMoved;
+		intent.Face = roi * NUMOFPLANES + face;
+		plane->GetOrigin(intent.Origin);
+		plane->GetPoint1(intent.Point1);
+		plane->GetPoint2(intent.Point2);
+		intent.Resolution[0] = plane->GetXResolution();
+		intent.Resolution[1] = plane->GetYResolution();
+		this->Post(intent, 2 * intent.Face + 1);
 	}
 
-	void SetPlaneSource(const std::vector<vtkPlaneSource*> pPlaneSource) {
-		int i = 0;
-		if (m_pPlaneSources.size() != pPlaneSource.size())
-			m_pPlaneSources.resize(pPlaneSource.size());
+	// Interactor side: the user switched between moving the boxes (actor
+	// mode) and moving the camera.
+	void PostModeToggled(bool actorMode)
+	{
+		Intent intent;
+		intent.Kind = Intent::ModeToggled;
+		intent.ActorMode = actorMode;
+		this->Post(intent, 2 * m_NumberOfFaces);
+	}
 
-		for (auto planeSource : pPlaneSource) {
-			m_pPlaneSources[i++] = planeSource;
+	// Interactor side: calls show(roi, face, result) for each face built
+	// since the last call, newest build only.  Returns the number of faces.
+	template <class F>
+	int TakeResults(F show)
+	{
+		this->SendWaiting();
+		int faces = 0;
+		for (int f = 0; f < m_NumberOfFaces; f++) {
+			Face& face = m_Faces[f];
+			if (!(face.Middle.load(std::memory_order_relaxed) & NewBit))
+				continue;
+			face.Front = face.Middle.exchange(face.Front, std::memory_order_acq_rel) & SlotMask;
+			show(f / NUMOFPLANES, f % NUMOFPLANES, face.Slots[face.Front]);
+			faces++;
 		}
+		m_Taken += faces;
+		return faces;
 	}
 
-	void SetBounds(double* pBound)
+	// Interactor side: whether a build is waiting to be taken.
+	bool HasResults() const
 	{
-		for (int i = 0; i < 6; i++) {
-			m_bounds[i] = pBound[i];
+		for (int f = 0; f < m_NumberOfFaces; f++) {
+			if (m_Faces[f].Middle.load(std::memory_order_relaxed) & NewBit)
+				return true;
 		}
+		return false;
 	}
 
-	virtual void OnKeyPress() override
+	// Interactor side: whether everything posted has been built and taken.
+	bool IsCaughtUp() const
 	{
-		std::string key = this->GetInteractor()->GetKeySym();
-		if (key == "c") // Press 'c' to switch mode
-		{
-			this->CurrentStyle = this->CameraStyle;
-			std::cout << "Switched to Camera Mode" << std::endl;
+		return m_WaitingCount == 0 && m_Processed.load(std::memory_order_acquire) == m_Sent && !this->HasResults();
+	}
 
-			this->GetInteractor()->SetInteractorStyle(this->CurrentStyle);
+	// Interactor side, for runs without an event loop (--serve, --batch,
+	// --alloc-check), whose frames must show what was posted before them:
+	// blocks until the thread has built everything posted so far.
+	void WaitUntilBuilt()
+	{
+		std::unique_lock<std::mutex> lock(m_DoneMutex);
+		for (;;) {
+			this->SendWaiting();
+			uint64_t processed = m_Processed.load(std::memory_order_acquire);
+			if (m_WaitingCount == 0 && processed == m_Sent)
+				return;
+			m_Done.wait(lock, [&] { return m_Processed.load(std::memory_order_acquire) != processed; });
 		}
-		//this->CurrentStyle->OnKeyPress();
 	}
 
-	void SetStyle(vtkSmartPointer<vtkCustomInteractorStyleCamera> pCameraStyle,
-		vtkSmartPointer<vtkInteractorStyle> pCurrentStyle)
+	void PrintStatistics() const
 	{
-		this->CameraStyle = pCameraStyle;
-		this->CurrentStyle = pCurrentStyle;
+		std::cout << "pipeline thread: " << m_Intents << " intents collapsed into " << m_Published
+			<< " face updates (" << m_Builds << " plane source runs), " << m_Taken << " drawn, "
+			<< m_Overflows << " waited for queue space" << std::endl;
 	}
 
-private:
-	vtkSmartPointer<vtkRenderer>	Renderer = nullptr;
-	vtkActor*						m_pTarget = nullptr;
-	std::array<vtkSmartPointer<vtkTransform>, NUMOFPLANES>	translations = { nullptr };
-	std::vector<vtkActor*>			m_pActors;
-	std::vector<vtkPlaneSource*>	m_pPlaneSources;
-	std::array<bool, NUMOFPLANES>	m_Moving = { false };
-	double							m_bounds[6]{ 0, 0, 0, 0, 0, 0 };
-	int								LastPos[2]{ 0, 0 };
-	vtkSmartPointer<vtkCustomInteractorStyleCamera> CameraStyle;
-	vtkSmartPointer<vtkInteractorStyle> CurrentStyle;
+	// How long the thread stays awake after work in actor mode.
+	std::chrono::milliseconds	SpinTime{ 20 };
 
-};
+private:
+	struct Intent
+	{
+		enum Type : uint8_t { FaceMoved, PlaneMoved, ModeToggled };
+		Type	Kind = FaceMoved;
+		bool	ActorMode = false;		// ModeToggled
+		int		Face = -1;				// box * NUMOFPLANES + face
+		double	Offset = 0;				// FaceMoved
+		double	Origin[3]{ 0, 0, 0 };	// PlaneMoved
+		double	Point1[3]{ 0, 0, 0 };
+		double	Point2[3]{ 0, 0, 0 };
+		int		Resolution[2]{ 1, 1 };
+	};
 
-vtkStandardNewMacro(vtkCustomInteractorStyle);
+	// Triple buffer slot indices; NewBit marks a middle slot the interactor
+	// has not taken yet.
+	enum : uint8_t { SlotMask = 3, NewBit = 4 };
 
-class vtkCustomInteractorStyleCamera : public vtkInteractorStyleTrackballCamera
-{
-public:
-	static vtkCustomInteractorStyleCamera* New();
-	vtkTypeMacro(vtkCustomInteractorStyleCamera, vtkInteractorStyleTrackballCamera);
+	struct Face
+	{
+		// The thread's.
+		vtkSmartPointer<vtkPlaneSource>	Source;
+		double			Offset = 0;
+		bool			Changed = false;
+		vtkMTimeType	BuiltMTime = 0;
+		uint64_t		Build = 0;
+		uint8_t			Back = 2;
+		// Shared.
+		std::atomic<uint8_t>	Middle{ 1 };
+		// The interactor's.
+		uint8_t			Front = 0;
+		FaceResult		Slots[3];
+	};
 
+	// Sends intent, or keeps it under key until there is room in the queue.
+	// Intents are absolute, so a later one replaces a waiting one with the
+	// same key and at most one per key ever waits.
+	void Post(const Intent& intent, int key)
+	{
+		if (!m_Thread.joinable())
+			return;
+		this->SendWaiting();
+		if (!m_IsWaiting[key] && this->Send(intent))
+			return;
+		if (!m_IsWaiting[key]) {
+			m_IsWaiting[key] = 1;
+			m_WaitingCount++;
+			m_Overflows++;
+		}
+		m_Waiting[key] = intent;
+	}
 
-	vtkCustomInteractorStyleCamera()
+	void SendWaiting()
 	{
-		this->ActorStyle = vtkSmartPointer<vtkCustomInteractorStyle>::New();
-		this->CurrentStyle = vtkSmartPointer<vtkInteractorStyle>::New();
-		this->ActorStyle->SetStyle(this, CurrentStyle);
+		for (size_t key = 0; m_WaitingCount > 0 && key < m_Waiting.size(); key++) {
+			if (!m_IsWaiting[key] || !this->Send(m_Waiting[key]))
+				continue;
+			m_IsWaiting[key] = 0;
+			m_WaitingCount--;
+		}
 	}
 
-	virtual void OnKeyPress() override
+	bool Send(const Intent& intent)
 	{
-		std::string key = this->GetInteractor()->GetKeySym();
-		if (key == "c") // Press 'c' to switch mode
-		{
-			this->CurrentStyle = this->ActorStyle;
-			std::cout << "Switched to Actor Mode" << std::endl;
-			this->GetInteractor()->SetInteractorStyle(this->CurrentStyle);
+		if (!m_Queue.Push(intent))
+			return false;
+		m_Sent++;
+		// Pairs with the fence in Sleep: either the thread sees the intent
+		// before it waits, or this sees that it is asleep.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_Sleeping.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> lock(m_WakeMutex);
+			m_Wake.notify_one();
 		}
-		//this->CurrentStyle->OnKeyPress();
+		return true;
 	}
 
-	void SetRenderer(vtkRenderer* renderer) { this->ActorStyle->SetRenderer(renderer); }
-	void SetPlanes(const std::vector<vtkActor*>& pActors)
+	void Run()
 	{
-		this->ActorStyle->SetPlanes(pActors);
+		AllocationStats::CountThisThread = false;
+		bool actorMode = false;
+		std::chrono::steady_clock::time_point lastWork = std::chrono::steady_clock::now();
+		for (;;) {
+			Intent intent;
+			uint64_t received = 0;
+			while (m_Queue.Pop(intent)) {
+				received++;
+				if (intent.Kind == Intent::ModeToggled) {
+					actorMode = intent.ActorMode;
+					continue;
+				}
+				Face& face = m_Faces[intent.Face];
+				if (intent.Kind == Intent::FaceMoved) {
+					face.Offset = intent.Offset;
+				}
+				else {
+					face.Source->SetOrigin(intent.Origin);
+					face.Source->SetPoint1(intent.Point1);
+					face.Source->SetPoint2(intent.Point2);
+					face.Source->SetResolution(intent.Resolution[0], intent.Resolution[1]);
+				}
+				face.Changed = true;
+			}
+			if (received > 0) {
+				m_Intents += received;
+				this->BuildChangedFaces();
+				{
+					std::lock_guard<std::mutex> lock(m_DoneMutex);
+					m_Processed.store(m_Processed.load(std::memory_order_relaxed) + received, std::memory_order_release);
+				}
+				m_Done.notify_all();
+				lastWork = std::chrono::steady_clock::now();
+				continue;
+			}
+			if (m_Stop)
+				break;
+			if (actorMode && std::chrono::steady_clock::now() - lastWork < this->SpinTime)
+				std::this_thread::yield();
+			else
+				this->Sleep();
+		}
 	}
-	void SetPlaneSource(const std::vector<vtkPlaneSource*> pPlaneSource) {
-		this->ActorStyle->SetPlaneSource(pPlaneSource);
+
+	void Sleep()
+	{
+		m_Sleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		{
+			std::unique_lock<std::mutex> lock(m_WakeMutex);
+			m_Wake.wait(lock, [this] { return m_Stop || !m_Queue.IsEmpty(); });
+		}
+		m_Sleeping.store(false, std::memory_order_relaxed);
 	}
 
-	void SetBounds(double* pBound)
+	// Runs the plane source of each face whose plane changed and publishes
+	// every changed face with its offset.
+	void BuildChangedFaces()
 	{
-		this->ActorStyle->SetBounds(pBound);
+		for (int f = 0; f < m_NumberOfFaces; f++) {
+			Face& face = m_Faces[f];
+			if (!face.Changed)
+				continue;
+			vtkPlaneSource* source = face.Source;
+			if (source->GetMTime() != face.BuiltMTime) {
+				source->Update();
+				face.BuiltMTime = source->GetMTime();
+				face.Build++;
+				m_Builds++;
+			}
+			// The back slot may hold a build from two publications ago.
+			FaceResult& slot = face.Slots[face.Back];
+			if (slot.Build != face.Build) {
+				slot.Data->ShallowCopy(source->GetOutput());
+				source->GetOrigin(slot.Origin);
+				source->GetPoint1(slot.Point1);
+				source->GetPoint2(slot.Point2);
+				slot.Build = face.Build;
+			}
+			slot.Offset = face.Offset;
+			face.Back = face.Middle.exchange(face.Back | NewBit, std::memory_order_acq_rel) & SlotMask;
+			face.Changed = false;
+			m_Published++;
+		}
 	}
 
-	vtkSmartPointer<vtkCustomInteractorStyle> ActorStyle;
-	vtkSmartPointer<vtkInteractorStyle> CurrentStyle;
+	static const size_t QueueSize = 1024;
+
+	SPSCQueue<Intent, QueueSize>	m_Queue;
+	std::unique_ptr<Face[]>			m_Faces;
+	int								m_NumberOfFaces = 0;
+	std::thread						m_Thread;
+	std::atomic<bool>				m_Stop{ false };		// set under m_WakeMutex
+	std::atomic<bool>				m_Sleeping{ false };
+	std::mutex						m_WakeMutex;
+	std::condition_variable			m_Wake;
+	std::mutex						m_DoneMutex;
+	std::condition_variable			m_Done;
+	std::atomic<uint64_t>			m_Processed{ 0 };		// intents the thread has built
+	std::atomic<uint64_t>			m_Intents{ 0 };
+	std::atomic<uint64_t>			m_Builds{ 0 };
+	std::atomic<uint64_t>			m_Published{ 0 };
+	// Interactor side only.
+	uint64_t						m_Sent = 0;
+	std::vector<Intent>				m_Waiting;				// by key, see Post
+	std::vector<char>				m_IsWaiting;
+	int								m_WaitingCount = 0;
+	uint64_t						m_Taken = 0;
+	uint64_t						m_Overflows = 0;
 };
 
-vtkStandardNewMacro(vtkCustomInteractorStyleCamera);
+// One box widget: its six faces, their pipelines and the drag state.
+// Face i moves along FaceAxis(i) and Offsets[i] is how far it has moved from
+// Bounds, so even faces hold values in [0, range] and odd faces in
+// [-range, 0].  Every box owns its own state, so any number of them can
+// share a scene and an interactor style.
+class BoxROI
+{
+public:
+	// Axis each face moves along, and the faces bounding each axis.
+	static int FaceAxis(int i) { static const int axes[NUMOFPLANES] = { 2, 2, 0, 0, 1, 1 }; return axes[i]; }
+	static int MinFace(int axis) { static const int faces[3] = { 2, 4, 0 }; return faces[axis]; }
+	static int MaxFace(int axis) { static const int faces[3] = { 3, 5, 1 }; return faces[axis]; }
+
+	// Creates the six faces spanning bounds and adds them to the renderer,
+	// either as one actor per face or batched through one composite mapper
+	// where face i is block i + 1, moved by its own transform filter.
+	void Build(vtkRenderer* renderer, const double* bounds, bool composite)
+	{
+		this->Renderer = renderer;
+		std::copy(bounds, bounds + 6, this->Bounds);
+		std::fill(this->Offsets, this->Offsets + NUMOFPLANES, 0.0);
+		for (int i = 0; i < NUMOFPLANES; i++) {
+			this->PlaneSources[i] = vtkSmartPointer<vtkPlaneSource>::New();
+			this->PlaneSources[i]->SetXResolution(10);
+			this->PlaneSources[i]->SetYResolution(10);
+			this->Matrices[i] = vtkSmartPointer<vtkMatrix4x4>::New();
+		}
+		this->UpdateFaces();
+
+		if (composite) {
+			this->Blocks = vtkSmartPointer<vtkMultiBlockDataGroupFilter>::New();
+			for (int i = 0; i < NUMOFPLANES; i++) {
+				this->Transforms[i] = vtkSmartPointer<vtkMatrixToLinearTransform>::New();
+				this->Transforms[i]->SetInput(this->Matrices[i]);
+				this->TransformFilters[i] = vtkSmartPointer<vtkTransformPolyDataFilter>::New();
+				this->TransformFilters[i]->SetInputConnection(this->PlaneSources[i]->GetOutputPort());
+				this->TransformFilters[i]->SetTransform(this->Transforms[i]);
+				this->Blocks->AddInputConnection(this->TransformFilters[i]->GetOutputPort());
+			}
+			this->CompositeMapper = vtkSmartPointer<vtkFaceBlockMapper>::New();
+			this->CompositeMapper->SetInputConnection(this->Blocks->GetOutputPort());
+			for (int i = 0; i < NUMOFPLANES; i++) {
+				this->CompositeMapper->SetBlockOpacity(i + 1, 0.3);
+				this->CompositeMapper->SetBlockColor(i + 1, faceColor);
+			}
+			this->CompositeActor = vtkSmartPointer<vtkActor>::New();
+			this->CompositeActor->SetMapper(this->CompositeMapper);
+			this->CompositeActor->GetProperty()->SetOpacity(0.3);
+			renderer->AddActor(this->CompositeActor);
+			return;
+		}
+
+		for (int i = 0; i < NUMOFPLANES; i++) {
+			this->Mappers[i] = vtkSmartPointer<vtkPolyDataMapper>::New();
+			this->Mappers[i]->SetInputConnection(this->PlaneSources[i]->GetOutputPort());
+			this->Actors[i] = vtkSmartPointer<vtkActor>::New();
+			this->Actors[i]->SetMapper(this->Mappers[i]);
+			this->Actors[i]->GetProperty()->SetOpacity(0.3);
+			this->Actors[i]->SetUserMatrix(this->Matrices[i]);
+			renderer->AddActor(this->Actors[i]);
+		}
+	}
+
+	bool IsComposite() const { return this->CompositeMapper != nullptr; }
+	vtkFaceBlockMapper* GetCompositeMapper() const { return this->CompositeMapper; }
+	// The actor drawing face i (the shared actor when batched).
+	vtkActor* GetFaceActor(int i) const { return this->IsComposite() ? this->CompositeActor.Get() : this->Actors[i].Get(); }
+	vtkPlaneSource* GetPlaneSource(int i) const { return this->PlaneSources[i]; }
+	const double* GetBounds() const { return this->Bounds; }
+	// Bumped whenever the faces are rebuilt.
+	unsigned long GetVersion() const { return this->Version; }
+
+	// Sets all six face offsets at once (clamped to the bounds) and rebuilds
+	// the faces from them.
+	void SetFaceOffsets(const double* offsets)
+	{
+		for (int i = 0; i < NUMOFPLANES; i++) {
+			int j = FaceAxis(i);
+			double range = this->Bounds[2 * j + 1] - this->Bounds[2 * j];
+			this->Offsets[i] = i % 2 == 0 ? std::min(std::max(offsets[i], 0.0), range)
+				: std::min(std::max(offsets[i], -range), 0.0);
+		}
+		this->UpdateFaces();
+	}
+
+	// Moves the box to new bounds and offsets in one update.
+	void SetState(const double* bounds, const double* offsets)
+	{
+		std::copy(bounds, bounds + 6, this->Bounds);
+		this->SetFaceOffsets(offsets);
+	}
+
+	void GetFaceOffsets(double* offsets) const { std::copy(this->Offsets, this->Offsets + NUMOFPLANES, offsets); }
+	double GetFaceOffset(int i) const { return this->Offsets[i]; }
+
+	// Face offsets that put the box at box[6] (clamped to the bounds).
+	void GetFaceOffsetsForBox(const double* box, double* offsets) const
+	{
+		for (int j = 0; j < 3; j++) {
+			offsets[MinFace(j)] = box[2 * j] - this->Bounds[2 * j];
+			offsets[MaxFace(j)] = box[2 * j + 1] - this->Bounds[2 * j + 1];
+		}
+	}
+
+	// The current crop box: the bounds moved in by the face offsets.
+	void GetCropBox(double* box) const
+	{
+		for (int j = 0; j < 3; j++) {
+			box[2 * j] = this->Bounds[2 * j] + this->Offsets[MinFace(j)];
+			box[2 * j + 1] = this->Bounds[2 * j + 1] + this->Offsets[MaxFace(j)];
+		}
+	}
+
+	// Drags face i by delta along its axis.
+	void MoveFace(int i, double delta)
+	{
+		double offsets[NUMOFPLANES];
+		this->GetFaceOffsets(offsets);
+		offsets[i] += delta;
+		this->SetFaceOffsets(offsets);
+	}
+
+	// World-space origin, point1 and point2 of face i.
+	void GetFaceCorners(int i, double corners[3][3]) const
+	{
+		this->PlaneSources[i]->GetOrigin(corners[0]);
+		this->PlaneSources[i]->GetPoint1(corners[1]);
+		this->PlaneSources[i]->GetPoint2(corners[2]);
+		for (int c = 0; c < 3; c++)
+			corners[c][FaceAxis(i)] += this->Offsets[i];
+	}
+
+	void HighlightFace(int i, const double* color)
+	{
+		if (this->IsComposite())
+			this->CompositeMapper->SetBlockColor(i + 1, color);
+		else
+			this->Actors[i]->GetProperty()->SetColor(color[0], color[1], color[2]);
+	}
+
+	// Hands the faces over to pipeline, which builds them on its thread as
+	// box index.  The mappers then draw FaceOutputs, filled by ShowFace from
+	// what the thread built, and the plane sources here only hold the planes
+	// posted to it; they are never run again.
+	void SetPipeline(BoxPipelineThread* pipeline, int index)
+	{
+		this->Pipeline = pipeline;
+		this->PipelineIndex = index;
+		for (int i = 0; i < NUMOFPLANES; i++) {
+			// Drawn until the thread's first build of the face arrives.
+			this->PlaneSources[i]->Update();
+			this->FaceOutputs[i] = vtkSmartPointer<vtkPolyData>::New();
+			this->FaceOutputs[i]->ShallowCopy(this->PlaneSources[i]->GetOutput());
+			if (this->IsComposite())
+				this->TransformFilters[i]->SetInputData(this->FaceOutputs[i]);
+			else
+				this->Mappers[i]->SetInputData(this->FaceOutputs[i]);
+			this->GetFaceCorners(i, this->ShownCorners[i]);
+			this->ShownBuilds[i] = 0;
+			this->PostedMTimes[i] = 0;
+			this->PostedOffsets[i] = std::numeric_limits<double>::quiet_NaN();
+		}
+		this->PostChanges();
+	}
+
+	// Posts to the pipeline thread each face whose plane or offset changed
+	// since it was last posted.  The tessellation changes resolutions as a
+	// frame starts, so this runs then as well as after every move.
+	void PostChanges()
+	{
+		if (!this->Pipeline)
+			return;
+		for (int i = 0; i < NUMOFPLANES; i++) {
+			vtkPlaneSource* planeSource = this->PlaneSources[i];
+			if (planeSource->GetMTime() != this->PostedMTimes[i]) {
+				this->Pipeline->PostPlaneMoved(this->PipelineIndex, i, planeSource);
+				this->PostedMTimes[i] = planeSource->GetMTime();
+			}
+			if (this->Offsets[i] != this->PostedOffsets[i]) {
+				this->Pipeline->PostFaceMoved(this->PipelineIndex, i, this->Offsets[i]);
+				this->PostedOffsets[i] = this->Offsets[i];
+			}
+		}
+	}
+
+	// Draws face i as the pipeline thread built it.  Returns the axes, one
+	// bit each, along which the drawn face changed; none when only its
+	// tessellation did.
+	int ShowFace(int i, const BoxPipelineThread::FaceResult& result)
+	{
+		if (result.Build != this->ShownBuilds[i]) {
+			this->FaceOutputs[i]->ShallowCopy(result.Data);
+			this->ShownBuilds[i] = result.Build;
+		}
+		// The face moves with the geometry built for its offset.
+		if (result.Offset != this->AppliedOffsets[i]) {
+			this->Matrices[i]->SetElement(FaceAxis(i), 3, result.Offset);
+			this->AppliedOffsets[i] = result.Offset;
+		}
+		const double* planeCorners[3] = { result.Origin, result.Point1, result.Point2 };
+		int axes = 0;
+		for (int c = 0; c < 3; c++) {
+			for (int k = 0; k < 3; k++) {
+				double corner = planeCorners[c][k] + (k == FaceAxis(i) ? result.Offset : 0.0);
+				if (corner != this->ShownCorners[i][c][k])
+					axes |= 1 << k;
+				this->ShownCorners[i][c][k] = corner;
+			}
+		}
+		return axes;
+	}
+
+private:
+	// Each face stays on its base plane (moved by its matrix) and spans the
+	// current box on its two in-plane axes, inset by offset from the bounds.
+	void UpdateFaces()
+	{
+		double lo[3], hi[3];
+		for (int j = 0; j < 3; j++) {
+			double minEdge = this->Bounds[2 * j] + offset;
+			double maxEdge = this->Bounds[2 * j + 1] - offset;
+			lo[j] = std::min(std::max(this->Bounds[2 * j] + this->Offsets[MinFace(j)], minEdge), maxEdge);
+			hi[j] = std::min(std::max(this->Bounds[2 * j + 1] + this->Offsets[MaxFace(j)], minEdge), maxEdge);
+		}
+
+		// In-plane axes of each face: Point1 - Origin runs along u, Point2 - Origin along v.
+		static const int uAxis[NUMOFPLANES] = { 0, 0, 1, 1, 0, 0 };
+		static const int vAxis[NUMOFPLANES] = { 1, 1, 2, 2, 2, 2 };
+		for (int i = 0; i < NUMOFPLANES; i++) {
+			int n = FaceAxis(i), u = uAxis[i], v = vAxis[i];
+			double origin[3], pt1[3], pt2[3];
+			origin[n] = pt1[n] = pt2[n] = this->Bounds[2 * n + i % 2];
+			origin[u] = lo[u]; origin[v] = lo[v];
+			pt1[u] = hi[u]; pt1[v] = lo[v];
+			pt2[u] = lo[u]; pt2[v] = hi[v];
+			// Faces that did not change keep their pipeline up to date.
+			vtkPlaneSource* planeSource = this->PlaneSources[i];
+			if (!std::equal(origin, origin + 3, planeSource->GetOrigin()) ||
+				!std::equal(pt1, pt1 + 3, planeSource->GetPoint1()) ||
+				!std::equal(pt2, pt2 + 3, planeSource->GetPoint2())) {
+				planeSource->SetOrigin(origin);
+				planeSource->SetPoint1(pt1);
+				planeSource->SetPoint2(pt2);
+			}
+
+			// The translation is written in place: rebuilding a vtkTransform
+			// allocates a new matrix on every step.  SetElement marks the
+			// matrix modified, which the actor or transform filter picks up.
+			// With a pipeline thread the matrix moves in ShowFace instead.
+			if (!this->Pipeline && this->Offsets[i] != this->AppliedOffsets[i]) {
+				this->Matrices[i]->SetElement(n, 3, this->Offsets[i]);
+				this->AppliedOffsets[i] = this->Offsets[i];
+			}
+		}
+		this->Version++;
+		this->PostChanges();
+	}
+
+	vtkRenderer*	Renderer = nullptr;
+	double			Bounds[6]{ 0, 0, 0, 0, 0, 0 };
+	double			Offsets[NUMOFPLANES]{ 0, 0, 0, 0, 0, 0 };
+	double			AppliedOffsets[NUMOFPLANES]{ 0, 0, 0, 0, 0, 0 };	// offsets the matrices hold
+	unsigned long	Version = 0;
+	std::array<vtkSmartPointer<vtkPlaneSource>, NUMOFPLANES>				PlaneSources;
+	std::array<vtkSmartPointer<vtkMatrix4x4>, NUMOFPLANES>					Matrices;	// moves face i along its axis
+	std::array<vtkSmartPointer<vtkMatrixToLinearTransform>, NUMOFPLANES>	Transforms;	// Matrices, for the transform filters
+	std::array<vtkSmartPointer<vtkPolyDataMapper>, NUMOFPLANES>				Mappers;
+	std::array<vtkSmartPointer<vtkActor>, NUMOFPLANES>						Actors;
+	std::array<vtkSmartPointer<vtkTransformPolyDataFilter>, NUMOFPLANES>	TransformFilters;
+	vtkSmartPointer<vtkMultiBlockDataGroupFilter>	Blocks;
+	vtkSmartPointer<vtkFaceBlockMapper>				CompositeMapper;
+	vtkSmartPointer<vtkActor>						CompositeActor;
+	// Set by SetPipeline.
+	BoxPipelineThread*	Pipeline = nullptr;
+	int					PipelineIndex = -1;
+	std::array<vtkSmartPointer<vtkPolyData>, NUMOFPLANES>	FaceOutputs;	// what the mappers draw
+	vtkMTimeType		PostedMTimes[NUMOFPLANES]{ 0, 0, 0, 0, 0, 0 };
+	double				PostedOffsets[NUMOFPLANES]{ 0, 0, 0, 0, 0, 0 };
+	uint64_t			ShownBuilds[NUMOFPLANES]{ 0, 0, 0, 0, 0, 0 };
+	double				ShownCorners[NUMOFPLANES][3][3];
+};
+
+// Undo history of face moves.  Each finished drag is one 8-byte entry (box,
+// face and how far the face moved), and every CheckpointInterval entries
+// the offsets of all boxes are saved, so any point in the history is
+// reached by restoring the checkpoint before it and replaying fewer than
+// CheckpointInterval entries, however long the history is.
+class EditJournal
+{
+public:
+	static const size_t CheckpointInterval = 64;
+
+	// Starts an empty history at the boxes' current state.
+	void Reset(const std::vector<BoxROI*>& rois)
+	{
+		this->Entries.clear();
+		this->Checkpoints.clear();
+		this->Position = 0;
+		this->Checkpoints.push_back(Snapshot(rois));
+	}
+
+	// Adds a move made at the current position, dropping any redo history.
+	void Record(const std::vector<BoxROI*>& rois, int roi, int face, double delta)
+	{
+		this->Entries.resize(this->Position);
+		this->Checkpoints.resize(this->Position / CheckpointInterval + 1);
+		Entry entry;
+		entry.roi = (uint16_t)roi;
+		entry.face = (uint8_t)face;
+		entry.delta = (float)delta;
+		this->Entries.push_back(entry);
+		this->Position++;
+		if (this->Position % CheckpointInterval == 0)
+			this->Checkpoints.push_back(Snapshot(rois));
+	}
+
+	size_t GetPosition() const { return this->Position; }
+	size_t GetSize() const { return this->Entries.size(); }
+	size_t GetMemorySize() const
+	{
+		size_t bytes = this->Entries.capacity() * sizeof(Entry);
+		for (const std::vector<double>& checkpoint : this->Checkpoints)
+			bytes += checkpoint.capacity() * sizeof(double);
+		return bytes;
+	}
+
+	// Moves the boxes to the state after the first position edits.  A single
+	// step applies one entry; longer jumps go through the nearest checkpoint.
+	// Returns the axis that changed for a single step, -1 otherwise.
+	int JumpTo(const std::vector<BoxROI*>& rois, size_t position)
+	{
+		position = std::min(position, this->Entries.size());
+		int axis = -1;
+		if (position + 1 == this->Position) {
+			axis = this->Apply(rois, this->Entries[position], -1);
+		}
+		else if (position == this->Position + 1) {
+			axis = this->Apply(rois, this->Entries[this->Position], 1);
+		}
+		else if (position != this->Position) {
+			size_t checkpoint = position / CheckpointInterval;
+			const std::vector<double>& offsets = this->Checkpoints[checkpoint];
+			for (size_t r = 0; r < rois.size(); r++)
+				rois[r]->SetFaceOffsets(&offsets[NUMOFPLANES * r]);
+			for (size_t e = checkpoint * CheckpointInterval; e < position; e++)
+				this->Apply(rois, this->Entries[e], 1);
+		}
+		this->Position = position;
+		return axis;
+	}
+
+private:
+	struct Entry
+	{
+		uint16_t	roi;
+		uint8_t		face;
+		float		delta;
+	};
+
+	static std::vector<double> Snapshot(const std::vector<BoxROI*>& rois)
+	{
+		std::vector<double> offsets(NUMOFPLANES * rois.size());
+		for (size_t r = 0; r < rois.size(); r++)
+			rois[r]->GetFaceOffsets(&offsets[NUMOFPLANES * r]);
+		return offsets;
+	}
+
+	static int Apply(const std::vector<BoxROI*>& rois, const Entry& entry, int direction)
+	{
+		rois[entry.roi]->MoveFace(entry.face, direction * entry.delta);
+		return BoxROI::FaceAxis(entry.face);
+	}
+
+	std::vector<Entry>					Entries;
+	std::vector<std::vector<double>>	Checkpoints;	// Checkpoints[c]: offsets after c * CheckpointInterval edits
+	size_t								Position = 0;
+};
+
+// Bounding volume hierarchy over the faces of every box.  Clicks and hovers
+// cast one ray through it instead of asking the renderer to pick, so their
+// cost grows with the tree depth rather than with the number of boxes.  The
+// tree is rebuilt from the boxes whenever a face has moved.
+class FacePickIndex
+{
+public:
+	struct Hit
+	{
+		int		roi = -1;
+		int		face = -1;
+		double	t = std::numeric_limits<double>::max();
+	};
+
+	void Build(const std::vector<BoxROI*>& rois)
+	{
+		this->Entries.clear();
+		this->Nodes.clear();
+		for (size_t r = 0; r < rois.size(); r++) {
+			for (int i = 0; i < NUMOFPLANES; i++) {
+				Entry entry;
+				entry.roi = (int)r;
+				entry.face = i;
+				rois[r]->GetFaceCorners(i, entry.corners);
+				for (int k = 0; k < 3; k++) {
+					// The fourth corner is point1 + point2 - origin.
+					double fourth = entry.corners[1][k] + entry.corners[2][k] - entry.corners[0][k];
+					entry.bounds[2 * k] = std::min({ entry.corners[0][k], entry.corners[1][k], entry.corners[2][k], fourth });
+					entry.bounds[2 * k + 1] = std::max({ entry.corners[0][k], entry.corners[1][k], entry.corners[2][k], fourth });
+				}
+				this->Entries.push_back(entry);
+			}
+		}
+		if (!this->Entries.empty())
+			this->BuildNode(0, (int)this->Entries.size());
+	}
+
+	size_t GetNumberOfFaces() const { return this->Entries.size(); }
+
+	// Nearest face hit by the ray origin + t * direction, t >= 0.
+	Hit Pick(const double* origin, const double* direction) const
+	{
+		Hit hit;
+		if (this->Nodes.empty())
+			return hit;
+		// Median splits keep the tree under 32 levels deep, so the
+		// traversal stack never needs more than one entry per level plus one.
+		int stack[64];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0) {
+			const Node& node = this->Nodes[stack[--top]];
+			if (!RayHitsBounds(node.bounds, origin, direction, hit.t))
+				continue;
+			if (node.left < 0) {
+				for (int e = node.begin; e < node.end; e++) {
+					double t;
+					if (RayHitsFace(this->Entries[e], origin, direction, t) && t < hit.t) {
+						hit.roi = this->Entries[e].roi;
+						hit.face = this->Entries[e].face;
+						hit.t = t;
+					}
+				}
+			}
+			else {
+				stack[top++] = node.left;
+				stack[top++] = node.right;
+			}
+		}
+		return hit;
+	}
+
+private:
+	struct Entry
+	{
+		int		roi;
+		int		face;
+		double	corners[3][3];
+		double	bounds[6];
+	};
+
+	struct Node
+	{
+		double	bounds[6];
+		int		begin;
+		int		end;
+		int		left = -1;
+		int		right = -1;
+	};
+
+	static const int LeafSize = 4;
+
+	// Splits entries [begin, end) at the median centre along the longest axis.
+	int BuildNode(int begin, int end)
+	{
+		int index = (int)this->Nodes.size();
+		this->Nodes.push_back(Node());
+		Node node;
+		node.begin = begin;
+		node.end = end;
+		for (int k = 0; k < 3; k++) {
+			node.bounds[2 * k] = std::numeric_limits<double>::max();
+			node.bounds[2 * k + 1] = -std::numeric_limits<double>::max();
+		}
+		for (int e = begin; e < end; e++) {
+			for (int k = 0; k < 3; k++) {
+				node.bounds[2 * k] = std::min(node.bounds[2 * k], this->Entries[e].bounds[2 * k]);
+				node.bounds[2 * k + 1] = std::max(node.bounds[2 * k + 1], this->Entries[e].bounds[2 * k + 1]);
+			}
+		}
+		if (end - begin > LeafSize) {
+			int axis = 0;
+			for (int k = 1; k < 3; k++) {
+				if (node.bounds[2 * k + 1] - node.bounds[2 * k] > node.bounds[2 * axis + 1] - node.bounds[2 * axis])
+					axis = k;
+			}
+			int middle = (begin + end) / 2;
+			std::nth_element(this->Entries.begin() + begin, this->Entries.begin() + middle, this->Entries.begin() + end,
+				[axis](const Entry& a, const Entry& b) {
+				return a.bounds[2 * axis] + a.bounds[2 * axis + 1] < b.bounds[2 * axis] + b.bounds[2 * axis + 1];
+			});
+			node.left = this->BuildNode(begin, middle);
+			node.right = this->BuildNode(middle, end);
+		}
+		this->Nodes[index] = node;
+		return index;
+	}
+
+	// Slab test against a box, padded because faces have no thickness.
+	static bool RayHitsBounds(const double* bounds, const double* origin, const double* direction, double tMax)
+	{
+		const double pad = 1e-6;
+		double tMin = 0;
+		for (int k = 0; k < 3; k++) {
+			double lo = bounds[2 * k] - pad, hi = bounds[2 * k + 1] + pad;
+			if (direction[k] == 0) {
+				if (origin[k] < lo || origin[k] > hi)
+					return false;
+				continue;
+			}
+			double t0 = (lo - origin[k]) / direction[k];
+			double t1 = (hi - origin[k]) / direction[k];
+			if (t0 > t1)
+				std::swap(t0, t1);
+			tMin = std::max(tMin, t0);
+			tMax = std::min(tMax, t1);
+			if (tMin > tMax)
+				return false;
+		}
+		return true;
+	}
+
+	static bool RayHitsFace(const Entry& entry, const double* origin, const double* direction, double& t)
+	{
+		double edge1[3], edge2[3], normal[3], toFace[3];
+		vtkMath::Subtract(entry.corners[1], entry.corners[0], edge1);
+		vtkMath::Subtract(entry.corners[2], entry.corners[0], edge2);
+		vtkMath::Cross(edge1, edge2, normal);
+		double denominator = vtkMath::Dot(normal, direction);
+		if (denominator == 0)
+			return false;
+		vtkMath::Subtract(entry.corners[0], origin, toFace);
+		t = vtkMath::Dot(normal, toFace) / denominator;
+		if (t < 0)
+			return false;
+		double q[3];
+		for (int k = 0; k < 3; k++)
+			q[k] = origin[k] + t * direction[k] - entry.corners[0][k];
+		double s = vtkMath::Dot(q, edge1) / vtkMath::Dot(edge1, edge1);
+		double u = vtkMath::Dot(q, edge2) / vtkMath::Dot(edge2, edge2);
+		return s >= 0 && s <= 1 && u >= 0 && u <= 1;
+	}
+
+	std::vector<Entry>	Entries;
+	std::vector<Node>	Nodes;
+};
+
+class vtkCustomInteractorStyleCamera;
+
+class vtkCustomInteractorStyle : public vtkInteractorStyleTrackballActor
+{
+public:
+	static vtkCustomInteractorStyle* New();
+	vtkTypeMacro(vtkCustomInteractorStyle, vtkInteractorStyleTrackballActor);
+	virtual void OnLeftButtonDown() override
+	{
+		AllocationStats::Scope accounting(AllocationStats::Press);
+		int clickPos[2];
+		this->Interactor->GetEventPosition(clickPos);
+		vtkRenderer* renderer = this->GetPokedRenderer(clickPos[0], clickPos[1]);
+		FacePickIndex::Hit hit = this->PickFace(renderer, clickPos[0], clickPos[1]);
+		if (hit.roi >= 0)
+		{
+			this->Interactor->GetEventPosition(this->LastPos);
+			// The drag is measured in the viewport it started in.
+			m_DragRenderer = renderer;
+			this->SetHover(-1, -1);
+			m_ROI = hit.roi;
+			m_Face = hit.face;
+			m_DragStart = m_ROIs[m_ROI]->GetFaceOffset(m_Face);
+			m_ROIs[m_ROI]->HighlightFace(m_Face, highlightColor);
+			// Switch the render window to the interactive update rate for the drag.
+			this->StartInteraction();
+			this->InvokeEvent(vtkCommand::StartInteractionEvent, nullptr);
+		}
+		else {
+			//vtkInteractorStyleTrackballActor::OnLeftButtonDown();
+		}
+	}
+
+
+	virtual void OnMouseMove() override
+	{
+		AllocationStats::Scope accounting(m_ROI >= 0 ? AllocationStats::Drag : AllocationStats::Hover);
+		if (m_ROI >= 0)
+		{
+
+			vtkCamera* camera = m_DragRenderer->GetActiveCamera();
+			if (!camera) {
+				std::cerr << "Camera is null" << std::endl;
+				return;
+			}
+
+			double	new_pick_point[4] = { 0 };
+			double	old_pick_point[4] = { 0 };
+			double	motion_vector[3] = { 0 };
+			int		currPos[2];
+
+			this->Interactor->GetEventPosition(currPos);
+
+			double  displayCurrPos[3] = { currPos[0], currPos[1], 0 };
+			double  displayLastPos[3] = { LastPos[0], LastPos[1], 0 };
+			m_DragRenderer->SetDisplayPoint(displayCurrPos);
+			m_DragRenderer->DisplayToWorld();
+			m_DragRenderer->GetWorldPoint(new_pick_point);
+
+			m_DragRenderer->SetDisplayPoint(displayLastPos);
+			m_DragRenderer->DisplayToWorld();
+			m_DragRenderer->GetWorldPoint(old_pick_point);
+
+			if (new_pick_point[3] == 0.0) {
+				std::cerr << "Invalid world coordinates! w component of new_pick_point is zero. " << std::endl;
+				return;
+			}
+			else {
+				for (int n = 0; n < 3; n++)
+					new_pick_point[n] /= new_pick_point[3];
+			}
+
+			if (old_pick_point[3] == 0.0) {
+				std::cerr << "Invalid world coordinates! w component of old_pick_point is zero. " << std::endl;
+				return;
+			}
+			else {
+				for (int n = 0; n < 3; n++)
+					old_pick_point[n] /= old_pick_point[3];
+			}
+
+			for (int n = 0; n < 3; n++) {
+				motion_vector[n] = new_pick_point[n] - old_pick_point[n];
+			}
+
+			int j = BoxROI::FaceAxis(m_Face);
+			if (motion_vector[j] > 0)
+				m_ROIs[m_ROI]->MoveFace(m_Face, increamentXYZ);
+			else if (motion_vector[j] < 0)
+				m_ROIs[m_ROI]->MoveFace(m_Face, -increamentXYZ);
+			// Tells linked views which axis the box changed along.
+			this->BoxesChanged(&j);
+
+			this->RenderFrame();
+
+			this->LastPos[0] = currPos[0];
+			this->LastPos[1] = currPos[1];
+		}
+		else {
+			int pos[2];
+			this->Interactor->GetEventPosition(pos);
+			FacePickIndex::Hit hit = this->PickFace(this->GetPokedRenderer(pos[0], pos[1]), pos[0], pos[1]);
+			if (hit.roi != m_HoverROI || hit.face != m_HoverFace) {
+				this->SetHover(hit.roi, hit.face);
+				this->RenderFrame();
+			}
+		}
+	}
+
+	virtual void OnLeftButtonUp() override
+	{
+		AllocationStats::Scope accounting(AllocationStats::Release);
+		if (m_ROI >= 0) {
+			m_ROIs[m_ROI]->HighlightFace(m_Face, faceColor);
+			double moved = m_ROIs[m_ROI]->GetFaceOffset(m_Face) - m_DragStart;
+			if (moved != 0)
+				m_Journal.Record(m_ROIs, m_ROI, m_Face, moved);
+			m_ROI = m_Face = -1;
+			this->EndInteraction();
+			this->InvokeEvent(vtkCommand::EndInteractionEvent, nullptr);
+		}
+		//vtkInteractorStyleTrackballActor::OnLeftButtonUp();
+	}
+
+	void SetRenderer(vtkRenderer* renderer) {
+		this->Renderer = renderer;
+	}
+
+	void SetROIs(const std::vector<BoxROI*>& rois)
+	{
+		m_ROIs = rois;
+		m_IndexDirty = true;
+		m_Journal.Reset(m_ROIs);
+	}
+
+	// Mode switches are posted to pipeline, when set, which keeps its
+	// thread awake between drag steps in actor mode.
+	void SetPipelineThread(BoxPipelineThread* pipeline) { m_Pipeline = pipeline; }
+
+	void ModeToggled(bool actorMode)
+	{
+		if (m_Pipeline)
+			m_Pipeline->PostModeToggled(actorMode);
+	}
+
+	// Undo history: 'z' undoes, 'y' redoes, Home and End jump to either end
+	// and 'h' prints where the history stands.  Returns true if the boxes
+	// changed and the window needs a render.
+	bool OnHistoryKey(const std::string& key)
+	{
+		size_t position = m_Journal.GetPosition();
+		if (key == "z" && position > 0)
+			return this->JumpToEdit(position - 1);
+		if (key == "y")
+			return this->JumpToEdit(position + 1);
+		if (key == "Home")
+			return this->JumpToEdit(0);
+		if (key == "End")
+			return this->JumpToEdit(m_Journal.GetSize());
+		if (key == "h") {
+			std::cout << "history: edit " << m_Journal.GetPosition() << " of " << m_Journal.GetSize() << ", "
+				<< m_Journal.GetMemorySize() << " bytes" << std::endl;
+		}
+		return false;
+	}
+
+	bool JumpToEdit(size_t position)
+	{
+		if (m_ROI >= 0 || position == m_Journal.GetPosition() || position > m_Journal.GetSize())
+			return false;
+		int axis = m_Journal.JumpTo(m_ROIs, position);
+		this->BoxesChanged(axis >= 0 ? &axis : nullptr);
+		return true;
+	}
+
+	// Box observers get an InteractionEvent, with the axis a single face moved
+	// along, whenever the boxes change.  They are called directly rather than
+	// through InvokeEvent, whose observer bookkeeping allocates on every call
+	// and would put an allocation in every drag event.
+	void AddBoxObserver(vtkCommand* observer)
+	{
+		m_BoxObservers.push_back(observer);
+	}
+
+	// Tells the box observers that the boxes were changed from outside the
+	// style, along axis or, when it is -1, not along any one axis.
+	void NotifyBoxesChanged(int axis = -1)
+	{
+		this->BoxesChanged(axis >= 0 ? &axis : nullptr);
+	}
+
+	virtual void OnKeyPress() override
+	{
+		std::string key = this->GetInteractor()->GetKeySym();
+		if (key == "c") // Press 'c' to switch mode
+		{
+			// A mode switch ends any drag in progress.
+			if (m_ROI >= 0)
+				m_ROIs[m_ROI]->HighlightFace(m_Face, faceColor);
+			m_ROI = m_Face = -1;
+			this->SetHover(-1, -1);
+			this->EndInteraction();
+			this->InvokeEvent(vtkCommand::EndInteractionEvent, nullptr);
+			this->CurrentStyle = this->CameraStyle;
+			std::cout << "Switched to Camera Mode" << std::endl;
+			this->ModeToggled(false);
+
+			this->GetInteractor()->SetInteractorStyle(this->CurrentStyle);
+		}
+		else if (this->OnHistoryKey(key)) {
+			this->Interactor->Render();
+		}
+		//this->CurrentStyle->OnKeyPress();
+	}
+
+	void SetStyle(vtkSmartPointer<vtkCustomInteractorStyleCamera> pCameraStyle,
+		vtkSmartPointer<vtkInteractorStyle> pCurrentStyle)
+	{
+		this->CameraStyle = pCameraStyle;
+		this->CurrentStyle = pCurrentStyle;
+	}
+
+private:
+	void BoxesChanged(int* axis)
+	{
+		for (vtkCommand* observer : m_BoxObservers)
+			observer->Execute(this, vtkCommand::InteractionEvent, axis);
+	}
+
+	void RenderFrame()
+	{
+		AllocationStats::Scope accounting(AllocationStats::Render);
+		this->Interactor->Render();
+	}
+
+	// Casts the ray under a display position through the face index, which
+	// is rebuilt first if any box has changed since the last pick.
+	FacePickIndex::Hit PickFace(vtkRenderer* renderer, int x, int y)
+	{
+		unsigned long version = 0;
+		for (BoxROI* roi : m_ROIs)
+			version += roi->GetVersion();
+		if (m_IndexDirty || version != m_IndexVersion) {
+			m_PickIndex.Build(m_ROIs);
+			m_IndexDirty = false;
+			m_IndexVersion = version;
+		}
+		double nearPoint[4], farPoint[4], direction[3];
+		renderer->SetDisplayPoint(x, y, 0);
+		renderer->DisplayToWorld();
+		renderer->GetWorldPoint(nearPoint);
+		renderer->SetDisplayPoint(x, y, 1);
+		renderer->DisplayToWorld();
+		renderer->GetWorldPoint(farPoint);
+		if (nearPoint[3] == 0.0 || farPoint[3] == 0.0)
+			return FacePickIndex::Hit();
+		for (int n = 0; n < 3; n++) {
+			nearPoint[n] /= nearPoint[3];
+			direction[n] = farPoint[n] / farPoint[3] - nearPoint[n];
+		}
+		return m_PickIndex.Pick(nearPoint, direction);
+	}
+
+	// The viewport under a display position; the boxes show in all of them.
+	vtkRenderer* GetPokedRenderer(int x, int y)
+	{
+		vtkRenderer* renderer = this->Interactor->FindPokedRenderer(x, y);
+		return renderer ? renderer : this->Renderer.Get();
+	}
+
+	void SetHover(int roi, int face)
+	{
+		if (m_HoverROI >= 0)
+			m_ROIs[m_HoverROI]->HighlightFace(m_HoverFace, faceColor);
+		m_HoverROI = roi;
+		m_HoverFace = face;
+		if (m_HoverROI >= 0)
+			m_ROIs[m_HoverROI]->HighlightFace(m_HoverFace, hoverColor);
+	}
+
+	vtkSmartPointer<vtkRenderer>	Renderer = nullptr;
+	std::vector<BoxROI*>			m_ROIs;
+	FacePickIndex					m_PickIndex;
+	bool							m_IndexDirty = true;
+	unsigned long					m_IndexVersion = 0;
+	int								m_ROI = -1;			// box being dragged
+	int								m_Face = -1;		// face being dragged
+	vtkRenderer*					m_DragRenderer = nullptr;
+	double							m_DragStart = 0;	// offset of the dragged face when the drag began
+	BoxPipelineThread*				m_Pipeline = nullptr;
+	EditJournal						m_Journal;
+	std::vector<vtkSmartPointer<vtkCommand>>	m_BoxObservers;
+	int								m_HoverROI = -1;
+	int								m_HoverFace = -1;
+	int								LastPos[2]{ 0, 0 };
+	vtkSmartPointer<vtkCustomInteractorStyleCamera> CameraStyle;
+	vtkSmartPointer<vtkInteractorStyle> CurrentStyle;
+
+};
+
+vtkStandardNewMacro(vtkCustomInteractorStyle);
+
+class vtkCustomInteractorStyleCamera : public vtkInteractorStyleTrackballCamera
+{
+public:
+	static vtkCustomInteractorStyleCamera* New();
+	vtkTypeMacro(vtkCustomInteractorStyleCamera, vtkInteractorStyleTrackballCamera);
+
+
+	vtkCustomInteractorStyleCamera()
+	{
+		this->ActorStyle = vtkSmartPointer<vtkCustomInteractorStyle>::New();
+		this->CurrentStyle = vtkSmartPointer<vtkInteractorStyle>::New();
+		this->ActorStyle->SetStyle(this, CurrentStyle);
+	}
+
+	virtual void OnKeyPress() override
+	{
+		std::string key = this->GetInteractor()->GetKeySym();
+		if (key == "c") // Press 'c' to switch mode
+		{
+			this->InvokeEvent(vtkCommand::EndInteractionEvent, nullptr);
+			this->CurrentStyle = this->ActorStyle;
+			std::cout << "Switched to Actor Mode" << std::endl;
+			this->ActorStyle->ModeToggled(true);
+			this->GetInteractor()->SetInteractorStyle(this->CurrentStyle);
+		}
+		else if (this->ActorStyle->OnHistoryKey(key)) {
+			this->Interactor->Render();
+		}
+		//this->CurrentStyle->OnKeyPress();
+	}
+
+	void SetRenderer(vtkRenderer* renderer) { this->ActorStyle->SetRenderer(renderer); }
+	void SetROIs(const std::vector<BoxROI*>& rois) { this->ActorStyle->SetROIs(rois); }
+
+	vtkSmartPointer<vtkCustomInteractorStyle> ActorStyle;
+	vtkSmartPointer<vtkInteractorStyle> CurrentStyle;
+};
+
+vtkStandardNewMacro(vtkCustomInteractorStyleCamera);
+
+// Octree over a large point cloud.  Points are Morton-sorted once at load so
+// every node owns a contiguous range of m_Points, and each leaf range is
+// shuffled so that any prefix of it is a uniform subsample of the leaf.
+class PointCloudOctree
+{
+public:
+	struct Node
+	{
+		double	bounds[6];
+		size_t	begin;
+		size_t	end;
+		int		children[8];
+		bool	leaf;
+	};
+
+	struct SelectStats
+	{
+		size_t	nodesVisited = 0;
+		size_t	nodesCulled = 0;
+		size_t	pointsTested = 0;
+		size_t	pointsSelected = 0;
+		double	milliseconds = 0;
+	};
+
+	// Takes ownership of xyz (3 floats per point), maps it uniformly into
+	// cube[6] and builds the tree.
+	void Build(std::vector<float>& xyz, const double* cube, size_t leafSize)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		const size_t numPoints = xyz.size() / 3;
+		for (int n = 0; n < 6; n++)
+			m_Cube[n] = cube[n];
+
+		// Fit the cloud into the cube, keeping its aspect ratio.
+		double cloudBounds[6] = { VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX, VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX, VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX };
+		for (size_t p = 0; p < numPoints; p++) {
+			for (int j = 0; j < 3; j++) {
+				cloudBounds[2 * j] = std::min(cloudBounds[2 * j], (double)xyz[3 * p + j]);
+				cloudBounds[2 * j + 1] = std::max(cloudBounds[2 * j + 1], (double)xyz[3 * p + j]);
+			}
+		}
+		double extent = 0;
+		for (int j = 0; j < 3; j++)
+			extent = std::max(extent, cloudBounds[2 * j + 1] - cloudBounds[2 * j]);
+		const double cubeSize = cube[1] - cube[0];
+		const double scale = extent > 0 ? cubeSize / extent : 1.0;
+		double shift[3];
+		for (int j = 0; j < 3; j++)
+			shift[j] = 0.5 * (cube[2 * j] + cube[2 * j + 1]) - 0.5 * (cloudBounds[2 * j] + cloudBounds[2 * j + 1]) * scale;
+
+		std::vector<MortonPoint> sorted(numPoints);
+		const double quantize = (double)(1 << MortonBits) / cubeSize;
+		vtkSMPTools::For(0, (vtkIdType)numPoints, [&](vtkIdType first, vtkIdType last) {
+			for (vtkIdType p = first; p < last; p++) {
+				uint64_t q[3];
+				for (int j = 0; j < 3; j++) {
+					float v = (float)(xyz[3 * p + j] * scale + shift[j]);
+					sorted[p].xyz[j] = v;
+					double c = (v - cube[2 * j]) * quantize;
+					q[j] = (uint64_t)std::min(std::max(c, 0.0), (double)((1 << MortonBits) - 1));
+				}
+				sorted[p].code = (SpreadBits(q[0]) << 2) | (SpreadBits(q[1]) << 1) | SpreadBits(q[2]);
+			}
+		});
+		std::vector<float>().swap(xyz);
+		vtkSMPTools::Sort(sorted.begin(), sorted.end(),
+			[](const MortonPoint& a, const MortonPoint& b) { return a.code < b.code; });
+
+		m_Nodes.clear();
+		m_LeafSize = std::max<size_t>(leafSize, 1);
+		BuildNode(sorted, 0, numPoints, 0, 0, cube);
+
+		m_Points.resize(3 * numPoints);
+		vtkSMPTools::For(0, (vtkIdType)numPoints, [&](vtkIdType first, vtkIdType last) {
+			for (vtkIdType p = first; p < last; p++)
+				std::copy(sorted[p].xyz, sorted[p].xyz + 3, &m_Points[3 * p]);
+		});
+		std::vector<MortonPoint>().swap(sorted);
+
+		std::vector<int> leaves;
+		for (size_t n = 0; n < m_Nodes.size(); n++)
+			if (m_Nodes[n].leaf)
+				leaves.push_back((int)n);
+		vtkSMPTools::For(0, (vtkIdType)leaves.size(), [&](vtkIdType first, vtkIdType last) {
+			for (vtkIdType l = first; l < last; l++) {
+				const Node& node = m_Nodes[leaves[l]];
+				std::mt19937 rng((unsigned)node.begin);
+				for (size_t p = node.end - node.begin; p > 1; p--) {
+					size_t q = std::uniform_int_distribution<size_t>(0, p - 1)(rng);
+					std::swap_ranges(&m_Points[3 * (node.begin + p - 1)], &m_Points[3 * (node.begin + p - 1)] + 3,
+						&m_Points[3 * (node.begin + q)]);
+				}
+			}
+		});
+		m_NumLeaves = leaves.size();
+		m_BuildMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+	}
+
+	// Appends to out the points of every node that intersects both the
+	// frustum and the crop box, at a density of about pointsPerPixel per
+	// projected pixel of the node and never more than budget in total.
+	// Nodes wholly inside the crop box are copied without per-point tests.
+	SelectStats Select(const double* frustumPlanes, const double* box, const double* eye,
+		double pixelsPerRadian, bool parallel, double parallelPixels,
+		double pointsPerPixel, size_t budget, vtkFloatArray* out)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		SelectStats stats;
+		m_Queue.clear();
+		float* dst = out->WritePointer(0, 3 * std::min(budget, NumberOfPoints()));
+		size_t count = 0;
+		if (!m_Nodes.empty())
+			m_Queue.push_back({ ProjectedPixels(m_Nodes[0].bounds, eye, pixelsPerRadian, parallel, parallelPixels), 0 });
+
+		while (!m_Queue.empty() && count < budget) {
+			std::pop_heap(m_Queue.begin(), m_Queue.end());
+			QueueEntry entry = m_Queue.back();
+			m_Queue.pop_back();
+			const Node& node = m_Nodes[entry.node];
+			stats.nodesVisited++;
+
+			bool insideBox = true;
+			if (!IntersectsBox(node.bounds, box, insideBox) || !IntersectsFrustum(node.bounds, frustumPlanes)) {
+				stats.nodesCulled++;
+				continue;
+			}
+
+			// The camera inside a node gives it an unbounded screen size: always refine it.
+			const bool cameraInside = entry.pixels == std::numeric_limits<double>::max();
+			const size_t numPoints = node.end - node.begin;
+			const double target = pointsPerPixel * entry.pixels * entry.pixels;
+			if (node.leaf || (!cameraInside && (double)numPoints <= target)) {
+				size_t take = std::min(numPoints, budget - count);
+				if (node.leaf && target < (double)take)
+					take = std::max<size_t>((size_t)target, 1);
+				const float* src = &m_Points[3 * node.begin];
+				if (insideBox) {
+					std::copy(src, src + 3 * take, dst + 3 * count);
+					count += take;
+				}
+				else {
+					stats.pointsTested += take;
+					for (size_t p = 0; p < take; p++, src += 3) {
+						if (src[0] >= box[0] && src[0] <= box[1] && src[1] >= box[2] && src[1] <= box[3] &&
+							src[2] >= box[4] && src[2] <= box[5]) {
+							std::copy(src, src + 3, dst + 3 * count);
+							count++;
+						}
+					}
+				}
+				continue;
+			}
+
+			for (int c = 0; c < 8; c++) {
+				if (node.children[c] < 0)
+					continue;
+				m_Queue.push_back({ ProjectedPixels(m_Nodes[node.children[c]].bounds, eye, pixelsPerRadian,
+					parallel, parallelPixels), node.children[c] });
+				std::push_heap(m_Queue.begin(), m_Queue.end());
+			}
+		}
+
+		out->SetNumberOfTuples((vtkIdType)count);
+		out->Modified();
+		stats.pointsSelected = count;
+		stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		return stats;
+	}
+
+	size_t NumberOfPoints() const { return m_Points.size() / 3; }
+	size_t NumberOfNodes() const { return m_Nodes.size(); }
+	size_t NumberOfLeaves() const { return m_NumLeaves; }
+	double GetBuildMilliseconds() const { return m_BuildMilliseconds; }
+
+private:
+	static const int MortonBits = 21;
+
+	struct MortonPoint
+	{
+		uint64_t	code;
+		float		xyz[3];
+	};
+
+	struct QueueEntry
+	{
+		double	pixels;
+		int		node;
+		bool operator<(const QueueEntry& other) const { return pixels < other.pixels; }
+	};
+
+	static uint64_t SpreadBits(uint64_t v)
+	{
+		v &= 0x1fffff;
+		v = (v | v << 32) & 0x1f00000000ffff;
+		v = (v | v << 16) & 0x1f0000ff0000ff;
+		v = (v | v << 8) & 0x100f00f00f00f00f;
+		v = (v | v << 4) & 0x10c30c30c30c30c3;
+		v = (v | v << 2) & 0x1249249249249249;
+		return v;
+	}
+
+	int BuildNode(const std::vector<MortonPoint>& sorted, size_t begin, size_t end, int level,
+		uint64_t prefix, const double* bounds)
+	{
+		int index = (int)m_Nodes.size();
+		m_Nodes.emplace_back();
+		Node& node = m_Nodes.back();
+		std::copy(bounds, bounds + 6, node.bounds);
+		node.begin = begin;
+		node.end = end;
+		std::fill(node.children, node.children + 8, -1);
+		node.leaf = (end - begin <= m_LeafSize) || level == MortonBits;
+		if (node.leaf)
+			return index;
+
+		const int shift = 3 * (MortonBits - level - 1);
+		size_t childBegin = begin;
+		for (int c = 0; c < 8; c++) {
+			uint64_t childPrefix = prefix | ((uint64_t)c << shift);
+			uint64_t nextPrefix = childPrefix + ((uint64_t)1 << shift);
+			size_t childEnd = c == 7 ? end : std::lower_bound(sorted.begin() + childBegin, sorted.begin() + end, nextPrefix,
+				[](const MortonPoint& p, uint64_t code) { return p.code < code; }) - sorted.begin();
+			if (childEnd > childBegin) {
+				double childBounds[6];
+				for (int j = 0; j < 3; j++) {
+					double mid = 0.5 * (bounds[2 * j] + bounds[2 * j + 1]);
+					bool upper = (c >> (2 - j)) & 1;
+					childBounds[2 * j] = upper ? mid : bounds[2 * j];
+					childBounds[2 * j + 1] = upper ? bounds[2 * j + 1] : mid;
+				}
+				int child = BuildNode(sorted, childBegin, childEnd, level + 1, childPrefix, childBounds);
+				m_Nodes[index].children[c] = child;
+			}
+			childBegin = childEnd;
+		}
+		return index;
+	}
+
+	static bool IntersectsBox(const double* bounds, const double* box, bool& inside)
+	{
+		for (int j = 0; j < 3; j++) {
+			if (bounds[2 * j + 1] < box[2 * j] || bounds[2 * j] > box[2 * j + 1])
+				return false;
+			if (bounds[2 * j] < box[2 * j] || bounds[2 * j + 1] > box[2 * j + 1])
+				inside = false;
+		}
+		return true;
+	}
+
+	// planes are the 6 inward facing (a, b, c, d) planes of vtkCamera::GetFrustumPlanes.
+	static bool IntersectsFrustum(const double* bounds, const double* planes)
+	{
+		for (int n = 0; n < 6; n++) {
+			const double* plane = planes + 4 * n;
+			double d = plane[3];
+			for (int j = 0; j < 3; j++)
+				d += plane[j] * (plane[j] > 0 ? bounds[2 * j + 1] : bounds[2 * j]);
+			if (d < 0)
+				return false;
+		}
+		return true;
+	}
+
+	static double ProjectedPixels(const double* bounds, const double* eye, double pixelsPerRadian,
+		bool parallel, double parallelPixels)
+	{
+		double center[3], radius2 = 0;
+		for (int j = 0; j < 3; j++) {
+			center[j] = 0.5 * (bounds[2 * j] + bounds[2 * j + 1]);
+			double half = 0.5 * (bounds[2 * j + 1] - bounds[2 * j]);
+			radius2 += half * half;
+		}
+		double radius = sqrt(radius2);
+		if (parallel)
+			return 2 * radius * parallelPixels;
+		double distance = sqrt(vtkMath::Distance2BetweenPoints(center, eye));
+		if (distance <= radius)
+			return std::numeric_limits<double>::max();
+		return 2 * radius / distance * pixelsPerRadian;
+	}
+
+	std::vector<Node>		m_Nodes;
+	std::vector<float>		m_Points;
+	std::vector<QueueEntry>	m_Queue;
+	double					m_Cube[6]{ 0, 0, 0, 0, 0, 0 };
+	size_t					m_LeafSize = 16384;
+	size_t					m_NumLeaves = 0;
+	double					m_BuildMilliseconds = 0;
+};
+
+// Reads a scanner export: raw little-endian float32 x,y,z triplets for .bin
+// and .raw files, otherwise text with x y z in the first three columns.
+static bool ReadPointCloud(const std::string& fileName, std::vector<float>& xyz)
+{
+	std::string ext = fileName.size() > 4 ? fileName.substr(fileName.size() - 4) : "";
+	if (ext == ".bin" || ext == ".raw") {
+		std::ifstream in(fileName, std::ios::binary | std::ios::ate);
+		if (!in)
+			return false;
+		std::streamsize size = in.tellg();
+		in.seekg(0);
+		xyz.resize((size_t)size / (3 * sizeof(float)) * 3);
+		return (bool)in.read(reinterpret_cast<char*>(xyz.data()), xyz.size() * sizeof(float));
+	}
+
+	std::ifstream in(fileName);
+	if (!in)
+		return false;
+	std::string line;
+	while (std::getline(in, line)) {
+		float p[3];
+		if (sscanf(line.c_str(), "%f %f %f", &p[0], &p[1], &p[2]) == 3 ||
+			sscanf(line.c_str(), "%f,%f,%f", &p[0], &p[1], &p[2]) == 3)
+			xyz.insert(xyz.end(), p, p + 3);
+	}
+	return !xyz.empty();
+}
+
+// Noisy sphere shell, used to exercise the octree without a scan at hand.
+static void MakeSyntheticPointCloud(size_t numPoints, std::vector<float>& xyz)
+{
+	xyz.resize(3 * numPoints);
+	vtkSMPTools::For(0, (vtkIdType)numPoints, [&](vtkIdType first, vtkIdType last) {
+		std::mt19937 rng((unsigned)first);
+		std::normal_distribution<float> normal(0.0f, 1.0f);
+		for (vtkIdType p = first; p < last; p++) {
+			float v[3] = { normal(rng), normal(rng), normal(rng) };
+			float r = (1.0f + 0.02f * normal(rng)) / std::max(sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]), 1e-6f);
+			for (int j = 0; j < 3; j++)
+				xyz[3 * p + j] = v[j] * r;
+		}
+	});
+}
+
+// Re-selects the visible octree nodes before each render whenever the camera,
+// the viewport size or the crop box changed since the last selection.
+class vtkPointCloudLODCallback : public vtkCommand
+{
+public:
+	static vtkPointCloudLODCallback* New() { return new vtkPointCloudLODCallback; }
+
+	virtual void Execute(vtkObject* caller, unsigned long, void*) override
+	{
+		vtkRenderer* renderer = vtkRenderer::SafeDownCast(caller);
+		if (!renderer || !this->Octree)
+			return;
+		vtkCamera* camera = renderer->GetActiveCamera();
+		int* size = renderer->GetSize();
+		double box[6];
+		this->ROI->GetCropBox(box);
+		if (camera->GetMTime() == this->CameraMTime && size[0] == this->Size[0] && size[1] == this->Size[1] &&
+			std::equal(box, box + 6, this->Box))
+			return;
+		this->CameraMTime = camera->GetMTime();
+		this->Size[0] = size[0];
+		this->Size[1] = size[1];
+		std::copy(box, box + 6, this->Box);
+
+		double planes[24];
+		camera->GetFrustumPlanes(renderer->GetTiledAspectRatio(), planes);
+		double pixelsPerRadian = size[1] / (2.0 * tan(vtkMath::RadiansFromDegrees(camera->GetViewAngle()) / 2.0));
+		double parallelPixels = size[1] / (2.0 * camera->GetParallelScale());
+
+		vtkFloatArray* coords = vtkFloatArray::SafeDownCast(this->Output->GetPoints()->GetData());
+		this->LastStats = this->Octree->Select(planes, box, camera->GetPosition(), pixelsPerRadian,
+			camera->GetParallelProjection() != 0, parallelPixels, this->PointsPerPixel, this->Budget, coords);
+		this->Output->GetPoints()->Modified();
+		this->Output->Modified();
+	}
+
+	// Forces a new selection on the next render, e.g. after a density change.
+	void Invalidate() { this->CameraMTime = 0; }
+
+	PointCloudOctree*	Octree = nullptr;
+	vtkPolyData*		Output = nullptr;
+	const BoxROI*		ROI = nullptr;		// crops the cloud
+	double				PointsPerPixel = 1.0;
+	size_t				Budget = 4000000;
+	PointCloudOctree::SelectStats	LastStats;
+
+private:
+	vtkMTimeType	CameraMTime = 0;
+	int				Size[2]{ 0, 0 };
+	double			Box[6]{ 0, 0, 0, 0, 0, 0 };
+};
+
+// Keeps interactive frames inside the frame-time budget of the interactor's
+// desired update rate.  While the user drags, measured frame times step the
+// quality level up (cheaper) or down (nicer); once the interaction ends a
+// repeating timer walks the level back to full quality one step at a time.
+// Costly features register a callback that applies a given level, 0 being
+// full quality and MaxQualityLevel the cheapest.
+class vtkFrameRateController : public vtkCommand
+{
+public:
+	static vtkFrameRateController* New() { return new vtkFrameRateController; }
+
+	enum { MaxQualityLevel = 3 };
+
+	void AddFeature(const std::string& name, std::function<void(int)> apply)
+	{
+		this->Features.push_back({ name, apply });
+	}
+
+	// Observes the styles for interaction start/stop, the render window for
+	// frame times and the interactor for the restore timer.
+	void Observe(vtkRenderWindowInteractor* iren, const std::vector<vtkInteractorObserver*>& styles)
+	{
+		this->Interactor = iren;
+		for (auto style : styles) {
+			style->AddObserver(vtkCommand::StartInteractionEvent, this);
+			style->AddObserver(vtkCommand::EndInteractionEvent, this);
+		}
+		iren->GetRenderWindow()->AddObserver(vtkCommand::StartEvent, this);
+		iren->GetRenderWindow()->AddObserver(vtkCommand::EndEvent, this);
+		iren->AddObserver(vtkCommand::TimerEvent, this);
+	}
+
+	virtual void Execute(vtkObject*, unsigned long eventId, void* callData) override
+	{
+		switch (eventId) {
+		case vtkCommand::StartInteractionEvent:
+			this->StopRestoring();
+			this->Interacting = true;
+			this->AverageFrameTime = 0;
+			break;
+		case vtkCommand::EndInteractionEvent:
+			if (this->Interacting) {
+				this->Interacting = false;
+				if (this->Level > 0 && this->RestoreTimer < 0)
+					this->RestoreTimer = this->Interactor->CreateRepeatingTimer(this->RestoreIntervalMs);
+			}
+			break;
+		case vtkCommand::StartEvent:
+			this->FrameStart = std::chrono::steady_clock::now();
+			break;
+		case vtkCommand::EndEvent:
+			this->FrameRendered(std::chrono::duration<double>(std::chrono::steady_clock::now() - this->FrameStart).count());
+			break;
+		case vtkCommand::TimerEvent:
+			if (callData && *static_cast<int*>(callData) == this->RestoreTimer) {
+				this->SetLevel(this->Level - 1);
+				if (this->Level == 0)
+					this->StopRestoring();
+				this->Interactor->Render();
+			}
+			break;
+		}
+	}
+
+	int GetLevel() const { return this->Level; }
+	double GetAverageFrameTime() const { return this->AverageFrameTime; }
+	long GetLevelChanges() const { return this->LevelChanges; }
+
+	unsigned long	RestoreIntervalMs = 150;
+
+private:
+	struct Feature
+	{
+		std::string					name;
+		std::function<void(int)>	apply;
+	};
+
+	void FrameRendered(double seconds)
+	{
+		if (!this->Interacting)
+			return;
+		this->AverageFrameTime = this->AverageFrameTime > 0 ? 0.7 * this->AverageFrameTime + 0.3 * seconds : seconds;
+		if (this->Cooldown > 0) {
+			this->Cooldown--;
+			return;
+		}
+		double budget = 1.0 / this->Interactor->GetDesiredUpdateRate();
+		if (this->AverageFrameTime > budget && this->Level < MaxQualityLevel)
+			this->SetLevel(this->Level + 1);
+		else if (this->AverageFrameTime < 0.5 * budget && this->Level > 0)
+			this->SetLevel(this->Level - 1);
+	}
+
+	void SetLevel(int level)
+	{
+		level = std::min(std::max(level, 0), static_cast<int>(MaxQualityLevel));
+		if (level == this->Level)
+			return;
+		this->Level = level;
+		// Give the new level a few frames to show in the average.
+		this->Cooldown = 3;
+		this->LevelChanges++;
+		for (auto& feature : this->Features)
+			feature.apply(level);
+	}
+
+	void StopRestoring()
+	{
+		if (this->RestoreTimer >= 0)
+			this->Interactor->DestroyTimer(this->RestoreTimer);
+		this->RestoreTimer = -1;
+	}
+
+	vtkRenderWindowInteractor*	Interactor = nullptr;
+	std::vector<Feature>		Features;
+	bool						Interacting = false;
+	int							Level = 0;
+	int							Cooldown = 0;
+	long						LevelChanges = 0;
+	int							RestoreTimer = -1;
+	double						AverageFrameTime = 0;
+	std::chrono::steady_clock::time_point	FrameStart;
+};
+
+// Draws the semi-transparent box faces back to front without depth peeling.
+// The faces are the sides of a convex box, so a face whose outward normal
+// points away from the camera is never in front of one that points toward
+// it: the faces are ordered back faces first, then by decreasing distance,
+// and re-added to the renderer in that order before each frame.
+// Frame times are accumulated per mode so the sort can be compared with
+// depth peeling ('t' cycles the modes).
+class vtkFaceSortCallback : public vtkCommand
+{
+public:
+	enum Mode { Sorted, DepthPeeling, Unsorted, NumberOfModes };
+
+	static vtkFaceSortCallback* New() { return new vtkFaceSortCallback; }
+
+	void SetFaces(vtkRenderer* renderer, const std::vector<vtkActor*>& actors,
+		const std::vector<vtkPlaneSource*>& planeSources)
+	{
+		this->Renderer = renderer;
+		this->Actors = actors;
+		this->PlaneSources = planeSources;
+		this->Order.resize(actors.size());
+		this->Keys.resize(actors.size());
+		this->FaceIndex.clear();
+		for (size_t i = 0; i < actors.size(); i++) {
+			this->Order[i] = (int)i;
+			this->FaceIndex[actors[i]] = (int)i;
+		}
+		this->BoxCenters.resize(3 * ((actors.size() + NUMOFPLANES - 1) / NUMOFPLANES));
+		this->BoxKeys.resize(this->BoxCenters.size() / 3);
+		renderer->AddObserver(vtkCommand::StartEvent, this);
+		renderer->AddObserver(vtkCommand::EndEvent, this);
+	}
+
+	void SetMode(int mode)
+	{
+		this->CurrentMode = mode;
+		this->Renderer->SetUseDepthPeeling(mode == DepthPeeling);
+		this->Renderer->SetMaximumNumberOfPeels(8);
+		this->Renderer->SetOcclusionRatio(0.0);
+		std::cout << "Translucency: " << ModeName(mode) << std::endl;
+	}
+
+	void NextMode()
+	{
+		for (int mode = 0; mode < NumberOfModes; mode++) {
+			if (this->Frames[mode] > 0)
+				std::cout << "  " << ModeName(mode) << ": " << 1000 * this->Seconds[mode] / this->Frames[mode]
+				<< " ms/frame over " << this->Frames[mode] << " frames" << std::endl;
+		}
+		this->SetMode((this->CurrentMode + 1) % NumberOfModes);
+	}
+
+	static const char* ModeName(int mode)
+	{
+		static const char* names[NumberOfModes] = { "sorted faces", "depth peeling", "unsorted" };
+		return names[mode];
+	}
+
+	virtual void Execute(vtkObject*, unsigned long eventId, void*) override
+	{
+		if (eventId == vtkCommand::EndEvent) {
+			this->Seconds[this->CurrentMode] += std::chrono::duration<double>(std::chrono::steady_clock::now() - this->FrameStart).count();
+			this->Frames[this->CurrentMode]++;
+			return;
+		}
+		this->FrameStart = std::chrono::steady_clock::now();
+		if (this->CurrentMode == Sorted)
+			this->SortFaces();
+	}
+
+private:
+	void SortFaces()
+	{
+		double eye[3];
+		this->Renderer->GetActiveCamera()->GetPosition(eye);
+
+		// Every NUMOFPLANES consecutive faces belong to one box.
+		const size_t numFaces = this->Actors.size();
+		std::vector<double>& boxCenters = this->BoxCenters;
+		std::fill(boxCenters.begin(), boxCenters.end(), 0.0);
+		for (size_t i = 0; i < numFaces; i++) {
+			double* center = this->Actors[i]->GetCenter();
+			for (int n = 0; n < 3; n++)
+				boxCenters[3 * (i / NUMOFPLANES) + n] += center[n] / NUMOFPLANES;
+		}
+
+		for (size_t i = 0; i < numFaces; i++) {
+			double center[3], normal[3], world[3];
+			const double* boxCenter = &boxCenters[3 * (i / NUMOFPLANES)];
+			std::copy(this->Actors[i]->GetCenter(), this->Actors[i]->GetCenter() + 3, center);
+			this->PlaneSources[i]->GetNormal(normal);
+			vtkMatrix4x4* matrix = this->Actors[i]->GetMatrix();
+			for (int r = 0; r < 3; r++)
+				world[r] = matrix->GetElement(r, 0) * normal[0] + matrix->GetElement(r, 1) * normal[1] +
+				matrix->GetElement(r, 2) * normal[2];
+			double toEye[3], outward[3];
+			vtkMath::Subtract(eye, center, toEye);
+			vtkMath::Subtract(center, boxCenter, outward);
+			double facing = vtkMath::Dot(world, toEye);
+			if (vtkMath::Dot(world, outward) < 0)
+				facing = -facing;
+			this->Keys[i].first = facing > 0 ? 1 : 0;
+			this->Keys[i].second = -vtkMath::Dot(toEye, toEye);
+		}
+
+		// Farther boxes are drawn first; within a box the key above decides.
+		std::vector<double>& boxKeys = this->BoxKeys;
+		for (size_t b = 0; b < boxKeys.size(); b++)
+			boxKeys[b] = -vtkMath::Distance2BetweenPoints(eye, &boxCenters[3 * b]);
+		std::sort(this->Order.begin(), this->Order.end(), [this, &boxKeys](int a, int b) {
+			int boxA = a / NUMOFPLANES, boxB = b / NUMOFPLANES;
+			if (boxA != boxB)
+				return boxKeys[boxA] < boxKeys[boxB];
+			return this->Keys[a] < this->Keys[b];
+		});
+		this->ReorderProps();
+	}
+
+	// Puts the faces in Order into the slots of the renderer's prop list
+	// that faces already hold.  Removing and re-adding them instead would
+	// release their graphics resources every frame.  Other props, and faces
+	// not in this renderer, are left alone.
+	void ReorderProps()
+	{
+		vtkPropCollection* props = this->Renderer->GetViewProps();
+		this->Slots.clear();
+		this->Present.assign(this->Actors.size(), 0);
+		vtkCollectionSimpleIterator it;
+		props->InitTraversal(it);
+		int slot = 0;
+		while (vtkProp* prop = props->GetNextProp(it)) {
+			auto face = this->FaceIndex.find(prop);
+			if (face != this->FaceIndex.end()) {
+				this->Slots.emplace_back(slot, face->second);
+				this->Present[face->second] = 1;
+			}
+			slot++;
+		}
+		size_t next = 0;
+		for (int i : this->Order) {
+			if (!this->Present[i])
+				continue;
+			if (this->Slots[next].second != i)
+				props->ReplaceItem(this->Slots[next].first, this->Actors[i]);
+			next++;
+		}
+	}
+
+	vtkRenderer*					Renderer = nullptr;
+	std::vector<vtkActor*>			Actors;
+	std::vector<vtkPlaneSource*>	PlaneSources;
+	std::vector<int>				Order;
+	std::vector<std::pair<int, double>>	Keys;
+	std::vector<double>				BoxCenters, BoxKeys;
+	std::map<vtkProp*, int>			FaceIndex;			// face actor to its index in Actors
+	std::vector<std::pair<int, int>>	Slots;			// prop list slot and the face in it
+	std::vector<char>				Present;			// faces found in the prop list
+	int								CurrentMode = Sorted;
+	double							Seconds[NumberOfModes]{ 0, 0, 0 };
+	long							Frames[NumberOfModes]{ 0, 0, 0 };
+	std::chrono::steady_clock::time_point	FrameStart;
+};
+
+// Keeps the face tessellation proportional to the faces' size on screen.
+// Before each frame the three corners of every plane are projected, and
+// each in-plane edge gets one cell per PixelsPerCell pixels (at least one,
+// at most MaxResolution).  A face is re-tessellated only when its target
+// leaves the band [resolution / Hysteresis, resolution * Hysteresis], so
+// small camera moves do not rebuild the geometry every frame.
+class vtkPlaneTessellationCallback : public vtkCommand
+{
+public:
+	static vtkPlaneTessellationCallback* New() { return new vtkPlaneTessellationCallback; }
+
+	// actors[i] draws planeSources[i]; its matrix maps the plane to world space.
+	void SetFaces(vtkRenderer* renderer, const std::vector<vtkActor*>& actors,
+		const std::vector<vtkPlaneSource*>& planeSources)
+	{
+		this->Renderer = renderer;
+		this->Actors = actors;
+		this->PlaneSources = planeSources;
+		renderer->AddObserver(vtkCommand::StartEvent, this);
+	}
+
+	// Total number of quads currently generated for all faces.
+	int GetNumberOfCells() const
+	{
+		int cells = 0;
+		for (vtkPlaneSource* planeSource : this->PlaneSources)
+			cells += planeSource->GetXResolution() * planeSource->GetYResolution();
+		return cells;
+	}
+
+	virtual void Execute(vtkObject*, unsigned long, void*) override
+	{
+		vtkCamera* camera = this->Renderer->GetActiveCamera();
+		vtkMatrix4x4* projection = camera->GetCompositeProjectionTransformMatrix(
+			this->Renderer->GetTiledAspectRatio(), -1, 1);
+		const int* size = this->Renderer->GetSize();
+		for (size_t i = 0; i < this->PlaneSources.size(); i++) {
+			vtkPlaneSource* planeSource = this->PlaneSources[i];
+			double corners[3][4], display[3][2];
+			planeSource->GetOrigin(corners[0]);
+			planeSource->GetPoint1(corners[1]);
+			planeSource->GetPoint2(corners[2]);
+			bool behindEye = false;
+			for (int c = 0; c < 3; c++) {
+				corners[c][3] = 1.0;
+				this->Actors[i]->GetMatrix()->MultiplyPoint(corners[c], corners[c]);
+				projection->MultiplyPoint(corners[c], corners[c]);
+				if (corners[c][3] <= 0) {
+					behindEye = true;
+					break;
+				}
+				display[c][0] = 0.5 * size[0] * corners[c][0] / corners[c][3];
+				display[c][1] = 0.5 * size[1] * corners[c][1] / corners[c][3];
+			}
+			int target[2] = { this->MaxResolution, this->MaxResolution };
+			if (!behindEye) {
+				// Point1 - Origin is the X resolution edge, Point2 - Origin the Y edge.
+				for (int e = 0; e < 2; e++) {
+					double pixels = std::hypot(display[e + 1][0] - display[0][0], display[e + 1][1] - display[0][1]);
+					double cells = std::ceil(pixels / (this->PixelsPerCell * this->Coarsening));
+					target[e] = (int)std::min(std::max(cells, 1.0), (double)this->MaxResolution);
+				}
+			}
+			int current[2] = { planeSource->GetXResolution(), planeSource->GetYResolution() };
+			bool update = false;
+			for (int e = 0; e < 2; e++)
+				update = update || target[e] > current[e] * this->Hysteresis || target[e] * this->Hysteresis < current[e]
+				|| ((target[e] == 1 || target[e] == this->MaxResolution) && target[e] != current[e]);
+			if (update) {
+				planeSource->SetResolution(target[0], target[1]);
+				this->Updates++;
+			}
+		}
+	}
+
+	double	PixelsPerCell = 8.0;	// screen pixels per cell edge
+	double	Coarsening = 1.0;		// multiplies PixelsPerCell while interacting
+	double	Hysteresis = 1.5;		// relative change needed to re-tessellate
+	int		MaxResolution = 128;
+	long	Updates = 0;			// number of faces re-tessellated so far
+
+private:
+	vtkRenderer*					Renderer = nullptr;
+	std::vector<vtkActor*>			Actors;
+	std::vector<vtkPlaneSource*>	PlaneSources;
+};
+
+// The interactor's end of --pipeline-thread.  As a frame starts it draws the
+// faces the thread has built since the last one and tells the box observers
+// along which axes they changed, so linked views redraw only what they can
+// see change; once the tessellation has picked this frame's resolutions it
+// posts the planes that changed.  While builds are outstanding a repeating
+// timer renders them as they arrive, and it is destroyed as soon as the
+// thread has caught up, so an idle window is never woken.  Runs without an
+// event loop (--serve, --batch, --alloc-check) wait for the thread instead,
+// so that each frame shows what was posted before it.
+class vtkBoxPipelineCallback : public vtkCommand
+{
+public:
+	static vtkBoxPipelineCallback* New() { return new vtkBoxPipelineCallback; }
+
+	void Observe(vtkRenderWindowInteractor* iren, vtkRenderer* renderer, BoxPipelineThread* pipeline,
+		const std::vector<BoxROI*>& rois, vtkCustomInteractorStyle* style, bool synchronous)
+	{
+		this->Interactor = iren;
+		this->Pipeline = pipeline;
+		this->ROIs = rois;
+		this->Style = style;
+		this->Synchronous = synchronous;
+		// Ahead of the linked views, which pick the viewports to draw then.
+		iren->GetRenderWindow()->AddObserver(vtkCommand::StartEvent, this, 1.0f);
+		iren->GetRenderWindow()->AddObserver(vtkCommand::EndEvent, this);
+		// Behind the tessellation.
+		renderer->AddObserver(vtkCommand::StartEvent, this, -1.0f);
+		if (!synchronous)
+			iren->AddObserver(vtkCommand::TimerEvent, this);
+	}
+
+	virtual void Execute(vtkObject* caller, unsigned long eventId, void* callData) override
+	{
+		switch (eventId) {
+		case vtkCommand::StartEvent:
+			if (caller == this->Interactor->GetRenderWindow()) {
+				this->ShowBuiltFaces();
+				break;
+			}
+			for (BoxROI* roi : this->ROIs)
+				roi->PostChanges();
+			if (this->Synchronous)
+				this->ShowBuiltFaces();
+			break;
+		case vtkCommand::EndEvent:
+			if (!this->Synchronous && this->Timer < 0 && !this->Pipeline->IsCaughtUp())
+				this->Timer = this->Interactor->CreateRepeatingTimer(this->PollIntervalMs);
+			break;
+		case vtkCommand::TimerEvent:
+			if (!callData || *static_cast<int*>(callData) != this->Timer)
+				break;
+			if (this->Pipeline->HasResults()) {
+				this->Interactor->Render();
+			}
+			else if (this->Pipeline->IsCaughtUp()) {
+				this->Interactor->DestroyTimer(this->Timer);
+				this->Timer = -1;
+			}
+			break;
+		}
+	}
+
+	unsigned long	PollIntervalMs = 5;
+
+private:
+	void ShowBuiltFaces()
+	{
+		if (this->Synchronous)
+			this->Pipeline->WaitUntilBuilt();
+		int axes = 0;
+		this->Pipeline->TakeResults([this, &axes](int roi, int face, const BoxPipelineThread::FaceResult& result) {
+			axes |= this->ROIs[roi]->ShowFace(face, result);
+		});
+		// A change along one axis leaves the views looking down it alone.
+		if (axes != 0)
+			this->Style->NotifyBoxesChanged(axes == 1 ? 0 : axes == 2 ? 1 : axes == 4 ? 2 : -1);
+	}
+
+	vtkRenderWindowInteractor*	Interactor = nullptr;
+	BoxPipelineThread*			Pipeline = nullptr;
+	std::vector<BoxROI*>		ROIs;
+	vtkCustomInteractorStyle*	Style = nullptr;
+	bool						Synchronous = false;
+	int							Timer = -1;
+};
+
+// Four viewports in one window: the 3D view plus axial, sagittal and
+// coronal views looking down z, x and y.  All of them draw the same box
+// actors, so they stay in sync, but a viewport is only redrawn when its
+// content changed: its camera or size, the colour or representation of a
+// face it shows, or a face drag along an axis it can see.  A view looking
+// down the drag axis sees the moving faces edge-on or face-on and keeps
+// its last frame.  Skipped viewports are left as they are in the window's
+// render framebuffer (VTK 9.1 and later keep it between frames).
+class vtkLinkedViewsCallback : public vtkCommand
+{
+public:
+	static vtkLinkedViewsCallback* New() { return new vtkLinkedViewsCallback; }
+
+	// viewAxes[i] is the axis renderers[i] looks along, or -1 for a 3D view.
+	void SetViews(vtkRenderWindow* renWin, const std::vector<vtkRenderer*>& renderers,
+		const std::vector<int>& viewAxes)
+	{
+		this->Renderers = renderers;
+		this->ViewAxes = viewAxes;
+		this->Dirty.assign(renderers.size(), true);
+		this->CameraMTimes.assign(renderers.size(), 0);
+		this->PropMTimes.assign(renderers.size(), 0);
+		this->Sizes.assign(renderers.size(), std::array<int, 2>{ { 0, 0 } });
+		renWin->AddObserver(vtkCommand::StartEvent, this);
+	}
+
+	// Box drags from this style mark the views that can see them.
+	void Observe(vtkCustomInteractorStyle* style) { style->AddBoxObserver(this); }
+
+	virtual void Execute(vtkObject*, unsigned long eventId, void* callData) override
+	{
+		if (eventId == vtkCommand::InteractionEvent) {
+			int axis = callData ? *static_cast<int*>(callData) : -1;
+			for (size_t v = 0; v < this->Renderers.size(); v++) {
+				if (axis < 0 || this->ViewAxes[v] != axis)
+					this->Dirty[v] = true;
+			}
+			return;
+		}
+
+		for (size_t v = 0; v < this->Renderers.size(); v++) {
+			vtkRenderer* renderer = this->Renderers[v];
+			vtkMTimeType cameraMTime = renderer->GetActiveCamera()->GetMTime();
+			vtkMTimeType propMTime = 0;
+			vtkActorCollection* actors = renderer->GetActors();
+			vtkCollectionSimpleIterator it;
+			actors->InitTraversal(it);
+			while (vtkActor* actor = actors->GetNextActor(it)) {
+				propMTime = std::max(propMTime, actor->GetProperty()->GetMTime());
+				if (actor->GetMapper())
+					propMTime = std::max(propMTime, actor->GetMapper()->GetMTime());
+			}
+			const int* size = renderer->GetSize();
+			if (cameraMTime != this->CameraMTimes[v] || propMTime != this->PropMTimes[v] ||
+				size[0] != this->Sizes[v][0] || size[1] != this->Sizes[v][1])
+				this->Dirty[v] = true;
+			this->CameraMTimes[v] = cameraMTime;
+			this->PropMTimes[v] = propMTime;
+			this->Sizes[v] = { { size[0], size[1] } };
+
+			renderer->SetDraw(this->Dirty[v] ? 1 : 0);
+			this->ViewportsDrawn += this->Dirty[v] ? 1 : 0;
+			this->Dirty[v] = false;
+		}
+		this->Frames++;
+	}
+
+	long	Frames = 0;
+	long	ViewportsDrawn = 0;
+
+private:
+	std::vector<vtkRenderer*>			Renderers;
+	std::vector<int>					ViewAxes;
+	std::vector<bool>					Dirty;
+	std::vector<vtkMTimeType>			CameraMTimes;
+	std::vector<vtkMTimeType>			PropMTimes;
+	std::vector<std::array<int, 2>>		Sizes;
+};
+
+// Changes when a prop is added to or removed from any renderer, to notice
+// props added late.  It is a sum over the props rather than an MTime so
+// that reordering them, as the face sorting does every frame, leaves it
+// alone.
+static uint64_t GetPropsSignature(vtkRenderWindow* renWin)
+{
+	uint64_t signature = 0;
+	vtkRendererCollection* renderers = renWin->GetRenderers();
+	vtkCollectionSimpleIterator it;
+	renderers->InitTraversal(it);
+	while (vtkRenderer* renderer = renderers->GetNextRenderer(it)) {
+		vtkPropCollection* props = renderer->GetViewProps();
+		vtkCollectionSimpleIterator pit;
+		props->InitTraversal(pit);
+		while (vtkProp* prop = props->GetNextProp(pit))
+			signature += ((uint64_t)(uintptr_t)prop ^ (uint64_t)(uintptr_t)renderer) * 0x9E3779B97F4A7C15ull + 1;
+	}
+	return signature;
+}
+
+// Calls visit for every algorithm upstream of an actor or volume in the window,
+// mappers included, with the algorithm that reads it (null for a mapper).
+// An algorithm read by several consumers is visited once for each.
+static void VisitPipelines(vtkRenderWindow* renWin,
+	const std::function<void(vtkAlgorithm* algorithm, vtkAlgorithm* consumer)>& visit)
+{
+	std::vector<std::pair<vtkAlgorithm*, vtkAlgorithm*>> pending;
+	vtkRendererCollection* renderers = renWin->GetRenderers();
+	vtkCollectionSimpleIterator rit;
+	renderers->InitTraversal(rit);
+	while (vtkRenderer* renderer = renderers->GetNextRenderer(rit)) {
+		vtkActorCollection* actors = renderer->GetActors();
+		vtkCollectionSimpleIterator ait;
+		actors->InitTraversal(ait);
+		while (vtkActor* actor = actors->GetNextActor(ait)) {
+			if (actor->GetMapper())
+				pending.emplace_back(actor->GetMapper(), nullptr);
+		}
+		vtkVolumeCollection* volumes = renderer->GetVolumes();
+		vtkCollectionSimpleIterator vit;
+		volumes->InitTraversal(vit);
+		while (vtkVolume* volume = volumes->GetNextVolume(vit)) {
+			if (volume->GetMapper())
+				pending.emplace_back(volume->GetMapper(), nullptr);
+		}
+	}
+	std::vector<std::pair<vtkAlgorithm*, vtkAlgorithm*>> visited;
+	while (!pending.empty()) {
+		auto edge = pending.back();
+		pending.pop_back();
+		if (std::find(visited.begin(), visited.end(), edge) != visited.end())
+			continue;
+		visited.push_back(edge);
+		visit(edge.first, edge.second);
+		vtkAlgorithm* algorithm = edge.first;
+		for (int port = 0; port < algorithm->GetNumberOfInputPorts(); port++) {
+			for (int c = 0; c < algorithm->GetNumberOfInputConnections(port); c++) {
+				if (vtkAlgorithm* input = algorithm->GetInputAlgorithm(port, c))
+					pending.emplace_back(input, algorithm);
+			}
+		}
+	}
+}
+
+// Chrome trace-event timeline for --trace: every algorithm feeding an actor
+// in the window (mappers included) and every renderer and window render
+// become begin/end slices, per thread.  Actors added later, such as the
+// --volume surface, are picked up at the next frame.  The JSON is written
+// when the tracer goes away and opens in chrome://tracing or Perfetto.
+class vtkPipelineTraceCallback : public vtkCommand
+{
+public:
+	static vtkPipelineTraceCallback* New() { return new vtkPipelineTraceCallback; }
+
+	void Observe(vtkRenderWindow* renWin)
+	{
+		this->RenderWindow = renWin;
+		this->Attach(renWin, "render window");
+		this->AttachPipelines();
+	}
+
+	virtual void Execute(vtkObject* caller, unsigned long eventId, void*) override
+	{
+		// A new frame may show actors that were not there when tracing began.
+		if (caller == this->RenderWindow && eventId == vtkCommand::StartEvent)
+			this->AttachPipelines();
+
+		auto label = this->Labels.find(caller);
+		if (label == this->Labels.end())
+			return;
+		std::lock_guard<std::mutex> lock(this->Mutex);
+		Event event;
+		event.name = &label->second;
+		event.begin = eventId == vtkCommand::StartEvent;
+		event.microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - this->Start).count();
+		event.thread = this->ThreadNumber();
+		this->Events.push_back(event);
+	}
+
+	std::string		FileName;
+
+protected:
+	~vtkPipelineTraceCallback() override
+	{
+		if (this->FileName.empty())
+			return;
+		std::ofstream out(this->FileName);
+		out << "{\"traceEvents\":[";
+		for (size_t e = 0; e < this->Events.size(); e++) {
+			const Event& event = this->Events[e];
+			out << (e ? ",\n" : "\n") << "{\"name\":\"" << *event.name << "\",\"cat\":\"vtk\",\"ph\":\""
+				<< (event.begin ? 'B' : 'E') << "\",\"ts\":" << std::fixed << std::setprecision(1)
+				<< event.microseconds << ",\"pid\":1,\"tid\":" << event.thread << "}";
+		}
+		out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+		std::cout << "trace: " << this->Events.size() << " events from " << this->Labels.size()
+			<< " objects written to " << this->FileName << std::endl;
+	}
+
+private:
+	struct Event
+	{
+		const std::string*	name;
+		bool				begin;
+		double				microseconds;
+		int					thread;
+	};
+
+	void AttachPipelines()
+	{
+		const uint64_t signature = GetPropsSignature(this->RenderWindow);
+		if (signature == this->PropsSignature)
+			return;
+		this->PropsSignature = signature;
+
+		vtkRendererCollection* renderers = this->RenderWindow->GetRenderers();
+		vtkCollectionSimpleIterator it;
+		renderers->InitTraversal(it);
+		while (vtkRenderer* renderer = renderers->GetNextRenderer(it))
+			this->Attach(renderer, "renderer");
+		VisitPipelines(this->RenderWindow, [this](vtkAlgorithm* algorithm, vtkAlgorithm*) {
+			this->Attach(algorithm, nullptr);
+		});
+	}
+
+	// Observes StartEvent and EndEvent of an object not seen before.  Begins
+	// go first and ends last among its observers, so other callbacks on the
+	// same events fall inside the slice.
+	bool Attach(vtkObject* object, const char* kind)
+	{
+		if (this->Labels.count(object))
+			return false;
+		std::ostringstream label;
+		label << (kind ? kind : object->GetClassName()) << " #" << this->Labels.size();
+		this->Labels[object] = label.str();
+		object->AddObserver(vtkCommand::StartEvent, this, 100.0f);
+		object->AddObserver(vtkCommand::EndEvent, this, -100.0f);
+		return true;
+	}
+
+	int ThreadNumber()
+	{
+		std::thread::id id = std::this_thread::get_id();
+		for (size_t t = 0; t < this->Threads.size(); t++) {
+			if (this->Threads[t] == id)
+				return (int)t + 1;
+		}
+		this->Threads.push_back(id);
+		return (int)this->Threads.size();
+	}
+
+	vtkRenderWindow*						RenderWindow = nullptr;
+	uint64_t								PropsSignature = 0;
+	std::map<vtkObject*, std::string>		Labels;
+	std::vector<Event>						Events;
+	std::vector<std::thread::id>			Threads;
+	std::mutex								Mutex;
+	std::chrono::steady_clock::time_point	Start = std::chrono::steady_clock::now();
+};
+
+// --memory-budget: tracks the resident size of every pipeline output in the
+// window and releases intermediates.  An output read only by other filters
+// (the volume the isosurface is cut from, the unstripped mesh, plane sources
+// under a transform filter) is freed once its consumers have run and is
+// re-executed if they ever need it again; outputs a mapper reads stay, so a
+// plain render never re-executes anything.  Data handed in with
+// SetInputData has no source to come back from and is never released.  The
+// total shows in the window title, refreshed a few times a second at most.
+class vtkMemoryBudgetCallback : public vtkCommand
+{
+public:
+	static vtkMemoryBudgetCallback* New() { return new vtkMemoryBudgetCallback; }
+
+	void Observe(vtkRenderWindow* renWin)
+	{
+		this->RenderWindow = renWin;
+		this->Title = renWin->GetWindowName() ? renWin->GetWindowName() : "";
+		renWin->AddObserver(vtkCommand::EndEvent, this);
+	}
+
+	virtual void Execute(vtkObject*, unsigned long, void*) override
+	{
+		const uint64_t signature = GetPropsSignature(this->RenderWindow);
+		if (signature != this->PropsSignature) {
+			this->PropsSignature = signature;
+			this->FindOutputs();
+		}
+		auto now = std::chrono::steady_clock::now();
+		if (now - this->LastUpdate < std::chrono::milliseconds(250))
+			return;
+		this->LastUpdate = now;
+
+		double megabytes = this->GetResidentKilobytes() / 1024.0;
+		char title[256];
+		std::snprintf(title, sizeof(title), "%s (%.1f MB)", this->Title.c_str(), megabytes);
+		this->RenderWindow->SetWindowName(title);
+		bool over = this->BudgetMegabytes > 0 && megabytes > this->BudgetMegabytes;
+		if (over && !this->OverBudget)
+			std::cerr << "memory: " << megabytes << " MB resident, over the " << this->BudgetMegabytes
+				<< " MB budget" << std::endl;
+		this->OverBudget = over;
+	}
+
+	// Sum of the outputs' actual memory size.
+	double GetResidentKilobytes() const
+	{
+		double total = 0;
+		for (const Output& output : this->Outputs) {
+			if (vtkDataObject* data = output.algorithm->GetOutputDataObject(output.port))
+				total += data->GetActualMemorySize();
+		}
+		return total;
+	}
+
+	void Print() const
+	{
+		for (const Output& output : this->Outputs) {
+			vtkDataObject* data = output.algorithm->GetOutputDataObject(output.port);
+			std::printf("memory: %-32s %10lu KiB%s\n", output.algorithm->GetClassName(),
+				data ? data->GetActualMemorySize() : 0ul, output.released ? " (released after use)" : "");
+		}
+		std::printf("memory: %-32s %10.0f KiB\n", "total", this->GetResidentKilobytes());
+	}
+
+	double	BudgetMegabytes = 0;
+
+private:
+	struct Output
+	{
+		vtkAlgorithm*	algorithm;
+		int				port;
+		bool			released;
+	};
+
+	void FindOutputs()
+	{
+		// An algorithm is an intermediate unless some mapper reads it.
+		std::map<vtkAlgorithm*, bool> readByMapper;
+		VisitPipelines(this->RenderWindow, [&](vtkAlgorithm* algorithm, vtkAlgorithm* consumer) {
+			bool& mapperInput = readByMapper[algorithm];
+			mapperInput = mapperInput || !consumer || consumer->IsA("vtkAbstractMapper");
+		});
+		this->Outputs.clear();
+		for (const auto& entry : readByMapper) {
+			vtkAlgorithm* algorithm = entry.first;
+			bool release = !entry.second && !algorithm->IsA("vtkTrivialProducer");
+			if (release)
+				algorithm->ReleaseDataFlagOn();
+			for (int port = 0; port < algorithm->GetNumberOfOutputPorts(); port++) {
+				// Outputs already consumed, such as the volume under a surface
+				// built before this pass, are freed now rather than at the
+				// consumer's next update.
+				vtkDataObject* data = algorithm->GetOutputDataObject(port);
+				if (release && data)
+					data->ReleaseData();
+				this->Outputs.push_back({ algorithm, port, release });
+			}
+		}
+	}
+
+	vtkRenderWindow*						RenderWindow = nullptr;
+	std::string								Title;
+	uint64_t								PropsSignature = 0;
+	std::vector<Output>						Outputs;
+	bool									OverBudget = false;
+	std::chrono::steady_clock::time_point	LastUpdate;
+};
+
+static void MemoryBudgetKeyPress(vtkObject* caller, unsigned long, void* clientData, void*)
+{
+	vtkRenderWindowInteractor* iren = vtkRenderWindowInteractor::SafeDownCast(caller);
+	std::string key = iren->GetKeySym();
+	if (key == "b") // Press 'b' to print the size of every pipeline output
+		static_cast<vtkMemoryBudgetCallback*>(clientData)->Print();
+}
+
+int test4(int argc, char* argv[]);
+int RunBenchmarks(int argc, char* argv[]);
+int main(int argc, char* argv[])
+{
+	// The MedicalDemo3Bench target builds this file with its benchmarks as main.
+#ifdef MEDICALDEMO3_BENCHMARK
+	int ret = RunBenchmarks(argc, argv);
+#else
+	int ret = test4(argc, argv);
+#endif
+
+	return ret;
+}
+
+static unsigned char bkg[4] = { 51, 77, 102, 255 };
+
+struct DemoOptions
+{
+	std::string	pointCloudFile;				// --points <file.xyz|file.bin>
+	size_t		syntheticPoints = 0;		// --points-synthetic <count>
+	double		pointsPerPixel = 1.0;		// --points-density <points per pixel>
+	size_t		pointBudget = 4000000;		// --points-budget <max points per frame>
+	double		interactiveRate = 15.0;		// --interactive-rate <frames per second while dragging>
+	double		stillRate = 0.5;			// --still-rate <frames per second when idle>
+	int			translucencyMode = 0;		// --translucency <sorted|peeling|unsorted>
+	bool		composite = false;			// --composite: draw all faces through one mapper
+	double		faceDetail = 8.0;			// --face-detail <screen pixels per face cell>
+	int			rois = 1;					// --rois <number of box widgets>
+	bool		fourUp = false;				// --four-up: axial, sagittal and coronal views beside the 3D view
+	std::string	sessionFile;				// --session <file>: restored at start if present, saved on exit
+	std::string	serveAddress;				// --serve <port|socket path>: stream frames to one client
+	std::string	connectAddress;				// --connect <port|socket path>: run the stand-in stream client
+	std::string	batchFile;					// --batch <job file>: render snapshots off screen and exit
+	std::string	batchOutput = ".";			// --batch-output <directory for the PNG files>
+	std::string	volumeFile;					// --volume <file.mhd>: skin surface shown with 'v'
+	bool		startupProfile = false;		// --startup-profile: print where launch time went
+	bool		allocStats = false;			// --alloc-stats: count heap allocations per interaction phase
+	bool		allocCheck = false;			// --alloc-check: scripted drag off screen, fails if it allocates
+	std::string	traceFile;					// --trace <file.json>: Chrome trace of pipeline updates and renders
+	double		memoryBudget = -1;			// --memory-budget <MB>: release intermediates, warn above the budget
+	bool		clipSurface = false;		// --clip-surface: cut the --volume surface to box 0
+	bool		rayCast = false;			// --ray-cast: show --volume by CPU ray casting cropped to box 0
+	double		growRange[2]{ 500, 4095 };	// --grow-range <lower> <upper>: voxels 'g' grows over
+	double		isoValue = 500;				// --iso <value>: contour value of the --volume surface
+	int			keepComponents = 0;			// --keep-components <N>: only the N largest surface pieces
+	int			minComponent = 0;			// --min-component <triangles>: drop smaller surface pieces
+	bool		pipelineThread = false;		// --pipeline-thread: build the box faces on a second thread
+	std::string	exportFile;					// --export <file.stl|file.ply>: 'x' writes the clipped surface
+};
+
+// Reads an option value; false unless all of text is a number that fits.
+static bool ParseNumber(const char* text, double& value)
+{
+	char* end = nullptr;
+	errno = 0;
+	value = std::strtod(text, &end);
+	return end != text && *end == '\0' && errno == 0;
+}
+
+static bool ParseNumber(const char* text, int& value)
+{
+	char* end = nullptr;
+	errno = 0;
+	const long number = std::strtol(text, &end, 10);
+	value = (int)number;
+	return end != text && *end == '\0' && errno == 0 &&
+		number >= std::numeric_limits<int>::min() && number <= std::numeric_limits<int>::max();
+}
+
+static bool ParseNumber(const char* text, size_t& value)
+{
+	char* end = nullptr;
+	errno = 0;
+	const unsigned long long number = std::strtoull(text, &end, 10);
+	value = (size_t)number;
+	return end != text && *end == '\0' && errno == 0 && !std::strchr(text, '-') &&
+		number <= std::numeric_limits<size_t>::max();
+}
+
+static bool ParseOptions(int argc, char* argv[], DemoOptions& options)
+{
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		bool valid = true;
+		if (arg == "--points" && hasValue)
+			options.pointCloudFile = argv[++i];
+		else if (arg == "--points-synthetic" && hasValue)
+			valid = ParseNumber(argv[++i], options.syntheticPoints);
+		else if (arg == "--points-density" && hasValue)
+			valid = ParseNumber(argv[++i], options.pointsPerPixel);
+		else if (arg == "--points-budget" && hasValue)
+			valid = ParseNumber(argv[++i], options.pointBudget);
+		else if (arg == "--interactive-rate" && hasValue)
+			valid = ParseNumber(argv[++i], options.interactiveRate);
+		else if (arg == "--still-rate" && hasValue)
+			valid = ParseNumber(argv[++i], options.stillRate);
+		else if (arg == "--batch" && hasValue)
+			options.batchFile = argv[++i];
+		else if (arg == "--batch-output" && hasValue)
+			options.batchOutput = argv[++i];
+		else if (arg == "--face-detail" && hasValue)
+			valid = ParseNumber(argv[++i], options.faceDetail);
+		else if (arg == "--rois" && hasValue) {
+			valid = ParseNumber(argv[++i], options.rois);
+			options.rois = std::max(1, options.rois);
+		}
+		else if (arg == "--session" && hasValue)
+			options.sessionFile = argv[++i];
+		else if (arg == "--serve" && hasValue)
+			options.serveAddress = argv[++i];
+		else if (arg == "--connect" && hasValue)
+			options.connectAddress = argv[++i];
+		else if (arg == "--volume" && hasValue)
+			options.volumeFile = argv[++i];
+		else if (arg == "--startup-profile")
+			options.startupProfile = true;
+		else if (arg == "--trace" && hasValue)
+			options.traceFile = argv[++i];
+		else if (arg == "--memory-budget" && hasValue)
+			valid = ParseNumber(argv[++i], options.memoryBudget);
+		else if (arg == "--iso" && hasValue)
+			valid = ParseNumber(argv[++i], options.isoValue);
+		else if (arg == "--keep-components" && hasValue) {
+			valid = ParseNumber(argv[++i], options.keepComponents);
+			options.keepComponents = std::max(0, options.keepComponents);
+		}
+		else if (arg == "--min-component" && hasValue) {
+			valid = ParseNumber(argv[++i], options.minComponent);
+			options.minComponent = std::max(0, options.minComponent);
+		}
+		else if (arg == "--export" && hasValue) {
+			options.exportFile = argv[++i];
+			options.clipSurface = true;
+		}
+		else if (arg == "--grow-range" && i + 2 < argc) {
+			valid = ParseNumber(argv[++i], options.growRange[0]);
+			valid = ParseNumber(argv[++i], options.growRange[1]) && valid;
+		}
+		else if (arg == "--pipeline-thread")
+			options.pipelineThread = true;
+		else if (arg == "--ray-cast")
+			options.rayCast = true;
+		else if (arg == "--clip-surface")
+			options.clipSurface = true;
+		else if (arg == "--alloc-stats")
+			options.allocStats = true;
+		else if (arg == "--alloc-check")
+			options.allocStats = options.allocCheck = true;
+		else if (arg == "--four-up")
+			options.fourUp = true;
+		else if (arg == "--composite")
+			options.composite = true;
+		else if (arg == "--translucency" && hasValue) {
+			std::string mode = argv[++i];
+			options.translucencyMode = mode == "peeling" ? vtkFaceSortCallback::DepthPeeling :
+				mode == "unsorted" ? vtkFaceSortCallback::Unsorted : vtkFaceSortCallback::Sorted;
+		}
+		else {
+			std::cerr << "Unknown option " << arg << std::endl;
+			return false;
+		}
+		if (!valid) {
+			std::cerr << "Bad value for " << arg << std::endl;
+			return false;
+		}
+	}
+	if (!options.exportFile.empty() && options.rayCast) {
+		std::cerr << "--export writes the clipped surface and cannot be used with --ray-cast" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+static void PointCloudKeyPress(vtkObject* caller, unsigned long, void* clientData, void*)
+{
+	vtkRenderWindowInteractor* iren = vtkRenderWindowInteractor::SafeDownCast(caller);
+	vtkPointCloudLODCallback* lod = static_cast<vtkPointCloudLODCallback*>(clientData);
+	std::string key = iren->GetKeySym();
+	if (key == "i") // Press 'i' to print the last point cloud selection
+	{
+		const PointCloudOctree::SelectStats& stats = lod->LastStats;
+		std::cout << "point cloud: " << stats.pointsSelected << " points drawn, " << stats.nodesVisited
+			<< " nodes visited, " << stats.nodesCulled << " culled, " << stats.pointsTested
+			<< " points box-tested, " << stats.milliseconds << " ms" << std::endl;
+	}
+}
+
+// What key 'd' reports on.
+struct DrawStats
+{
+	vtkRenderer*			Renderer = nullptr;
+	vtkFrameRateController*	FrameRate = nullptr;
+};
+
+static void DrawStatsKeyPress(vtkObject* caller, unsigned long, void* clientData, void*)
+{
+	vtkRenderWindowInteractor* iren = vtkRenderWindowInteractor::SafeDownCast(caller);
+	DrawStats* stats = static_cast<DrawStats*>(clientData);
+	std::string key = iren->GetKeySym();
+	if (key == "d") // Press 'd' to print what the last frame drew
+	{
+		vtkRenderer* renderer = stats->Renderer;
+		std::cout << "draw: " << renderer->GetNumberOfPropsRendered() << " props rendered, "
+			<< renderer->VisibleActorCount() << " visible actors, "
+			<< 1000 * renderer->GetLastRenderTimeInSeconds() << " ms" << std::endl;
+		vtkFrameRateController* frameRate = stats->FrameRate;
+		std::cout << "quality level " << frameRate->GetLevel() << " (" << frameRate->GetLevelChanges()
+			<< " changes, drag frames averaging " << 1000 * frameRate->GetAverageFrameTime() << " ms)" << std::endl;
+	}
+}
+
+static void LinkedViewsKeyPress(vtkObject* caller, unsigned long, void* clientData, void*)
+{
+	vtkRenderWindowInteractor* iren = vtkRenderWindowInteractor::SafeDownCast(caller);
+	vtkLinkedViewsCallback* views = static_cast<vtkLinkedViewsCallback*>(clientData);
+	std::string key = iren->GetKeySym();
+	if (key == "l" && views->Frames > 0) // Press 'l' to print how many viewports were redrawn
+	{
+		std::cout << "viewports: " << views->ViewportsDrawn << " drawn over " << views->Frames << " frames ("
+			<< (double)views->ViewportsDrawn / views->Frames << " per frame)" << std::endl;
+	}
+}
+
+static void FaceSortKeyPress(vtkObject* caller, unsigned long, void* clientData, void*)
+{
+	vtkRenderWindowInteractor* iren = vtkRenderWindowInteractor::SafeDownCast(caller);
+	std::string key = iren->GetKeySym();
+	if (key == "t") // Press 't' to cycle the translucency modes
+	{
+		static_cast<vtkFaceSortCallback*>(clientData)->NextMode();
+		iren->Render();
+	}
+}
+
+// Where launch time goes, printed with --startup-profile.  Library loading
+// is measured from the process start time the kernel reports, which only
+// Linux exposes and only to 10 ms; the other phases are marked as they end.
+struct StartupProfile
+{
+	typedef std::chrono::steady_clock Clock;
+
+	std::vector<std::pair<std::string, Clock::time_point>> Marks;
+
+	void Mark(const char* phase) { this->Marks.emplace_back(phase, Clock::now()); }
+
+	void Print() const
+	{
+		auto ms = [](Clock::time_point from, Clock::time_point to) {
+			return std::chrono::duration<double, std::milli>(to - from).count();
+		};
+		Clock::time_point start = librariesLoadedTime;
+		double loading = LibraryLoadingMilliseconds();
+		if (loading >= 0)
+			std::printf("startup: %-22s %8.1f ms (10 ms resolution)\n", "library loading", loading);
+		std::printf("startup: %-22s %8.1f ms\n", "factory registration", ms(start, factoriesRegisteredTime));
+		Clock::time_point last = factoriesRegisteredTime;
+		for (const auto& mark : this->Marks) {
+			std::printf("startup: %-22s %8.1f ms\n", mark.first.c_str(), ms(last, mark.second));
+			last = mark.second;
+		}
+		std::printf("startup: %-22s %8.1f ms\n", "total", ms(start, last) + std::max(loading, 0.0));
+	}
+
+	// Time from exec to librariesLoadedTime, or -1 where it cannot be read.
+	static double LibraryLoadingMilliseconds()
+	{
+#ifdef __linux__
+		// Field 22 of /proc/self/stat is the start time in clock ticks since
+		// boot; the command name before it may contain spaces.
+		std::ifstream statFile("/proc/self/stat");
+		std::string stat((std::istreambuf_iterator<char>(statFile)), std::istreambuf_iterator<char>());
+		size_t end = stat.rfind(')');
+		double uptime = 0;
+		if (end == std::string::npos || !(std::ifstream("/proc/uptime") >> uptime))
+			return -1;
+		Clock::time_point now = Clock::now();
+		std::istringstream fields(stat.substr(end + 2));
+		std::string field;
+		for (int i = 3; i < 22 && fields >> field; i++)
+			;
+		unsigned long long startTicks = 0;
+		if (!(fields >> startTicks))
+			return -1;
+		double sinceExec = 1000.0 * (uptime - (double)startTicks / sysconf(_SC_CLK_TCK));
+		return std::max(0.0, sinceExec - std::chrono::duration<double, std::milli>(now - librariesLoadedTime).count());
+#else
+		return -1;
+#endif
+	}
+};
+
+// Clips a triangle mesh to a box at drag rates.  Vertices are sorted along
+// each axis once, so moving one side of the box only reclassifies the run of
+// vertices it swept past, and only the triangles around those vertices, plus
+// the ones the moved side already cuts, are looked at again.  Triangles
+// wholly inside are drawn from the mesh's own points (GetInside); triangles
+// crossing the box are cut and drawn with their own points (GetCut).  Box
+// index b is the side of box[b] as in GetCropBox, and bit b of a vertex's
+// mask is set when the vertex lies beyond that side.
+// Both outputs are views of arrays kept here.  Each cut triangle owns a
+// fixed slot of MaxCutVertices points and MaxCutVertices - 2 fan triangles
+// (the ones its polygon does not need are collapsed to a point), so a cut
+// is rewritten in its own slot and the rest of the output is left alone.
+class SurfaceBoxClipper
+{
+public:
+	// Six sides can each add one corner to a triangle.
+	enum { MaxCutVertices = 9, MaxCutTriangles = MaxCutVertices - 2 };
+
+	SurfaceBoxClipper()
+	{
+		this->InsideOffsets->SetNumberOfComponents(1);
+		this->InsideConnectivity->SetNumberOfComponents(1);
+		this->InsidePolys->SetData(this->InsideOffsets, this->InsideConnectivity);
+		this->Inside->SetPolys(this->InsidePolys);
+		this->CutCoords->SetNumberOfComponents(3);
+		this->CutNormals->SetNumberOfComponents(3);
+		this->CutNormals->SetName("Normals");
+		this->CutPoints->SetData(this->CutCoords);
+		this->CutOffsets->SetNumberOfComponents(1);
+		this->CutConnectivity->SetNumberOfComponents(1);
+		this->CutPolys->SetData(this->CutOffsets, this->CutConnectivity);
+		this->Cut->SetPoints(this->CutPoints);
+		this->Cut->SetPolys(this->CutPolys);
+	}
+
+	// Takes the triangles of mesh (other cells are ignored) and starts with
+	// an unbounded box, so everything is inside.
+	void SetInput(vtkPolyData* mesh)
+	{
+		vtkIdType numPoints = mesh->GetNumberOfPoints();
+		this->Points.resize(3 * numPoints);
+		for (vtkIdType v = 0; v < numPoints; v++) {
+			double p[3];
+			mesh->GetPoint(v, p);
+			std::copy(p, p + 3, &this->Points[3 * v]);
+		}
+		vtkDataArray* normals = mesh->GetPointData()->GetNormals();
+		this->Normals.assign(normals ? 3 * numPoints : 0, 0.0f);
+		for (vtkIdType v = 0; normals && v < numPoints; v++) {
+			double n[3];
+			normals->GetTuple(v, n);
+			std::copy(n, n + 3, &this->Normals[3 * v]);
+		}
+		this->Triangles.clear();
+		vtkCellArray* polys = mesh->GetPolys();
+		vtkIdType npts;
+		const vtkIdType* pts;
+		for (polys->InitTraversal(); polys->GetNextCell(npts, pts);) {
+			if (npts == 3)
+				this->Triangles.insert(this->Triangles.end(), { (int32_t)pts[0], (int32_t)pts[1], (int32_t)pts[2] });
+		}
+		this->BuildIndex(numPoints);
+
+		this->Inside->SetPoints(mesh->GetPoints());
+		if (normals) {
+			this->Inside->GetPointData()->SetNormals(normals);
+			this->Cut->GetPointData()->SetNormals(this->CutNormals);
+		}
+		this->UpdateOutputs();
+	}
+
+	// Moves the box to box (xmin, xmax, ymin, ymax, zmin, zmax).  Returns the
+	// number of triangles reclassified.
+	size_t SetBox(const double* box)
+	{
+		this->Stamp++;
+		this->Dirty.clear();
+		int moved = 0;
+		for (int b = 0; b < 6; b++) {
+			if (box[b] != this->Box[b]) {
+				this->SweepSide(b, box[b]);
+				moved |= 1 << b;
+			}
+		}
+		if (!moved)
+			return 0;
+		// A cut triangle whose vertices all stay put still changes shape when
+		// a side cutting it moves.
+		for (int32_t t : this->MixedTriangles) {
+			if (this->CutSides(t) & moved)
+				this->MarkDirty(t);
+		}
+		for (int32_t t : this->Dirty)
+			this->Reclassify(t);
+		this->UpdateOutputs();
+		return this->Dirty.size();
+	}
+
+	vtkPolyData* GetInside() { return this->Inside; }
+	vtkPolyData* GetCut() { return this->Cut; }
+	size_t GetNumberOfTriangles() const { return this->Triangles.size() / 3; }
+
+private:
+	enum { Outside, InsideBox, Mixed };
+
+	void BuildIndex(vtkIdType numPoints)
+	{
+		size_t numTriangles = this->Triangles.size() / 3;
+		for (int a = 0; a < 3; a++) {
+			std::vector<int32_t>& order = this->Order[a];
+			order.resize(numPoints);
+			for (vtkIdType v = 0; v < numPoints; v++)
+				order[v] = (int32_t)v;
+			const float* points = this->Points.data();
+			vtkSMPTools::Sort(order.begin(), order.end(),
+				[points, a](int32_t i, int32_t j) { return points[3 * i + a] < points[3 * j + a]; });
+			this->SortedCoords[a].resize(numPoints);
+			for (vtkIdType i = 0; i < numPoints; i++)
+				this->SortedCoords[a][i] = points[3 * order[i] + a];
+		}
+
+		// Triangles around each vertex, as offsets into one list.
+		this->VertexTriangleOffsets.assign(numPoints + 1, 0);
+		for (int32_t v : this->Triangles)
+			this->VertexTriangleOffsets[v + 1]++;
+		for (vtkIdType v = 0; v < numPoints; v++)
+			this->VertexTriangleOffsets[v + 1] += this->VertexTriangleOffsets[v];
+		this->VertexTriangles.resize(this->Triangles.size());
+		std::vector<int32_t> fill(this->VertexTriangleOffsets.begin(), this->VertexTriangleOffsets.end() - 1);
+		for (size_t k = 0; k < this->Triangles.size(); k++)
+			this->VertexTriangles[fill[this->Triangles[k]]++] = (int32_t)(k / 3);
+
+		this->Masks.assign(numPoints, 0);
+		this->States.assign(numTriangles, InsideBox);
+		this->Slots.resize(numTriangles);
+		this->Stamps.assign(numTriangles, 0);
+		this->InsideTriangles.resize(numTriangles);
+		this->InsideIds.resize(this->Triangles.size());
+		for (size_t t = 0; t < numTriangles; t++) {
+			this->InsideTriangles[t] = (int32_t)t;
+			this->Slots[t] = (int32_t)t;
+		}
+		std::copy(this->Triangles.begin(), this->Triangles.end(), this->InsideIds.begin());
+		this->MixedTriangles.clear();
+		this->CutSizes.clear();
+		this->CutXYZ.clear();
+		this->CutNormalXYZ.clear();
+		this->CutIds.clear();
+		for (int b = 0; b < 6; b++)
+			this->Box[b] = b % 2 ? std::numeric_limits<double>::infinity() : -std::numeric_limits<double>::infinity();
+	}
+
+	// Updates bit b of the vertices side b passes over on its way to value:
+	// a min side culls x < value, a max side x > value.
+	void SweepSide(int b, double value)
+	{
+		int a = b / 2;
+		bool maxSide = b % 2 != 0;
+		double from = std::min(this->Box[b], value), to = std::max(this->Box[b], value);
+		const std::vector<float>& coords = this->SortedCoords[a];
+		size_t first, last;
+		if (maxSide) {
+			first = std::upper_bound(coords.begin(), coords.end(), from) - coords.begin();
+			last = std::upper_bound(coords.begin(), coords.end(), to) - coords.begin();
+		}
+		else {
+			first = std::lower_bound(coords.begin(), coords.end(), from) - coords.begin();
+			last = std::lower_bound(coords.begin(), coords.end(), to) - coords.begin();
+		}
+		this->Box[b] = value;
+		uint8_t bit = (uint8_t)(1 << b);
+		for (size_t i = first; i < last; i++) {
+			int32_t v = this->Order[a][i];
+			bool beyond = maxSide ? coords[i] > value : coords[i] < value;
+			uint8_t mask = beyond ? (uint8_t)(this->Masks[v] | bit) : (uint8_t)(this->Masks[v] & ~bit);
+			if (mask == this->Masks[v])
+				continue;
+			this->Masks[v] = mask;
+			for (int32_t k = this->VertexTriangleOffsets[v]; k < this->VertexTriangleOffsets[v + 1]; k++)
+				this->MarkDirty(this->VertexTriangles[k]);
+		}
+	}
+
+	void MarkDirty(int32_t t)
+	{
+		if (this->Stamps[t] != this->Stamp) {
+			this->Stamps[t] = this->Stamp;
+			this->Dirty.push_back(t);
+		}
+	}
+
+	// Sides with vertices of t on both sides of them.
+	int CutSides(int32_t t) const
+	{
+		const int32_t* v = &this->Triangles[3 * t];
+		int any = this->Masks[v[0]] | this->Masks[v[1]] | this->Masks[v[2]];
+		int all = this->Masks[v[0]] & this->Masks[v[1]] & this->Masks[v[2]];
+		return any & ~all;
+	}
+
+	void Reclassify(int32_t t)
+	{
+		const int32_t* v = &this->Triangles[3 * t];
+		int any = this->Masks[v[0]] | this->Masks[v[1]] | this->Masks[v[2]];
+		int all = this->Masks[v[0]] & this->Masks[v[1]] & this->Masks[v[2]];
+		uint8_t state = any == 0 ? InsideBox : all != 0 ? Outside : Mixed;
+		if (state != this->States[t]) {
+			this->Remove(t);
+			this->States[t] = state;
+			if (state == InsideBox) {
+				this->Slots[t] = (int32_t)this->InsideTriangles.size();
+				this->InsideTriangles.push_back(t);
+				this->InsideIds.insert(this->InsideIds.end(), v, v + 3);
+			}
+			else if (state == Mixed) {
+				this->Slots[t] = (int32_t)this->MixedTriangles.size();
+				this->MixedTriangles.push_back(t);
+				this->CutSizes.push_back(0);
+				this->CutXYZ.resize(this->CutXYZ.size() + 3 * MaxCutVertices);
+				this->CutNormalXYZ.resize(this->CutNormalXYZ.size() + 3 * MaxCutVertices);
+				this->CutIds.resize(this->CutIds.size() + 3 * MaxCutTriangles);
+			}
+		}
+		if (state == Mixed) {
+			this->CutTriangle(t, this->Polygon);
+			this->WriteCutSlot(this->Slots[t], this->Polygon.data(), (int)this->Polygon.size() / 6);
+		}
+	}
+
+	// Takes t out of the list for its current state, moving the last entry
+	// into its slot.
+	void Remove(int32_t t)
+	{
+		int32_t slot = this->Slots[t];
+		if (this->States[t] == InsideBox) {
+			int32_t last = this->InsideTriangles.back();
+			this->InsideTriangles[slot] = last;
+			std::copy(this->InsideIds.end() - 3, this->InsideIds.end(), this->InsideIds.begin() + 3 * slot);
+			this->Slots[last] = slot;
+			this->InsideTriangles.pop_back();
+			this->InsideIds.resize(this->InsideIds.size() - 3);
+		}
+		else if (this->States[t] == Mixed) {
+			int32_t last = this->MixedTriangles.back();
+			int32_t lastSlot = (int32_t)this->MixedTriangles.size() - 1;
+			this->MixedTriangles[slot] = last;
+			if (slot != lastSlot) {
+				const int n = 3 * MaxCutVertices;
+				std::copy_n(this->CutXYZ.begin() + n * lastSlot, n, this->CutXYZ.begin() + n * slot);
+				std::copy_n(this->CutNormalXYZ.begin() + n * lastSlot, n, this->CutNormalXYZ.begin() + n * slot);
+				this->CutSizes[slot] = this->CutSizes[lastSlot];
+				this->WriteCutIds(slot);
+			}
+			this->Slots[last] = slot;
+			this->MixedTriangles.pop_back();
+			this->CutSizes.pop_back();
+			this->CutXYZ.resize(this->CutXYZ.size() - 3 * MaxCutVertices);
+			this->CutNormalXYZ.resize(this->CutNormalXYZ.size() - 3 * MaxCutVertices);
+			this->CutIds.resize(this->CutIds.size() - 3 * MaxCutTriangles);
+		}
+	}
+
+	// Puts the n corners of polygon (position and normal, six floats each)
+	// into slot and fans its triangles there.
+	void WriteCutSlot(int32_t slot, const float* polygon, int n)
+	{
+		n = std::min(n, (int)MaxCutVertices);
+		float* xyz = &this->CutXYZ[3 * MaxCutVertices * (size_t)slot];
+		float* normals = &this->CutNormalXYZ[3 * MaxCutVertices * (size_t)slot];
+		for (int i = 0; i < n; i++) {
+			std::copy(polygon + 6 * i, polygon + 6 * i + 3, xyz + 3 * i);
+			std::copy(polygon + 6 * i + 3, polygon + 6 * i + 6, normals + 3 * i);
+		}
+		this->CutSizes[slot] = (uint8_t)n;
+		this->WriteCutIds(slot);
+	}
+
+	void WriteCutIds(int32_t slot)
+	{
+		const vtkIdType first = (vtkIdType)MaxCutVertices * slot;
+		const int n = this->CutSizes[slot];
+		vtkIdType* ids = &this->CutIds[3 * MaxCutTriangles * (size_t)slot];
+		for (int k = 0; k < MaxCutTriangles; k++, ids += 3) {
+			bool used = k + 2 < n;
+			ids[0] = first;
+			ids[1] = used ? first + k + 1 : first;
+			ids[2] = used ? first + k + 2 : first;
+		}
+	}
+
+	// Sutherland-Hodgman against the sides the triangle crosses.  Polygon
+	// vertices carry position and normal, six floats each.
+	void CutTriangle(int32_t t, std::vector<float>& polygon)
+	{
+		polygon.clear();
+		for (int k = 0; k < 3; k++) {
+			int32_t v = this->Triangles[3 * t + k];
+			polygon.insert(polygon.end(), &this->Points[3 * v], &this->Points[3 * v] + 3);
+			if (this->Normals.empty())
+				polygon.insert(polygon.end(), 3, 0.0f);
+			else
+				polygon.insert(polygon.end(), &this->Normals[3 * v], &this->Normals[3 * v] + 3);
+		}
+		int sides = CutSides(t);
+		std::vector<float>& clipped = this->Scratch;
+		for (int b = 0; b < 6 && !polygon.empty(); b++) {
+			if (!(sides & (1 << b)))
+				continue;
+			int a = b / 2;
+			double sign = b % 2 ? -1.0 : 1.0;	// distance inside the side is positive
+			clipped.clear();
+			size_t n = polygon.size() / 6;
+			for (size_t i = 0; i < n; i++) {
+				const float* p = &polygon[6 * i];
+				const float* q = &polygon[6 * ((i + 1) % n)];
+				double dp = sign * (p[a] - this->Box[b]), dq = sign * (q[a] - this->Box[b]);
+				if (dp >= 0)
+					clipped.insert(clipped.end(), p, p + 6);
+				if ((dp >= 0) != (dq >= 0)) {
+					double s = dp / (dp - dq);
+					for (int c = 0; c < 6; c++)
+						clipped.push_back((float)(p[c] + s * (q[c] - p[c])));
+					clipped[clipped.size() - 6 + a] = (float)this->Box[b];
+				}
+			}
+			polygon.swap(clipped);
+		}
+	}
+
+	// Points the output arrays at the current lists.  The cells of both
+	// outputs are triangles, so they share one list of offsets, which only
+	// grows.
+	void UpdateOutputs()
+	{
+		vtkIdType numInside = (vtkIdType)this->InsideTriangles.size();
+		vtkIdType numCut = (vtkIdType)this->MixedTriangles.size();
+		while ((vtkIdType)this->Offsets.size() <= std::max(numInside, numCut * MaxCutTriangles))
+			this->Offsets.push_back(3 * (vtkIdType)this->Offsets.size());
+		this->InsideOffsets->SetArray(this->Offsets.data(), numInside + 1, 1);
+		this->InsideConnectivity->SetArray(this->InsideIds.data(), 3 * numInside, 1);
+		this->InsidePolys->Modified();
+		this->Inside->Modified();
+
+		this->CutCoords->SetArray(this->CutXYZ.data(), 3 * MaxCutVertices * numCut, 1);
+		this->CutNormals->SetArray(this->CutNormalXYZ.data(), 3 * MaxCutVertices * numCut, 1);
+		this->CutOffsets->SetArray(this->Offsets.data(), MaxCutTriangles * numCut + 1, 1);
+		this->CutConnectivity->SetArray(this->CutIds.data(), 3 * MaxCutTriangles * numCut, 1);
+		this->CutPoints->Modified();
+		this->CutPolys->Modified();
+		this->Cut->Modified();
+	}
+
+	std::vector<float>				Points;
+	std::vector<float>				Normals;
+	std::vector<int32_t>			Triangles;
+	std::array<std::vector<int32_t>, 3>	Order;			// vertices by coordinate, per axis
+	std::array<std::vector<float>, 3>	SortedCoords;	// their coordinates in that order
+	std::vector<int32_t>			VertexTriangleOffsets;
+	std::vector<int32_t>			VertexTriangles;
+	std::vector<uint8_t>			Masks;
+	std::vector<uint8_t>			States;
+	std::vector<int32_t>			Slots;			// index in the list for the triangle's state
+	std::vector<uint32_t>			Stamps;
+	uint32_t						Stamp = 0;
+	std::vector<int32_t>			Dirty;
+	std::vector<int32_t>			InsideTriangles;
+	std::vector<vtkIdType>			InsideIds;
+	std::vector<vtkIdType>			Offsets;
+	std::vector<int32_t>			MixedTriangles;
+	std::vector<uint8_t>			CutSizes;		// corners of each slot's polygon
+	std::vector<float>				CutXYZ;			// MaxCutVertices points per slot
+	std::vector<float>				CutNormalXYZ;
+	std::vector<vtkIdType>			CutIds;			// MaxCutTriangles triangles per slot
+	std::vector<float>				Polygon;		// the cut being worked on
+	std::vector<float>				Scratch;
+	double							Box[6];
+	vtkNew<vtkIdTypeArray>			InsideOffsets;
+	vtkNew<vtkIdTypeArray>			InsideConnectivity;
+	vtkNew<vtkCellArray>			InsidePolys;
+	vtkNew<vtkPolyData>				Inside;
+	vtkNew<vtkFloatArray>			CutCoords;
+	vtkNew<vtkFloatArray>			CutNormals;
+	vtkNew<vtkPoints>				CutPoints;
+	vtkNew<vtkIdTypeArray>			CutOffsets;
+	vtkNew<vtkIdTypeArray>			CutConnectivity;
+	vtkNew<vtkCellArray>			CutPolys;
+	vtkNew<vtkPolyData>				Cut;
+};
+
+// Keeps a clipped surface in step with its box, checked as each frame starts.
+class vtkSurfaceClipCallback : public vtkCommand
+{
+public:
+	static vtkSurfaceClipCallback* New() { return new vtkSurfaceClipCallback; }
+
+	virtual void Execute(vtkObject*, unsigned long, void*) override
+	{
+		double box[6];
+		this->ROI->GetCropBox(box);
+		this->Clipper->SetBox(box);
+	}
+
+	SurfaceBoxClipper*	Clipper = nullptr;
+	const BoxROI*		ROI = nullptr;
+};
+
+// Crops a ray-cast volume to a box, checked as each frame starts.  The
+// cropping planes are in the volume's data coordinates, which are world
+// coordinates here since the volume is never moved.
+class vtkVolumeCropCallback : public vtkCommand
+{
+public:
+	static vtkVolumeCropCallback* New() { return new vtkVolumeCropCallback; }
+
+	virtual void Execute(vtkObject*, unsigned long, void*) override
+	{
+		double box[6];
+		this->ROI->GetCropBox(box);
+		for (int j = 0; j < 3; j++) {
+			box[2 * j] = std::min(std::max(box[2 * j], this->Limits[2 * j]), this->Limits[2 * j + 1]);
+			box[2 * j + 1] = std::min(std::max(box[2 * j + 1], box[2 * j]), this->Limits[2 * j + 1]);
+		}
+		if (std::equal(box, box + 6, this->Box))
+			return;
+		std::copy(box, box + 6, this->Box);
+		this->Mapper->SetCroppingRegionPlanes(box);
+	}
+
+	vtkVolumeMapper*	Mapper = nullptr;
+	const BoxROI*		ROI = nullptr;
+	double				Limits[6]{ -VTK_DOUBLE_MAX, VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX, VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX, VTK_DOUBLE_MAX };	// crop never goes past
+
+private:
+	double	Box[6]{ 0, 0, 0, 0, 0, 0 };
+};
+
+// Connected components of a triangle mesh, to drop the small fragments an
+// isosurface of noisy data is full of.  Triangles sharing a vertex are
+// connected.  Every triangle unions its vertices in a lock-free union-find
+// (roots are linked with compare-and-swap, the larger index under the
+// smaller, and finds halve their paths as they go), so all cores work on
+// the mesh at once; the triangles of each component are then counted, and
+// the kept triangles and the points they use are copied out in parallel.
+class SurfaceComponents
+{
+public:
+	// Keep the Largest components (all if 0) that have at least
+	// MinTriangles triangles.
+	int		Largest = 0;
+	int		MinTriangles = 0;
+
+	vtkSmartPointer<vtkPolyData> Filter(vtkPolyData* mesh)
+	{
+		auto start = std::chrono::steady_clock::now();
+		const vtkIdType numPoints = mesh->GetNumberOfPoints();
+		m_Triangles.clear();
+		vtkCellArray* polys = mesh->GetPolys();
+		vtkIdType npts;
+		const vtkIdType* pts;
+		for (polys->InitTraversal(); polys->GetNextCell(npts, pts);) {
+			if (npts == 3)
+				m_Triangles.insert(m_Triangles.end(), { (int32_t)pts[0], (int32_t)pts[1], (int32_t)pts[2] });
+		}
+		const vtkIdType numTriangles = (vtkIdType)m_Triangles.size() / 3;
+
+		m_Parents.reset(new std::atomic<int32_t>[numPoints]);
+		vtkSMPTools::For(0, numPoints, [&](vtkIdType first, vtkIdType last) {
+			for (vtkIdType p = first; p < last; p++)
+				m_Parents[p].store((int32_t)p, std::memory_order_relaxed);
+		});
+		vtkSMPTools::For(0, numTriangles, [&](vtkIdType first, vtkIdType last) {
+			for (vtkIdType t = first; t < last; t++) {
+				this->Union(m_Triangles[3 * t], m_Triangles[3 * t + 1]);
+				this->Union(m_Triangles[3 * t], m_Triangles[3 * t + 2]);
+			}
+		});
+
+		// Number the roots, then label every point with its root's number.
+		std::vector<int32_t> labels(numPoints);
+		vtkSMPTools::For(0, numPoints, [&](vtkIdType first, vtkIdType last) {
+			for (vtkIdType p = first; p < last; p++)
+				labels[p] = this->Find((int32_t)p);
+		});
+		std::vector<vtkIdType> rootNumbers;
+		const vtkIdType numRoots = ExclusiveScan(numPoints, [&](vtkIdType p) { return labels[p] == p; }, rootNumbers);
+		vtkSMPTools::For(0, numPoints, [&](vtkIdType first, vtkIdType last) {
+			for (vtkIdType p = first; p < last; p++)
+				labels[p] = (int32_t)rootNumbers[labels[p]];
+		});
+		m_Parents.reset();
+
+		// Triangles come out of the contour filter in spatial order, so a
+		// thread counts runs of one component before touching the shared
+		// counter.
+		std::unique_ptr<std::atomic<vtkIdType>[]> counts(new std::atomic<vtkIdType>[numRoots]);
+		for (vtkIdType c = 0; c < numRoots; c++)
+			counts[c].store(0, std::memory_order_relaxed);
+		vtkSMPTools::For(0, numTriangles, [&](vtkIdType first, vtkIdType last) {
+			int32_t component = -1;
+			vtkIdType run = 0;
+			for (vtkIdType t = first; t < last; t++) {
+				int32_t c = labels[m_Triangles[3 * t]];
+				if (c != component) {
+					if (run > 0)
+						counts[component].fetch_add(run, std::memory_order_relaxed);
+					component = c;
+					run = 0;
+				}
+				run++;
+			}
+			if (run > 0)
+				counts[component].fetch_add(run, std::memory_order_relaxed);
+		});
+
+		// Components with triangles, largest first; points no triangle uses
+		// are components of their own and are left out.
+		m_Sizes.clear();
+		std::vector<int32_t> order;
+		for (vtkIdType c = 0; c < numRoots; c++) {
+			if (counts[c] > 0) {
+				order.push_back((int32_t)c);
+				m_Sizes.push_back(counts[c]);
+			}
+		}
+		std::vector<size_t> byCount(order.size());
+		for (size_t n = 0; n < byCount.size(); n++)
+			byCount[n] = n;
+		vtkSMPTools::Sort(byCount.begin(), byCount.end(), [&](size_t a, size_t b) { return m_Sizes[a] > m_Sizes[b]; });
+		std::vector<unsigned char> keep(numRoots, 0);
+		std::vector<vtkIdType> sizes(byCount.size());
+		m_KeptComponents = 0;
+		m_KeptTriangles = 0;
+		for (size_t n = 0; n < byCount.size(); n++) {
+			sizes[n] = m_Sizes[byCount[n]];
+			if ((this->Largest <= 0 || (int)n < this->Largest) && sizes[n] >= this->MinTriangles) {
+				keep[order[byCount[n]]] = 1;
+				m_KeptComponents++;
+				m_KeptTriangles += sizes[n];
+			}
+		}
+		m_Sizes.swap(sizes);
+
+		vtkSmartPointer<vtkPolyData> output = this->CopyKept(mesh, labels, keep);
+		this->Milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		return output;
+	}
+
+	// Triangles per component, largest first, from the last Filter.
+	const std::vector<vtkIdType>& GetComponentSizes() const { return m_Sizes; }
+
+	void PrintSummary() const
+	{
+		vtkIdType total = 0;
+		for (vtkIdType size : m_Sizes)
+			total += size;
+		std::cout << "components: " << m_Sizes.size() << ", kept " << m_KeptComponents << " with " << m_KeptTriangles
+			<< " of " << total << " triangles in " << this->Milliseconds << " ms; largest:";
+		for (size_t n = 0; n < m_Sizes.size() && n < 5; n++)
+			std::cout << " " << m_Sizes[n];
+		std::cout << std::endl;
+	}
+
+	double	Milliseconds = 0;
+
+private:
+	int32_t Find(int32_t p)
+	{
+		for (;;) {
+			int32_t parent = m_Parents[p].load(std::memory_order_relaxed);
+			if (parent == p)
+				return p;
+			int32_t grandparent = m_Parents[parent].load(std::memory_order_relaxed);
+			if (grandparent != parent)
+				m_Parents[p].compare_exchange_weak(parent, grandparent, std::memory_order_relaxed);
+			p = grandparent;
+		}
+	}
+
+	void Union(int32_t a, int32_t b)
+	{
+		for (;;) {
+			a = this->Find(a);
+			b = this->Find(b);
+			if (a == b)
+				return;
+			if (a < b)
+				std::swap(a, b);
+			// Only a root may be linked; if a stopped being one, retry.
+			int32_t expected = a;
+			if (m_Parents[a].compare_exchange_strong(expected, b, std::memory_order_relaxed))
+				return;
+		}
+	}
+
+	// numbers[i] = how many of 0..i-1 satisfy flag, computed in parallel
+	// chunks; returns how many of all n do.
+	template <class Flag>
+	static vtkIdType ExclusiveScan(vtkIdType n, Flag flag, std::vector<vtkIdType>& numbers)
+	{
+		const vtkIdType chunks = 64, chunkSize = (n + chunks - 1) / chunks;
+		std::vector<vtkIdType> totals(chunks + 1, 0);
+		numbers.resize(n);
+		vtkSMPTools::For(0, chunks, 1, [&](vtkIdType first, vtkIdType last) {
+			for (vtkIdType c = first; c < last; c++)
+				for (vtkIdType i = c * chunkSize; i < std::min(n, (c + 1) * chunkSize); i++)
+					totals[c + 1] += flag(i) ? 1 : 0;
+		});
+		for (vtkIdType c = 0; c < chunks; c++)
+			totals[c + 1] += totals[c];
+		vtkSMPTools::For(0, chunks, 1, [&](vtkIdType first, vtkIdType last) {
+			for (vtkIdType c = first; c < last; c++) {
+				vtkIdType number = totals[c];
+				for (vtkIdType i = c * chunkSize; i < std::min(n, (c + 1) * chunkSize); i++) {
+					numbers[i] = number;
+					number += flag(i) ? 1 : 0;
+				}
+			}
+		});
+		return totals[chunks];
+	}
+
+	vtkSmartPointer<vtkPolyData> CopyKept(vtkPolyData* mesh, const std::vector<int32_t>& labels,
+		const std::vector<unsigned char>& keep) const
+	{
+		const vtkIdType numPoints = (vtkIdType)labels.size(), numTriangles = (vtkIdType)m_Triangles.size() / 3;
+		std::vector<vtkIdType> pointIds, triangleIds;
+		const vtkIdType keptPoints = ExclusiveScan(numPoints, [&](vtkIdType p) { return keep[labels[p]] != 0; }, pointIds);
+		const vtkIdType keptTriangles = ExclusiveScan(numTriangles,
+			[&](vtkIdType t) { return keep[labels[m_Triangles[3 * t]]] != 0; }, triangleIds);
+
+		auto output = vtkSmartPointer<vtkPolyData>::New();
+		vtkNew<vtkPoints> points;
+		points->SetDataType(mesh->GetPoints()->GetDataType());
+		points->SetNumberOfPoints(keptPoints);
+		vtkPointData* inData = mesh->GetPointData();
+		vtkPointData* outData = output->GetPointData();
+		std::vector<std::pair<vtkDataArray*, vtkDataArray*>> arrays;
+		for (int a = 0; a < inData->GetNumberOfArrays(); a++) {
+			vtkDataArray* in = inData->GetArray(a);
+			if (!in)
+				continue;
+			vtkSmartPointer<vtkDataArray> out = vtkSmartPointer<vtkDataArray>::Take(in->NewInstance());
+			out->SetName(in->GetName());
+			out->SetNumberOfComponents(in->GetNumberOfComponents());
+			out->SetNumberOfTuples(keptPoints);
+			outData->AddArray(out);
+			if (in == inData->GetNormals())
+				outData->SetNormals(out);
+			arrays.emplace_back(in, out);
+		}
+		vtkPoints* inPoints = mesh->GetPoints();
+		vtkSMPTools::For(0, numPoints, [&](vtkIdType first, vtkIdType last) {
+			for (vtkIdType p = first; p < last; p++) {
+				if (!keep[labels[p]])
+					continue;
+				double xyz[3];
+				inPoints->GetPoint(p, xyz);
+				points->SetPoint(pointIds[p], xyz);
+				for (auto& array : arrays)
+					array.second->SetTuple(pointIds[p], p, array.first);
+			}
+		});
+		output->SetPoints(points);
+
+		vtkNew<vtkIdTypeArray> offsets, connectivity;
+		offsets->SetNumberOfValues(keptTriangles + 1);
+		connectivity->SetNumberOfValues(3 * keptTriangles);
+		vtkSMPTools::For(0, numTriangles, [&](vtkIdType first, vtkIdType last) {
+			for (vtkIdType t = first; t < last; t++) {
+				if (!keep[labels[m_Triangles[3 * t]]])
+					continue;
+				const vtkIdType k = triangleIds[t];
+				for (int v = 0; v < 3; v++)
+					connectivity->SetValue(3 * k + v, pointIds[m_Triangles[3 * t + v]]);
+				offsets->SetValue(k, 3 * k);
+			}
+		});
+		offsets->SetValue(keptTriangles, 3 * keptTriangles);
+		vtkNew<vtkCellArray> triangles;
+		triangles->SetData(offsets, connectivity);
+		output->SetPolys(triangles);
+		return output;
+	}
+
+	std::vector<int32_t>						m_Triangles;	// three point ids per triangle
+	std::unique_ptr<std::atomic<int32_t>[]>		m_Parents;		// union-find forest over points
+	std::vector<vtkIdType>						m_Sizes;		// triangles per component, largest first
+	vtkIdType									m_KeptComponents = 0;
+	vtkIdType									m_KeptTriangles = 0;
+};
+
+// Value range of every 8x8x8 block of a volume, so code that only cares
+// about some values can skip the blocks holding none of them (in a scan
+// that is mostly air, most blocks).  Block b along an axis covers voxels
+// 8b to 8b + 8, one voxel more than its share, so any cell of 2x2x2 voxels
+// lies wholly inside one block and a contour through the cell shows in that
+// block's range.  The ranges are computed in parallel, one z slab of blocks
+// per task; occupancy for a given threshold or opacity is read off them.
+class BlockRangeGrid
+{
+public:
+	static const int BlockSize = 8;
+
+	void Build(vtkImageData* image)
+	{
+		auto start = std::chrono::steady_clock::now();
+		image->GetExtent(m_Extent);
+		for (int j = 0; j < 3; j++)
+			m_Blocks[j] = std::max(1, (m_Extent[2 * j + 1] - m_Extent[2 * j] + BlockSize - 1) / BlockSize);
+		const size_t count = (size_t)m_Blocks[0] * m_Blocks[1] * m_Blocks[2];
+		m_Min.resize(count);
+		m_Max.resize(count);
+		void* scalars = image->GetScalarPointer();
+		switch (image->GetScalarType()) {
+			vtkTemplateMacro(this->BuildRanges(static_cast<const VTK_TT*>(scalars)));
+		}
+		this->BuildMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	bool IsBuilt() const { return !m_Min.empty(); }
+	size_t GetNumberOfBlocks() const { return m_Min.size(); }
+
+	// Block holding voxel (i, j, k) of the image's extent.
+	size_t BlockOf(int i, int j, int k) const
+	{
+		const int b[3] = { (i - m_Extent[0]) / BlockSize, (j - m_Extent[2]) / BlockSize, (k - m_Extent[4]) / BlockSize };
+		return (size_t)std::min(b[0], m_Blocks[0] - 1) + m_Blocks[0] *
+			((size_t)std::min(b[1], m_Blocks[1] - 1) + (size_t)m_Blocks[1] * std::min(b[2], m_Blocks[2] - 1));
+	}
+
+	// One bit per block, set where keep(min, max) holds.  Returns the number
+	// of blocks set.
+	template <class Keep>
+	size_t GetOccupancy(Keep keep, std::vector<uint64_t>& bits) const
+	{
+		bits.assign((m_Min.size() + 63) / 64, 0);
+		size_t occupied = 0;
+		for (size_t b = 0; b < m_Min.size(); b++) {
+			if (keep(m_Min[b], m_Max[b])) {
+				bits[b / 64] |= uint64_t(1) << (b % 64);
+				occupied++;
+			}
+		}
+		return occupied;
+	}
+
+	static bool IsSet(const std::vector<uint64_t>& bits, size_t block) { return (bits[block / 64] >> (block % 64)) & 1; }
+
+	// First voxel index along axis past the block holding voxel i.
+	int NextBlockStart(int axis, int i) const
+	{
+		return m_Extent[2 * axis] + ((i - m_Extent[2 * axis]) / BlockSize + 1) * BlockSize;
+	}
+
+	// The voxel extent spanned by the blocks where keep(min, max) holds;
+	// false if there are none.
+	template <class Keep>
+	bool GetOccupiedExtent(Keep keep, int extent[6]) const
+	{
+		int lo[3] = { m_Blocks[0], m_Blocks[1], m_Blocks[2] }, hi[3] = { -1, -1, -1 };
+		size_t b = 0;
+		for (int z = 0; z < m_Blocks[2]; z++) {
+			for (int y = 0; y < m_Blocks[1]; y++) {
+				for (int x = 0; x < m_Blocks[0]; x++, b++) {
+					if (!keep(m_Min[b], m_Max[b]))
+						continue;
+					const int block[3] = { x, y, z };
+					for (int j = 0; j < 3; j++) {
+						lo[j] = std::min(lo[j], block[j]);
+						hi[j] = std::max(hi[j], block[j]);
+					}
+				}
+			}
+		}
+		if (hi[0] < 0)
+			return false;
+		for (int j = 0; j < 3; j++) {
+			extent[2 * j] = m_Extent[2 * j] + lo[j] * BlockSize;
+			extent[2 * j + 1] = std::min(m_Extent[2 * j] + (hi[j] + 1) * BlockSize, m_Extent[2 * j + 1]);
+		}
+		return true;
+	}
+
+	double	BuildMilliseconds = 0;
+
+private:
+	template <class T>
+	void BuildRanges(const T* scalars)
+	{
+		const int dims[3] = { m_Extent[1] - m_Extent[0] + 1, m_Extent[3] - m_Extent[2] + 1, m_Extent[5] - m_Extent[4] + 1 };
+		vtkSMPTools::For(0, m_Blocks[2], [&](vtkIdType firstSlab, vtkIdType lastSlab) {
+			// One row of block ranges is filled a voxel row at a time.
+			std::vector<float> rowMin(m_Blocks[0]), rowMax(m_Blocks[0]);
+			for (vtkIdType bz = firstSlab; bz < lastSlab; bz++) {
+				for (int by = 0; by < m_Blocks[1]; by++) {
+					std::fill(rowMin.begin(), rowMin.end(), VTK_FLOAT_MAX);
+					std::fill(rowMax.begin(), rowMax.end(), -VTK_FLOAT_MAX);
+					const int z1 = std::min((int)bz * BlockSize + BlockSize, dims[2] - 1);
+					const int y1 = std::min(by * BlockSize + BlockSize, dims[1] - 1);
+					for (int z = (int)bz * BlockSize; z <= z1; z++) {
+						for (int y = by * BlockSize; y <= y1; y++) {
+							const T* row = scalars + ((size_t)z * dims[1] + y) * dims[0];
+							for (int bx = 0; bx < m_Blocks[0]; bx++) {
+								const int x1 = std::min(bx * BlockSize + BlockSize, dims[0] - 1);
+								float lo = rowMin[bx], hi = rowMax[bx];
+								for (int x = bx * BlockSize; x <= x1; x++) {
+									const float value = (float)row[x];
+									lo = std::min(lo, value);
+									hi = std::max(hi, value);
+								}
+								rowMin[bx] = lo;
+								rowMax[bx] = hi;
+							}
+						}
+					}
+					const size_t first = (size_t)m_Blocks[0] * (by + (size_t)m_Blocks[1] * bz);
+					std::copy(rowMin.begin(), rowMin.end(), m_Min.begin() + first);
+					std::copy(rowMax.begin(), rowMax.end(), m_Max.begin() + first);
+				}
+			}
+		});
+	}
+
+	int					m_Extent[6]{ 0, -1, 0, -1, 0, -1 };
+	int					m_Blocks[3]{ 0, 0, 0 };
+	std::vector<float>	m_Min, m_Max;
+};
+
+// The --volume data set, shown with 'v' either as the skin isosurface or,
+// with RayCast, by CPU ray casting cropped to CropBox.  The reader and
+// everything after it are created the first time 'v' is pressed, so the
+// first frame does not wait for the volume to be read.  With a ClipBox the
+// surface is cut to that box instead of being stripped.  Components, when
+// set, drops the surface's small disconnected pieces first.
+struct VolumeSurface
+{
+	std::string					FileName;
+	vtkRenderer*				Renderer = nullptr;
+	const BoxROI*				ClipBox = nullptr;
+	bool						RayCast = false;
+	const BoxROI*				CropBox = nullptr;
+	double						IsoValue = 500;
+	std::string					ExportFile;		// written by 'x'
+	std::unique_ptr<SurfaceComponents>			Components;
+	vtkSmartPointer<vtkActor>	Actor;
+	vtkSmartPointer<vtkActor>	CutActor;		// the clipped triangles along the box
+	std::unique_ptr<SurfaceBoxClipper>			Clipper;
+	vtkSmartPointer<vtkSurfaceClipCallback>		ClipCallback;
+	vtkSmartPointer<vtkVolume>					Volume;
+	vtkSmartPointer<vtkFixedPointVolumeRayCastMapper>	VolumeMapper;
+	vtkSmartPointer<vtkVolumeCropCallback>		CropCallback;
+
+	bool IsBuilt() const { return this->Actor || this->Volume; }
+
+	void ToggleVisibility()
+	{
+		vtkProp* props[] = { this->Actor, this->CutActor, this->Volume };
+		for (vtkProp* prop : props) {
+			if (prop)
+				prop->SetVisibility(!prop->GetVisibility());
+		}
+	}
+
+	bool Build()
+	{
+		auto start = std::chrono::steady_clock::now();
+		vtkNew<vtkMetaImageReader> reader;
+		if (!reader->CanReadFile(this->FileName.c_str()))
+			return false;
+		reader->SetFileName(this->FileName.c_str());
+		if (this->RayCast)
+			this->BuildRayCast(reader);
+		else
+			this->BuildSurface(reader);
+		std::cout << "volume: " << this->FileName << (this->RayCast ? " loaded in " : " contoured in ")
+			<< std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+			<< " ms" << std::endl;
+		return true;
+	}
+
+	// Sample spacing for a frame-rate quality level: coarser rays and a
+	// coarser image while dragging, refined once idle.
+	void SetQualityLevel(int level)
+	{
+		if (!this->VolumeMapper)
+			return;
+		this->VolumeMapper->SetImageSampleDistance(1.0f + level);
+		this->VolumeMapper->SetSampleDistance(this->SampleDistance * (1 << level));
+	}
+
+private:
+	void BuildSurface(vtkMetaImageReader* reader)
+	{
+#ifdef USE_FLYING_EDGES
+		vtkNew<vtkFlyingEdges3D> skinExtractor;
+#else
+		vtkNew<vtkMarchingCubes> skinExtractor;
+#endif
+		// Only blocks whose range holds the iso value can hold the surface, so
+		// the contour is run on the voxels those blocks span.  The extent is
+		// extracted downstream of the reader rather than cropped out of its
+		// output, so the pipeline stays connected and --memory-budget can
+		// release the volume once the surface is built.
+		reader->Update();
+		vtkImageData* image = reader->GetOutput();
+		BlockRangeGrid blocks;
+		blocks.Build(image);
+		const float iso = (float)this->IsoValue;
+		int extent[6];
+		image->GetExtent(extent);
+		const double voxels = (double)(extent[1] - extent[0] + 1) * (extent[3] - extent[2] + 1) *
+			(extent[5] - extent[4] + 1);
+		double kept = voxels;
+		if (blocks.GetOccupiedExtent([iso](float lo, float hi) { return lo <= iso && hi >= iso; }, extent))
+			kept = (double)(extent[1] - extent[0] + 1) * (extent[3] - extent[2] + 1) * (extent[5] - extent[4] + 1);
+		vtkNew<vtkExtractVOI> occupied;
+		occupied->SetInputConnection(reader->GetOutputPort());
+		occupied->SetVOI(extent);
+		skinExtractor->SetInputConnection(occupied->GetOutputPort());
+		skinExtractor->SetValue(0, this->IsoValue);
+		vtkNew<vtkStripper> skinStripper;
+		vtkNew<vtkPolyDataMapper> skinMapper;
+		skinMapper->ScalarVisibilityOff();
+		vtkSmartPointer<vtkPolyData> mesh;
+		if (this->ClipBox)
+			skinExtractor->ComputeNormalsOn();
+		auto contourStart = std::chrono::steady_clock::now();
+		skinExtractor->Update();
+		const double contourMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - contourStart).count();
+		std::cout << "surface: " << 100 * (1 - kept / voxels) << "% of voxels skipped in blocks without " << iso
+			<< " (ranges of " << blocks.GetNumberOfBlocks() << " blocks in " << blocks.BuildMilliseconds << " ms), contour "
+			<< contourMs << " ms, about " << contourMs * (voxels - kept) / kept
+			<< " ms saved (contour time per voxel extrapolated linearly)" << std::endl;
+		if (this->Components) {
+			mesh = this->Components->Filter(skinExtractor->GetOutput());
+			this->Components->PrintSummary();
+		}
+		if (this->ClipBox) {
+			// The clipper keeps what it needs of the mesh, so the volume and
+			// the contour filter go away once it has built its index.
+			if (!mesh)
+				mesh = skinExtractor->GetOutput();
+			this->Clipper.reset(new SurfaceBoxClipper);
+			this->Clipper->SetInput(mesh);
+			skinMapper->SetInputData(this->Clipper->GetInside());
+		}
+		else {
+			if (mesh)
+				skinStripper->SetInputData(mesh);
+			else
+				skinStripper->SetInputConnection(skinExtractor->GetOutputPort());
+			skinMapper->SetInputConnection(skinStripper->GetOutputPort());
+		}
+		skinMapper->Update();
+
+		vtkNew<vtkNamedColors> colors;
+		colors->SetColor("SkinColor", 240, 184, 160, 255);
+		this->Actor = vtkSmartPointer<vtkActor>::New();
+		this->Actor->SetMapper(skinMapper);
+		this->Actor->GetProperty()->SetDiffuseColor(colors->GetColor3d("SkinColor").GetData());
+		this->Actor->PickableOff();
+		this->Renderer->AddActor(this->Actor);
+		if (this->Clipper) {
+			vtkNew<vtkPolyDataMapper> cutMapper;
+			cutMapper->SetInputData(this->Clipper->GetCut());
+			cutMapper->ScalarVisibilityOff();
+			this->CutActor = vtkSmartPointer<vtkActor>::New();
+			this->CutActor->SetMapper(cutMapper);
+			this->CutActor->SetProperty(this->Actor->GetProperty());
+			this->CutActor->PickableOff();
+			this->Renderer->AddActor(this->CutActor);
+			this->ClipCallback = vtkSmartPointer<vtkSurfaceClipCallback>::New();
+			this->ClipCallback->Clipper = this->Clipper.get();
+			this->ClipCallback->ROI = this->ClipBox;
+			this->Renderer->AddObserver(vtkCommand::StartEvent, this->ClipCallback);
+		}
+	}
+
+	// The fixed-point ray caster spreads image rows over all cores and skips
+	// blocks whose value range maps to zero opacity, using the min/max
+	// volume it keeps per 4x4x4 block of voxels.
+	void BuildRayCast(vtkMetaImageReader* reader)
+	{
+		reader->Update();
+		double spacing[3];
+		reader->GetOutput()->GetSpacing(spacing);
+		this->SampleDistance = (float)std::min(std::min(spacing[0], spacing[1]), spacing[2]);
+
+		vtkNew<vtkColorTransferFunction> color;
+		color->AddRGBPoint(0, 0.0, 0.0, 0.0);
+		color->AddRGBPoint(500, 240 / 255.0, 184 / 255.0, 160 / 255.0);
+		color->AddRGBPoint(1000, 240 / 255.0, 184 / 255.0, 160 / 255.0);
+		color->AddRGBPoint(1150, 1.0, 1.0, 240 / 255.0);
+		vtkNew<vtkPiecewiseFunction> opacity;
+		opacity->AddPoint(0, 0.0);
+		opacity->AddPoint(500, 0.15);
+		opacity->AddPoint(1000, 0.15);
+		opacity->AddPoint(1150, 0.85);
+		vtkNew<vtkVolumeProperty> property;
+		property->SetColor(color);
+		property->SetScalarOpacity(opacity);
+		property->SetInterpolationTypeToLinear();
+		property->ShadeOn();
+		property->SetAmbient(0.4);
+		property->SetDiffuse(0.6);
+		property->SetSpecular(0.2);
+
+		this->VolumeMapper = vtkSmartPointer<vtkFixedPointVolumeRayCastMapper>::New();
+		this->VolumeMapper->SetInputConnection(reader->GetOutputPort());
+		this->VolumeMapper->SetBlendModeToComposite();
+		// Quality follows the frame-rate controller instead.
+		this->VolumeMapper->AutoAdjustSampleDistancesOff();
+		this->VolumeMapper->CroppingOn();
+		this->VolumeMapper->SetCroppingRegionFlagsToSubVolume();
+		this->SetQualityLevel(0);
+		this->Volume = vtkSmartPointer<vtkVolume>::New();
+		this->Volume->SetMapper(this->VolumeMapper);
+		this->Volume->SetProperty(property);
+		this->Volume->PickableOff();
+		this->Renderer->AddVolume(this->Volume);
+
+		this->CropCallback = vtkSmartPointer<vtkVolumeCropCallback>::New();
+		this->CropCallback->Mapper = this->VolumeMapper;
+		this->CropCallback->ROI = this->CropBox;
+		this->LimitCropToOpacity(reader->GetOutput(), opacity);
+		this->Renderer->AddObserver(vtkCommand::StartEvent, this->CropCallback);
+	}
+
+	// Blocks whose values all map to zero opacity draw nothing, so the crop
+	// never reaches past the blocks that do not.
+	void LimitCropToOpacity(vtkImageData* image, vtkPiecewiseFunction* opacity)
+	{
+		BlockRangeGrid blocks;
+		blocks.Build(image);
+		const float transparent = (float)opacity->GetFirstNonZeroValue();
+		int extent[6], fullExtent[6];
+		image->GetExtent(fullExtent);
+		if (!blocks.GetOccupiedExtent([transparent](float, float hi) { return hi > transparent; }, extent))
+			return;
+		double origin[3], spacing[3];
+		image->GetOrigin(origin);
+		image->GetSpacing(spacing);
+		double kept = 1, voxels = 1;
+		for (int j = 0; j < 3; j++) {
+			this->CropCallback->Limits[2 * j] = origin[j] + spacing[j] * extent[2 * j];
+			this->CropCallback->Limits[2 * j + 1] = origin[j] + spacing[j] * extent[2 * j + 1];
+			kept *= extent[2 * j + 1] - extent[2 * j] + 1;
+			voxels *= fullExtent[2 * j + 1] - fullExtent[2 * j] + 1;
+		}
+		std::cout << "ray cast: " << 100 * (1 - kept / voxels) << "% of voxels skipped in blocks at zero opacity (ranges of "
+			<< blocks.GetNumberOfBlocks() << " blocks in " << blocks.BuildMilliseconds << " ms)" << std::endl;
+	}
+
+	float	SampleDistance = 1.0f;
+};
+
+static void VolumeKeyPress(vtkObject* caller, unsigned long, void* clientData, void*)
+{
+	vtkRenderWindowInteractor* iren = vtkRenderWindowInteractor::SafeDownCast(caller);
+	VolumeSurface* volume = static_cast<VolumeSurface*>(clientData);
+	std::string key = iren->GetKeySym();
+	if (key == "v") // Press 'v' to show or hide the volume
+	{
+		if (!volume->IsBuilt()) {
+			if (!volume->Build()) {
+				std::cerr << "Cannot read volume " << volume->FileName << std::endl;
+				return;
+			}
+		}
+		else {
+			volume->ToggleVisibility();
+		}
+		iren->Render();
+	}
+}
+
+// Threshold region growing from a seed voxel, confined to a box of voxels.
+// The region and the in-range voxels are bitmasks, 64 voxels to a word and
+// one row of words per (y, z) of the box.  The grow is a breadth-first
+// wavefront over rows rather than voxels: each level, the rows that gained
+// voxels OR them into their four neighbour rows in parallel, then every row
+// that received any widens them, again in parallel, to the whole runs of
+// in-range voxels along x that they touch.  A row is thresholded the first
+// time the wavefront reaches it, so rows the region never touches cost
+// nothing.
+class RegionGrower
+{
+public:
+	void SetInput(vtkImageData* image) { m_Image = image; }
+	vtkImageData* GetInput() const { return m_Image; }
+	// Block ranges of the input; rows are then only read in blocks holding
+	// in-range values.
+	void SetBlocks(const BlockRangeGrid* blocks) { m_Blocks = blocks; }
+
+	// Grows from seed, in voxel indices inside extent, over the voxels whose
+	// value is in [lower, upper].  False if the seed itself is not.
+	bool Grow(const int extent[6], const int seed[3], double lower, double upper)
+	{
+		auto start = std::chrono::steady_clock::now();
+		std::copy(extent, extent + 6, m_Extent);
+		for (int j = 0; j < 3; j++)
+			m_Size[j] = extent[2 * j + 1] - extent[2 * j] + 1;
+		m_Words = (m_Size[0] + 63) / 64;
+		m_Lower = lower;
+		m_Upper = upper;
+		const size_t rows = (size_t)m_Size[1] * m_Size[2], words = rows * m_Words;
+		m_Region.assign(words, 0);
+		m_Added.assign(words, 0);
+		m_InRange.resize(words);
+		m_Thresholded.assign(rows, 0);
+		m_Received.reset(new std::atomic<uint64_t>[words]);
+		m_Queued.reset(new std::atomic<unsigned char>[rows]);
+		vtkSMPTools::For(0, (vtkIdType)rows, [&](vtkIdType first, vtkIdType last) {
+			for (vtkIdType row = first; row < last; row++) {
+				m_Queued[row].store(0, std::memory_order_relaxed);
+				for (int w = 0; w < m_Words; w++)
+					m_Received[row * m_Words + w].store(0, std::memory_order_relaxed);
+			}
+		});
+		this->Voxels = 0;
+		this->Levels = 0;
+		m_ReadVoxels = m_SkippedVoxels = m_ThresholdNs = 0;
+		if (m_Blocks) {
+			const float lo = (float)lower, hi = (float)upper;
+			m_Blocks->GetOccupancy([lo, hi](float min, float max) { return max >= lo && min <= hi; }, m_Occupied);
+		}
+
+		const int x = seed[0] - extent[0];
+		const int seedRow = (seed[1] - extent[2]) + m_Size[1] * (seed[2] - extent[4]);
+		m_Received[(size_t)seedRow * m_Words + x / 64].store(uint64_t(1) << (x % 64));
+		std::vector<int> received(rows), grown(rows);
+		received[0] = seedRow;
+		size_t numReceived = 1;
+		std::atomic<size_t> count(0), voxels(0);
+		while (numReceived > 0) {
+			this->Levels++;
+			// Rows that were handed voxels keep the runs those voxels touch.
+			count = 0;
+			vtkSMPTools::For(0, (vtkIdType)numReceived, [&](vtkIdType first, vtkIdType last) {
+				size_t added = 0;
+				for (vtkIdType n = first; n < last; n++) {
+					m_Queued[received[n]].store(0, std::memory_order_relaxed);
+					size_t rowAdded = this->WidenRow(received[n]);
+					if (rowAdded > 0)
+						grown[count++] = received[n];
+					added += rowAdded;
+				}
+				voxels += added;
+			});
+			const size_t numGrown = count;
+			// Rows that grew hand their new voxels to the rows around them.
+			count = 0;
+			vtkSMPTools::For(0, (vtkIdType)numGrown, [&](vtkIdType first, vtkIdType last) {
+				for (vtkIdType n = first; n < last; n++) {
+					const int row = grown[n], y = row % m_Size[1], z = row / m_Size[1];
+					const int neighbours[4][2] = { { y - 1, z }, { y + 1, z }, { y, z - 1 }, { y, z + 1 } };
+					for (const int* yz : neighbours) {
+						if (yz[0] < 0 || yz[0] >= m_Size[1] || yz[1] < 0 || yz[1] >= m_Size[2])
+							continue;
+						const int neighbour = yz[0] + m_Size[1] * yz[1];
+						if (this->Send(row, neighbour) && m_Queued[neighbour].exchange(1) == 0)
+							received[count++] = neighbour;
+					}
+				}
+			});
+			numReceived = count;
+		}
+		this->Voxels = voxels;
+		this->Milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		return this->Voxels > 0;
+	}
+
+	// The region as an unsigned char image (255 inside) over its bounding
+	// voxels plus a zero border, in the input's coordinates, for contouring.
+	vtkSmartPointer<vtkImageData> GetMaskImage() const
+	{
+		int bounds[6] = { m_Size[0], -1, m_Size[1], -1, m_Size[2], -1 };
+		for (int z = 0; z < m_Size[2]; z++) {
+			for (int y = 0; y < m_Size[1]; y++) {
+				const uint64_t* region = this->Row(m_Region, y + m_Size[1] * z);
+				int x = FindBit(region, 0, m_Size[0], true);
+				if (x == m_Size[0])
+					continue;
+				int end = x;
+				for (int w = m_Words - 1; w >= x / 64; w--) {
+					if (region[w]) {
+						end = w * 64 + 63 - LeadingZeros(region[w]);
+						break;
+					}
+				}
+				const int voxel[3] = { x, y, z };
+				for (int j = 0; j < 3; j++) {
+					bounds[2 * j] = std::min(bounds[2 * j], voxel[j]);
+					bounds[2 * j + 1] = std::max(bounds[2 * j + 1], j == 0 ? end : voxel[j]);
+				}
+			}
+		}
+		auto mask = vtkSmartPointer<vtkImageData>::New();
+		mask->SetOrigin(m_Image->GetOrigin());
+		mask->SetSpacing(m_Image->GetSpacing());
+		if (bounds[1] < bounds[0])
+			return mask;
+		int extent[6];
+		for (int j = 0; j < 3; j++) {
+			extent[2 * j] = m_Extent[2 * j] + bounds[2 * j] - 1;
+			extent[2 * j + 1] = m_Extent[2 * j] + bounds[2 * j + 1] + 1;
+		}
+		mask->SetExtent(extent);
+		mask->AllocateScalars(VTK_UNSIGNED_CHAR, 1);
+		const int width = extent[1] - extent[0] + 1, height = extent[3] - extent[2] + 1;
+		unsigned char* bytes = static_cast<unsigned char*>(mask->GetScalarPointer());
+		std::fill(bytes, bytes + (size_t)width * height * (extent[5] - extent[4] + 1), 0);
+		vtkSMPTools::For(bounds[4], bounds[5] + 1, [&](vtkIdType first, vtkIdType last) {
+			for (vtkIdType z = first; z < last; z++) {
+				for (int y = bounds[2]; y <= bounds[3]; y++) {
+					const uint64_t* region = this->Row(m_Region, y + m_Size[1] * (int)z);
+					unsigned char* out = bytes + ((size_t)(z - bounds[4] + 1) * height + (y - bounds[2] + 1)) * width + 1;
+					for (int x = bounds[0]; x <= bounds[1]; x++)
+						out[x - bounds[0]] = (region[x / 64] >> (x % 64)) & 1 ? 255 : 0;
+				}
+			}
+		});
+		return mask;
+	}
+
+	size_t	Voxels = 0;			// voxels in the region
+	int		Levels = 0;			// wavefront steps taken
+	double	Milliseconds = 0;	// time of the last grow
+
+	// Share of the thresholded voxels the blocks let the last grow skip, and
+	// the time skipping them saved at the rate the others were read.
+	double GetSkippedFraction() const
+	{
+		const double total = (double)m_ReadVoxels + m_SkippedVoxels;
+		return total > 0 ? m_SkippedVoxels / total : 0;
+	}
+	double GetSkippedMilliseconds() const
+	{
+		return m_ReadVoxels > 0 ? 1e-6 * m_ThresholdNs * m_SkippedVoxels / m_ReadVoxels : 0;
+	}
+
+private:
+	uint64_t* Row(std::vector<uint64_t>& bits, int row) const { return bits.data() + (size_t)row * m_Words; }
+	const uint64_t* Row(const std::vector<uint64_t>& bits, int row) const { return bits.data() + (size_t)row * m_Words; }
+
+	static int TrailingZeros(uint64_t word)
+	{
+		// de Bruijn multiplication, valid for a non-zero word.
+		static const int table[64] = { 0, 1, 48, 2, 57, 49, 28, 3, 61, 58, 50, 42, 38, 29, 17, 4, 62, 55, 59, 36,
+			53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12, 5, 63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32,
+			23, 11, 46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19, 9, 13, 8, 7, 6 };
+		return table[((word & (~word + 1)) * 0x03f79d71b4cb0a89ULL) >> 58];
+	}
+
+	static int LeadingZeros(uint64_t word)
+	{
+		int n = 0;
+		for (int shift = 32; shift > 0; shift /= 2) {
+			if (!(word >> (64 - shift))) {
+				n += shift;
+				word <<= shift;
+			}
+		}
+		return n;
+	}
+
+	static int PopCount(uint64_t word)
+	{
+		word = word - ((word >> 1) & 0x5555555555555555ULL);
+		word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+		word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+		return (int)((word * 0x0101010101010101ULL) >> 56);
+	}
+
+	// First bit at or after from that is set (or clear), or bits if none.
+	static int FindBit(const uint64_t* words, int from, int bits, bool set)
+	{
+		while (from < bits) {
+			uint64_t word = set ? words[from / 64] : ~words[from / 64];
+			word &= ~uint64_t(0) << (from % 64);
+			if (word)
+				return std::min(from / 64 * 64 + TrailingZeros(word), bits);
+			from = from / 64 * 64 + 64;
+		}
+		return bits;
+	}
+
+	// First bit of the run of set bits that contains bit x.
+	static int RunStart(const uint64_t* words, int x)
+	{
+		int w = x / 64;
+		uint64_t clear = ~words[w] & ((uint64_t(1) << (x % 64)) - 1);
+		while (!clear) {
+			if (w == 0)
+				return 0;
+			clear = ~words[--w];
+		}
+		return w * 64 + 64 - LeadingZeros(clear);
+	}
+
+	template <class T>
+	void ThresholdRow(const T* voxels, uint64_t* bits, int row)
+	{
+		if (m_Blocks) {
+			this->ThresholdRowInBlocks(voxels, bits, row);
+			return;
+		}
+		m_ReadVoxels += m_Size[0];
+		std::fill(bits, bits + m_Words, 0);
+		this->ThresholdRun(voxels, bits, 0, m_Size[0]);
+	}
+
+	// Sets the bits of [begin, end) one word at a time; bits start clear.
+	template <class T>
+	void ThresholdRun(const T* voxels, uint64_t* bits, int begin, int end)
+	{
+		for (int x = begin; x < end;) {
+			const int stop = std::min(end, (x / 64 + 1) * 64);
+			uint64_t word = 0;
+			for (; x < stop; x++) {
+				const double value = voxels[x];
+				word |= uint64_t(value >= m_Lower && value <= m_Upper) << (x % 64);
+			}
+			bits[(stop - 1) / 64] |= word;
+		}
+	}
+
+	// Runs of the row in blocks with no in-range value stay clear unread.
+	template <class T>
+	void ThresholdRowInBlocks(const T* voxels, uint64_t* bits, int row)
+	{
+		const int y = m_Extent[2] + row % m_Size[1], z = m_Extent[4] + row / m_Size[1];
+		std::fill(bits, bits + m_Words, 0);
+		size_t skipped = 0;
+		for (int x = 0; x < m_Size[0];) {
+			const int i = m_Extent[0] + x;
+			const int end = std::min(m_Size[0], m_Blocks->NextBlockStart(0, i) - m_Extent[0]);
+			if (!BlockRangeGrid::IsSet(m_Occupied, m_Blocks->BlockOf(i, y, z))) {
+				skipped += end - x;
+				x = end;
+				continue;
+			}
+			this->ThresholdRun(voxels, bits, x, end);
+			x = end;
+		}
+		m_SkippedVoxels += skipped;
+		m_ReadVoxels += m_Size[0] - skipped;
+	}
+
+	// Keeps the runs of in-range voxels touched by the bits the row was
+	// handed; returns the number of voxels added.
+	size_t WidenRow(int row)
+	{
+		uint64_t* inRange = this->Row(m_InRange, row);
+		if (!m_Thresholded[row]) {
+			auto start = std::chrono::steady_clock::now();
+			void* voxels = m_Image->GetScalarPointer(m_Extent[0], m_Extent[2] + row % m_Size[1], m_Extent[4] + row / m_Size[1]);
+			switch (m_Image->GetScalarType()) {
+				vtkTemplateMacro(this->ThresholdRow(static_cast<const VTK_TT*>(voxels), inRange, row));
+			}
+			m_Thresholded[row] = 1;
+			m_ThresholdNs += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		}
+		uint64_t* region = this->Row(m_Region, row);
+		uint64_t* added = this->Row(m_Added, row);
+		uint64_t any = 0;
+		for (int w = 0; w < m_Words; w++) {
+			added[w] = m_Received[(size_t)row * m_Words + w].exchange(0, std::memory_order_relaxed) & inRange[w] & ~region[w];
+			any |= added[w];
+		}
+		if (!any)
+			return 0;
+		// A run that already belongs to the region is complete, so every run
+		// holding a new bit is new; widening in place only writes runs whose
+		// bits were already read.
+		for (int x = FindBit(added, 0, m_Size[0], true); x < m_Size[0]; x = FindBit(added, x, m_Size[0], true)) {
+			const int begin = RunStart(inRange, x), end = FindBit(inRange, x, m_Size[0], false);
+			for (int w = begin / 64; w <= (end - 1) / 64; w++) {
+				uint64_t bits = ~uint64_t(0);
+				if (w == begin / 64)
+					bits &= ~uint64_t(0) << (begin % 64);
+				if (w == (end - 1) / 64 && end % 64)
+					bits &= ~(~uint64_t(0) << (end % 64));
+				added[w] |= bits;
+			}
+			x = end;
+		}
+		size_t count = 0;
+		for (int w = 0; w < m_Words; w++) {
+			region[w] |= added[w];
+			count += PopCount(added[w]);
+		}
+		return count;
+	}
+
+	// Hands the row's new voxels to a neighbour row; true if any are new there.
+	bool Send(int row, int neighbour)
+	{
+		const uint64_t* added = this->Row(m_Added, row);
+		const uint64_t* region = this->Row(m_Region, neighbour);
+		bool any = false;
+		for (int w = 0; w < m_Words; w++) {
+			const uint64_t fresh = added[w] & ~region[w];
+			if (fresh) {
+				m_Received[(size_t)neighbour * m_Words + w].fetch_or(fresh, std::memory_order_relaxed);
+				any = true;
+			}
+		}
+		return any;
+	}
+
+	vtkSmartPointer<vtkImageData>	m_Image;
+	const BlockRangeGrid*			m_Blocks = nullptr;
+	std::vector<uint64_t>			m_Occupied;		// blocks with values in [m_Lower, m_Upper]
+	std::atomic<uint64_t>			m_ReadVoxels{ 0 }, m_SkippedVoxels{ 0 }, m_ThresholdNs{ 0 };
+	int								m_Extent[6]{ 0, -1, 0, -1, 0, -1 };
+	int								m_Size[3]{ 0, 0, 0 };
+	int								m_Words = 0;	// words per row
+	double							m_Lower = 0, m_Upper = 0;
+	std::vector<uint64_t>			m_Region;		// the grown region
+	std::vector<uint64_t>			m_InRange;		// valid where m_Thresholded
+	std::vector<uint64_t>			m_Added;		// bits each row gained in its last widening
+	std::vector<unsigned char>		m_Thresholded;
+	std::unique_ptr<std::atomic<uint64_t>[]>		m_Received;	// bits handed over by neighbour rows
+	std::unique_ptr<std::atomic<unsigned char>[]>	m_Queued;	// row is in the next level's list
+};
+
+// Region growing on the --volume data.  Key 'g' seeds a grow at the first
+// in-range voxel under the mouse inside box 0, '[' and ']' lower or raise
+// the lower threshold and grow again from the same seed.  The region is
+// shown as a contour of its mask.
+struct RegionGrowTool
+{
+	std::string		FileName;
+	vtkRenderer*	Renderer = nullptr;
+	const BoxROI*	ROI = nullptr;
+	double			Range[2]{ 500, 4095 };
+	RegionGrower	Grower;
+	BlockRangeGrid	Blocks;
+	vtkSmartPointer<vtkActor>	Actor;
+#ifdef USE_FLYING_EDGES
+	vtkSmartPointer<vtkFlyingEdges3D>	Contour;
+#else
+	vtkSmartPointer<vtkMarchingCubes>	Contour;
+#endif
+
+	bool Load()
+	{
+		vtkNew<vtkMetaImageReader> reader;
+		if (!reader->CanReadFile(this->FileName.c_str()))
+			return false;
+		reader->SetFileName(this->FileName.c_str());
+		reader->Update();
+		this->Grower.SetInput(reader->GetOutput());
+		this->Blocks.Build(reader->GetOutput());
+		this->Grower.SetBlocks(&this->Blocks);
+		return true;
+	}
+
+	// Seeds at display position (x, y): the first in-range voxel inside the
+	// box along the view ray.
+	bool SeedAt(int x, int y)
+	{
+		vtkImageData* image = this->Grower.GetInput();
+		double ray[2][4];
+		for (int d = 0; d < 2; d++) {
+			this->Renderer->SetDisplayPoint(x, y, d);
+			this->Renderer->DisplayToWorld();
+			this->Renderer->GetWorldPoint(ray[d]);
+			if (ray[d][3] == 0.0)
+				return false;
+			for (int j = 0; j < 3; j++)
+				ray[d][j] /= ray[d][3];
+		}
+		double box[6], enter = 0, leave = 1;
+		this->ROI->GetCropBox(box);
+		for (int j = 0; j < 3; j++) {
+			double direction = ray[1][j] - ray[0][j];
+			if (std::abs(direction) < 1e-12) {
+				if (ray[0][j] < box[2 * j] || ray[0][j] > box[2 * j + 1])
+					return false;
+				continue;
+			}
+			double t0 = (box[2 * j] - ray[0][j]) / direction, t1 = (box[2 * j + 1] - ray[0][j]) / direction;
+			enter = std::max(enter, std::min(t0, t1));
+			leave = std::min(leave, std::max(t0, t1));
+		}
+		if (enter > leave)
+			return false;
+		double origin[3], spacing[3];
+		int extent[6];
+		image->GetOrigin(origin);
+		image->GetSpacing(spacing);
+		image->GetExtent(extent);
+		const double length = std::sqrt(vtkMath::Distance2BetweenPoints(ray[0], ray[1])) * (leave - enter);
+		const double step = 0.5 * std::min(std::min(spacing[0], spacing[1]), spacing[2]);
+		for (double s = 0; s <= length; s += step) {
+			const double t = enter + (leave - enter) * s / std::max(length, step);
+			int voxel[3];
+			bool inside = true;
+			for (int j = 0; j < 3; j++) {
+				voxel[j] = (int)std::lround((ray[0][j] + t * (ray[1][j] - ray[0][j]) - origin[j]) / spacing[j]);
+				inside = inside && voxel[j] >= extent[2 * j] && voxel[j] <= extent[2 * j + 1];
+			}
+			if (!inside)
+				continue;
+			double value = image->GetScalarComponentAsDouble(voxel[0], voxel[1], voxel[2], 0);
+			if (value >= this->Range[0] && value <= this->Range[1]) {
+				std::copy(voxel, voxel + 3, this->Seed);
+				this->HasSeed = true;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Grows from the last seed within the box's current voxels.
+	bool Grow()
+	{
+		if (!this->HasSeed)
+			return false;
+		vtkImageData* image = this->Grower.GetInput();
+		double box[6], origin[3], spacing[3];
+		int extent[6], boxExtent[6];
+		this->ROI->GetCropBox(box);
+		image->GetOrigin(origin);
+		image->GetSpacing(spacing);
+		image->GetExtent(extent);
+		for (int j = 0; j < 3; j++) {
+			boxExtent[2 * j] = std::max(extent[2 * j], (int)std::ceil((box[2 * j] - origin[j]) / spacing[j]));
+			boxExtent[2 * j + 1] = std::min(extent[2 * j + 1], (int)std::floor((box[2 * j + 1] - origin[j]) / spacing[j]));
+			if (this->Seed[j] < boxExtent[2 * j] || this->Seed[j] > boxExtent[2 * j + 1]) {
+				std::cout << "grow: the seed is outside the box" << std::endl;
+				return false;
+			}
+		}
+		if (!this->Grower.Grow(boxExtent, this->Seed, this->Range[0], this->Range[1])) {
+			std::cout << "grow: the seed is outside [" << this->Range[0] << ", " << this->Range[1] << "]" << std::endl;
+			return false;
+		}
+		std::cout << "grow: " << this->Grower.Voxels << " voxels in [" << this->Range[0] << ", " << this->Range[1]
+			<< "], " << this->Grower.Levels << " levels, " << this->Grower.Milliseconds << " ms; blocks out of range skipped "
+			<< 100 * this->Grower.GetSkippedFraction() << "% of the voxels thresholded, about "
+			<< this->Grower.GetSkippedMilliseconds() << " ms saved (threshold time per voxel extrapolated linearly)" << std::endl;
+		this->ShowRegion();
+		return true;
+	}
+
+private:
+	void ShowRegion()
+	{
+		if (!this->Actor) {
+#ifdef USE_FLYING_EDGES
+			this->Contour = vtkSmartPointer<vtkFlyingEdges3D>::New();
+#else
+			this->Contour = vtkSmartPointer<vtkMarchingCubes>::New();
+#endif
+			this->Contour->SetValue(0, 127.5);
+			vtkNew<vtkPolyDataMapper> mapper;
+			mapper->SetInputConnection(this->Contour->GetOutputPort());
+			mapper->ScalarVisibilityOff();
+			vtkNew<vtkNamedColors> colors;
+			this->Actor = vtkSmartPointer<vtkActor>::New();
+			this->Actor->SetMapper(mapper);
+			this->Actor->GetProperty()->SetDiffuseColor(colors->GetColor3d("Tomato").GetData());
+			this->Actor->PickableOff();
+			this->Renderer->AddActor(this->Actor);
+		}
+		this->Contour->SetInputData(this->Grower.GetMaskImage());
+	}
+
+	int		Seed[3]{ 0, 0, 0 };
+	bool	HasSeed = false;
+};
+
+static void RegionGrowKeyPress(vtkObject* caller, unsigned long, void* clientData, void*)
+{
+	vtkRenderWindowInteractor* iren = vtkRenderWindowInteractor::SafeDownCast(caller);
+	RegionGrowTool* tool = static_cast<RegionGrowTool*>(clientData);
+	std::string key = iren->GetKeySym();
+	bool seed = key == "g";	// Press 'g' to grow a region from the voxel under the mouse
+	if (!seed && key != "bracketleft" && key != "bracketright")
+		return;
+	if (!tool->Grower.GetInput() && !tool->Load()) {
+		std::cerr << "Cannot read volume " << tool->FileName << std::endl;
+		return;
+	}
+	if (seed) {
+		int position[2];
+		iren->GetEventPosition(position);
+		if (!tool->SeedAt(position[0], position[1])) {
+			std::cout << "grow: no voxel in [" << tool->Range[0] << ", " << tool->Range[1]
+				<< "] under the mouse inside the box" << std::endl;
+			return;
+		}
+	}
+	else {
+		tool->Range[0] += key == "bracketright" ? 50 : -50;
+	}
+	if (tool->Grow())
+		iren->Render();
+}
+
+// Writes surfaces as one binary STL or PLY file (chosen by extension),
+// reading the points and cells the mappers draw rather than a copy of
+// them.  Output goes through one fixed buffer flushed in large writes, so
+// memory use does not grow with the mesh.  STL needs nothing else.  PLY
+// shares vertices, so it also keeps one index per point, which lets it
+// write only the points the cells use.  Polygons become fans in STL.
+class MeshExporter
+{
+public:
+	bool Write(const std::string& fileName, const std::vector<vtkPolyData*>& meshes)
+	{
+		auto start = std::chrono::steady_clock::now();
+		m_Out.open(fileName, std::ios::binary | std::ios::trunc);
+		if (!m_Out)
+			return false;
+		m_Buffer.resize(BufferSize);
+		m_Used = 0;
+		this->Bytes = 0;
+		this->Triangles = 0;
+		std::string extension = fileName.size() >= 4 ? fileName.substr(fileName.size() - 4) : "";
+		std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+		if (extension == ".ply")
+			this->WritePLY(meshes);
+		else
+			this->WriteSTL(meshes);
+		this->Flush();
+		bool ok = (bool)m_Out;
+		m_Out.close();
+		std::vector<char>().swap(m_Buffer);
+		this->Milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		return ok;
+	}
+
+	size_t	Bytes = 0;
+	size_t	Triangles = 0;
+	double	Milliseconds = 0;
+
+private:
+	static const size_t BufferSize = 8 << 20;
+
+	static bool LittleEndian()
+	{
+		const uint16_t one = 1;
+		return *reinterpret_cast<const unsigned char*>(&one) == 1;
+	}
+
+	void Flush()
+	{
+		m_Out.write(m_Buffer.data(), (std::streamsize)m_Used);
+		this->Bytes += m_Used;
+		m_Used = 0;
+	}
+
+	void Put(const void* data, size_t size)
+	{
+		if (m_Used + size > m_Buffer.size())
+			this->Flush();
+		std::memcpy(m_Buffer.data() + m_Used, data, size);
+		m_Used += size;
+	}
+
+	// A value in little-endian byte order, as both formats are written.
+	template <class T>
+	void PutLittle(T value)
+	{
+		unsigned char bytes[sizeof(T)];
+		std::memcpy(bytes, &value, sizeof(T));
+		if (!m_LittleEndian)
+			std::reverse(bytes, bytes + sizeof(T));
+		this->Put(bytes, sizeof(T));
+	}
+
+	void PutFloats(const float* values, int count)
+	{
+		if (m_LittleEndian) {
+			this->Put(values, count * sizeof(float));
+			return;
+		}
+		for (int i = 0; i < count; i++)
+			this->PutLittle(values[i]);
+	}
+
+	// Point p of mesh, straight from the array when it holds floats.
+	static void GetPoint(vtkPoints* points, const float* xyz, vtkIdType p, float point[3])
+	{
+		if (xyz) {
+			std::copy(xyz + 3 * p, xyz + 3 * p + 3, point);
+			return;
+		}
+		double x[3];
+		points->GetPoint(p, x);
+		for (int j = 0; j < 3; j++)
+			point[j] = (float)x[j];
+	}
+
+	// Triangles collapsed to a line or a point, such as the unused ones in
+	// the clipper's cut slots, are not written.
+	static bool IsCollapsed(vtkIdType a, vtkIdType b, vtkIdType c)
+	{
+		return a == b || b == c || a == c;
+	}
+
+	static const float* FloatPoints(vtkPoints* points)
+	{
+		vtkFloatArray* array = vtkFloatArray::SafeDownCast(points->GetData());
+		return array ? array->GetPointer(0) : nullptr;
+	}
+
+	void WriteSTL(const std::vector<vtkPolyData*>& meshes)
+	{
+		char header[80] = "MedicalDemo3 box-clipped surface";
+		this->Put(header, sizeof(header));
+		// The count is patched in at the end, so the cells are read once.
+		this->PutLittle<uint32_t>(0);
+		for (vtkPolyData* mesh : meshes) {
+			vtkPoints* points = mesh->GetPoints();
+			if (!points)
+				continue;
+			const float* xyz = FloatPoints(points);
+			vtkCellArray* polys = mesh->GetPolys();
+			vtkIdType npts;
+			const vtkIdType* pts;
+			for (polys->InitTraversal(); polys->GetNextCell(npts, pts);) {
+				for (vtkIdType k = 1; k + 1 < npts; k++) {
+					if (IsCollapsed(pts[0], pts[k], pts[k + 1]))
+						continue;
+					float corners[3][3];
+					GetPoint(points, xyz, pts[0], corners[0]);
+					GetPoint(points, xyz, pts[k], corners[1]);
+					GetPoint(points, xyz, pts[k + 1], corners[2]);
+					float u[3], v[3], normal[3];
+					vtkMath::Subtract(corners[1], corners[0], u);
+					vtkMath::Subtract(corners[2], corners[0], v);
+					vtkMath::Cross(u, v, normal);
+					vtkMath::Normalize(normal);
+					this->PutFloats(normal, 3);
+					this->PutFloats(corners[0], 9);
+					this->PutLittle<uint16_t>(0);
+					this->Triangles++;
+				}
+			}
+		}
+		this->Flush();
+		m_Out.seekp(80);
+		uint32_t count = (uint32_t)this->Triangles;
+		unsigned char bytes[4] = { (unsigned char)count, (unsigned char)(count >> 8), (unsigned char)(count >> 16),
+			(unsigned char)(count >> 24) };
+		m_Out.write(reinterpret_cast<const char*>(bytes), 4);
+		m_Out.seekp(0, std::ios::end);
+	}
+
+	void WritePLY(const std::vector<vtkPolyData*>& meshes)
+	{
+		// Number the points the cells use, across all meshes.
+		std::vector<std::vector<int32_t>> numbers(meshes.size());
+		size_t numVertices = 0, numFaces = 0;
+		for (size_t m = 0; m < meshes.size(); m++) {
+			if (!meshes[m]->GetPoints())
+				continue;
+			numbers[m].assign(meshes[m]->GetNumberOfPoints(), -1);
+			vtkCellArray* polys = meshes[m]->GetPolys();
+			vtkIdType npts;
+			const vtkIdType* pts;
+			for (polys->InitTraversal(); polys->GetNextCell(npts, pts);) {
+				if (npts == 3 && IsCollapsed(pts[0], pts[1], pts[2]))
+					continue;
+				for (vtkIdType k = 0; k < npts; k++)
+					numbers[m][pts[k]] = 0;
+				numFaces++;
+			}
+			for (int32_t& number : numbers[m])
+				if (number == 0)
+					number = (int32_t)numVertices++;
+		}
+
+		std::ostringstream header;
+		header << "ply\nformat binary_little_endian 1.0\ncomment MedicalDemo3 box-clipped surface\n"
+			<< "element vertex " << numVertices << "\nproperty float x\nproperty float y\nproperty float z\n"
+			<< "element face " << numFaces << "\nproperty list uchar int vertex_indices\nend_header\n";
+		const std::string text = header.str();
+		this->Put(text.data(), text.size());
+		for (size_t m = 0; m < meshes.size(); m++) {
+			vtkPoints* points = meshes[m]->GetPoints();
+			if (!points)
+				continue;
+			const float* xyz = FloatPoints(points);
+			for (vtkIdType p = 0; p < (vtkIdType)numbers[m].size(); p++) {
+				if (numbers[m][p] < 0)
+					continue;
+				float point[3];
+				GetPoint(points, xyz, p, point);
+				this->PutFloats(point, 3);
+			}
+		}
+		for (size_t m = 0; m < meshes.size(); m++) {
+			if (!meshes[m]->GetPoints())
+				continue;
+			vtkCellArray* polys = meshes[m]->GetPolys();
+			vtkIdType npts;
+			const vtkIdType* pts;
+			for (polys->InitTraversal(); polys->GetNextCell(npts, pts);) {
+				if (npts == 3 && IsCollapsed(pts[0], pts[1], pts[2]))
+					continue;
+				const unsigned char count = (unsigned char)std::min<vtkIdType>(npts, 255);
+				this->Put(&count, 1);
+				for (vtkIdType k = 0; k < count; k++)
+					this->PutLittle<int32_t>(numbers[m][pts[k]]);
+				this->Triangles += npts > 2 ? npts - 2 : 0;
+			}
+		}
+	}
+
+	std::ofstream		m_Out;
+	std::vector<char>	m_Buffer;
+	size_t				m_Used = 0;
+	const bool			m_LittleEndian = LittleEndian();
+};
+
+static void ExportKeyPress(vtkObject* caller, unsigned long, void* clientData, void*)
+{
+	vtkRenderWindowInteractor* iren = vtkRenderWindowInteractor::SafeDownCast(caller);
+	std::string key = iren->GetKeySym();
+	if (key != "x") // Press 'x' to export the box-clipped surface
+		return;
+	VolumeSurface* volume = static_cast<VolumeSurface*>(clientData);
+	if (!volume->ClipBox || volume->RayCast) {
+		std::cout << "export: needs --clip-surface and cannot export a --ray-cast view" << std::endl;
+		return;
+	}
+	if (!volume->Clipper) {
+		std::cout << "export: show the surface with 'v' first" << std::endl;
+		return;
+	}
+	MeshExporter exporter;
+	if (!exporter.Write(volume->ExportFile, { volume->Clipper->GetInside(), volume->Clipper->GetCut() })) {
+		std::cerr << "Cannot write " << volume->ExportFile << std::endl;
+		return;
+	}
+	std::cout << "export: " << volume->ExportFile << ", " << exporter.Triangles << " triangles, "
+		<< exporter.Bytes / 1e6 << " MB in " << exporter.Milliseconds << " ms ("
+		<< exporter.Bytes / 1e3 / std::max(exporter.Milliseconds, 1e-3) << " MB/s)" << std::endl;
+}
+
+static void AllocationStatsKeyPress(vtkObject* caller, unsigned long, void*, void*)
+{
+	vtkRenderWindowInteractor* iren = vtkRenderWindowInteractor::SafeDownCast(caller);
+	std::string key = iren->GetKeySym();
+	if (key == "a") // Press 'a' to print allocations per interaction phase
+		AllocationStats::Print();
+}
 
-int test4(int argc, char* argv[]);
-int main(int argc, char* argv[])
+// --alloc-check: hovers across box 0, then drags the face facing the camera
+// round a circle, and fails if any hover or drag event past the warm-up
+// allocated outside rendering.
+static bool RunAllocationCheck(vtkRenderWindowInteractor* iren, vtkRenderer* renderer,
+	vtkInteractorStyle* actorStyle, BoxROI* roi)
 {
-	int ret = test4(argc, argv);
+	iren->SetInteractorStyle(actorStyle);
+	iren->GetRenderWindow()->Render();
+	const double* bounds = roi->GetBounds();
+	renderer->SetWorldPoint(0.5 * (bounds[0] + bounds[1]), 0.5 * (bounds[2] + bounds[3]),
+		0.5 * (bounds[4] + bounds[5]), 1.0);
+	renderer->WorldToDisplay();
+	double center[3];
+	renderer->GetDisplayPoint(center);
 
-	return ret;
+	auto send = [iren](double x, double y, unsigned long event) {
+		iren->SetEventInformation((int)x, (int)y);
+		iren->InvokeEvent(event, nullptr);
+	};
+	// Sweeping on and off the box changes the hovered face, which renders.
+	for (int m = 0; m <= 100; m++) {
+		double sweep = std::abs(m - 50) / 50.0;
+		send(center[0] - 200 * sweep, center[1], vtkCommand::MouseMoveEvent);
+	}
+	const int moves = 200;
+	send(center[0], center[1], vtkCommand::LeftButtonPressEvent);
+	for (int m = 1; m <= moves; m++) {
+		double angle = 2 * vtkMath::Pi() * m / 50;
+		send(center[0] + 20 * std::cos(angle), center[1] + 20 * std::sin(angle), vtkCommand::MouseMoveEvent);
+	}
+	send(center[0], center[1], vtkCommand::LeftButtonReleaseEvent);
+
+	AllocationStats::Print();
+	if (AllocationStats::PhaseTotals[AllocationStats::Drag].events == 0) {
+		std::cerr << "allocation check: no face was picked" << std::endl;
+		return false;
+	}
+	const AllocationStats::Totals& drag = AllocationStats::PhaseTotals[AllocationStats::Drag];
+	std::cout << "allocation check: only allocations outside rendering are checked; with the renders they trigger, "
+		<< "drag events allocated " << (double)drag.allocationsWithNested / drag.events << " blocks each" << std::endl;
+	return AllocationStats::SteadyDragEventsThatAllocated == 0 && AllocationStats::SteadyHoverEventsThatAllocated == 0;
 }
 
-static unsigned char bkg[4] = { 51, 77, 102, 255 };
+// One snapshot of a batch: a camera pose (the default view when absent) and
+// a box, given either as its extent or as the six face offsets.
+struct SnapshotJob
+{
+	std::string	name;
+	bool		hasCamera = false;
+	double		position[3] = { 0 };
+	double		focalPoint[3] = { 0 };
+	double		viewUp[3] = { 0 };
+	bool		hasBox = false;
+	bool		boxIsExtent = false;
+	double		box[6] = { 0 };
+};
+
+// Job file: one snapshot per line, '#' starts a comment.
+//   name [camera px py pz fx fy fz ux uy uz] [box xmin xmax ymin ymax zmin zmax | offsets t0 .. t5]
+static bool ReadSnapshotJobs(const std::string& fileName, std::vector<SnapshotJob>& jobs)
+{
+	std::ifstream in(fileName);
+	if (!in)
+		return false;
+	std::string line;
+	for (int lineNumber = 1; std::getline(in, line); lineNumber++) {
+		line = line.substr(0, line.find('#'));
+		std::istringstream fields(line);
+		SnapshotJob job;
+		if (!(fields >> job.name))
+			continue;
+		bool ok = true;
+		std::string keyword;
+		while (ok && fields >> keyword) {
+			if (keyword == "camera") {
+				job.hasCamera = true;
+				for (double* v : { job.position, job.focalPoint, job.viewUp })
+					ok = ok && (fields >> v[0] >> v[1] >> v[2]);
+			}
+			else if (keyword == "box" || keyword == "offsets") {
+				job.hasBox = true;
+				job.boxIsExtent = keyword == "box";
+				for (int i = 0; i < 6; i++)
+					ok = ok && (fields >> job.box[i]);
+			}
+			else {
+				ok = false;
+			}
+		}
+		if (!ok) {
+			std::cerr << fileName << ":" << lineNumber << ": cannot parse snapshot job, skipped" << std::endl;
+			continue;
+		}
+		jobs.push_back(job);
+	}
+	return true;
+}
+
+// Renders every job off screen through one window-to-image filter and PNG
+// writer, so only the scene state changes between frames.
+static bool RunBatchSnapshots(const DemoOptions& options, vtkRenderWindow* renWin, vtkRenderer* renderer,
+	BoxROI* roi)
+{
+	std::vector<SnapshotJob> jobs;
+	if (!ReadSnapshotJobs(options.batchFile, jobs)) {
+		std::cerr << "Cannot read batch file " << options.batchFile << std::endl;
+		return false;
+	}
+
+	vtkCamera* camera = renderer->GetActiveCamera();
+	double defaultPosition[3], defaultFocalPoint[3], defaultViewUp[3];
+	camera->GetPosition(defaultPosition);
+	camera->GetFocalPoint(defaultFocalPoint);
+	camera->GetViewUp(defaultViewUp);
+
+	vtkNew<vtkWindowToImageFilter> grabber;
+	grabber->SetInput(renWin);
+	grabber->SetInputBufferTypeToRGB();
+	grabber->ReadFrontBufferOff();
+	grabber->ShouldRerenderOff();
+	vtkNew<vtkPNGWriter> writer;
+	writer->SetInputConnection(grabber->GetOutputPort());
+
+	double renderSeconds = 0, writeSeconds = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (const SnapshotJob& job : jobs) {
+		if (job.hasCamera) {
+			camera->SetPosition(job.position);
+			camera->SetFocalPoint(job.focalPoint);
+			camera->SetViewUp(job.viewUp);
+		}
+		else {
+			camera->SetPosition(defaultPosition);
+			camera->SetFocalPoint(defaultFocalPoint);
+			camera->SetViewUp(defaultViewUp);
+		}
+		double offsets[NUMOFPLANES] = { 0 };
+		if (job.boxIsExtent)
+			roi->GetFaceOffsetsForBox(job.box, offsets);
+		else if (job.hasBox)
+			std::copy(job.box, job.box + NUMOFPLANES, offsets);
+		roi->SetFaceOffsets(offsets);
+		renderer->ResetCameraClippingRange();
+
+		auto frameStart = std::chrono::steady_clock::now();
+		renWin->Render();
+		auto frameRendered = std::chrono::steady_clock::now();
+		grabber->Modified();
+		std::string fileName = options.batchOutput + "/" + job.name + ".png";
+		writer->SetFileName(fileName.c_str());
+		writer->Write();
+		auto frameWritten = std::chrono::steady_clock::now();
+		renderSeconds += std::chrono::duration<double>(frameRendered - frameStart).count();
+		writeSeconds += std::chrono::duration<double>(frameWritten - frameRendered).count();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	size_t count = jobs.size();
+	std::cout << "batch: " << count << " snapshots in " << seconds << " s";
+	if (count > 0) {
+		std::cout << " (" << count / seconds << " images/s, " << 1000 * renderSeconds / count << " ms render, "
+			<< 1000 * writeSeconds / count << " ms write per image)";
+	}
+	std::cout << std::endl;
+	return true;
+}
+
+// Session files: the boxes, the 3D camera and the active style, written as
+// raw little structs so a case reopens in a few milliseconds.  Restoring
+// only pushes values that differ into the faces, so pipelines whose inputs
+// are unchanged do not run again.
+namespace Session
+{
+	const uint32_t	Magic = 0x5333444d;	// "MD3S"
+	const uint32_t	Version = 1;
+
+	struct Header
+	{
+		uint32_t	magic;
+		uint32_t	version;
+		uint32_t	rois;
+		uint32_t	actorMode;		// 1 when the box (actor) style was active
+	};
+
+	struct BoxState
+	{
+		double	bounds[6];
+		double	offsets[NUMOFPLANES];
+	};
+
+	struct CameraState
+	{
+		double	position[3];
+		double	focalPoint[3];
+		double	viewUp[3];
+		double	clippingRange[2];
+		double	viewAngle;
+		double	parallelScale;
+		int32_t	parallelProjection;
+		int32_t	reserved;
+	};
+
+	static bool Save(const std::string& fileName, const std::vector<BoxROI*>& rois, vtkCamera* camera, bool actorMode)
+	{
+		Header header{ Magic, Version, (uint32_t)rois.size(), actorMode ? 1u : 0u };
+		std::vector<BoxState> boxes(rois.size());
+		for (size_t r = 0; r < rois.size(); r++) {
+			std::copy(rois[r]->GetBounds(), rois[r]->GetBounds() + 6, boxes[r].bounds);
+			rois[r]->GetFaceOffsets(boxes[r].offsets);
+		}
+		CameraState view{};
+		camera->GetPosition(view.position);
+		camera->GetFocalPoint(view.focalPoint);
+		camera->GetViewUp(view.viewUp);
+		camera->GetClippingRange(view.clippingRange);
+		view.viewAngle = camera->GetViewAngle();
+		view.parallelScale = camera->GetParallelScale();
+		view.parallelProjection = camera->GetParallelProjection();
+
+		std::ofstream out(fileName, std::ios::binary);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(boxes.data()), boxes.size() * sizeof(BoxState));
+		out.write(reinterpret_cast<const char*>(&view), sizeof(view));
+		return (bool)out;
+	}
+
+	// Restores as many boxes as both the file and the scene have.
+	static bool Load(const std::string& fileName, const std::vector<BoxROI*>& rois, vtkCamera* camera, bool& actorMode)
+	{
+		std::ifstream in(fileName, std::ios::binary);
+		Header header;
+		if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != Magic || header.version != Version)
+			return false;
+		// The box count comes from the file, so it must match the file's
+		// size before anything is allocated for it.
+		const std::streamoff boxesStart = in.tellg();
+		in.seekg(0, std::ios::end);
+		const std::streamoff fileSize = in.tellg();
+		in.seekg(boxesStart);
+		if (boxesStart < 0 || (uint64_t)(fileSize - boxesStart) != (uint64_t)header.rois * sizeof(BoxState) + sizeof(CameraState))
+			return false;
+		std::vector<BoxState> boxes(header.rois);
+		CameraState view;
+		if (!in.read(reinterpret_cast<char*>(boxes.data()), boxes.size() * sizeof(BoxState)) ||
+			!in.read(reinterpret_cast<char*>(&view), sizeof(view)))
+			return false;
+		if (header.rois != rois.size()) {
+			std::cerr << fileName << " has " << header.rois << " boxes, the scene has " << rois.size()
+				<< "; restoring the first " << std::min<size_t>(header.rois, rois.size()) << std::endl;
+		}
+		for (size_t r = 0; r < std::min<size_t>(header.rois, rois.size()); r++)
+			rois[r]->SetState(boxes[r].bounds, boxes[r].offsets);
+
+		camera->SetPosition(view.position);
+		camera->SetFocalPoint(view.focalPoint);
+		camera->SetViewUp(view.viewUp);
+		camera->SetViewAngle(view.viewAngle);
+		camera->SetParallelScale(view.parallelScale);
+		camera->SetParallelProjection(view.parallelProjection);
+		camera->SetClippingRange(view.clippingRange);
+		actorMode = header.actorMode != 0;
+		return true;
+	}
+}
+
+// What the session keys need: F5 saves, F9 restores.
+struct SessionContext
+{
+	std::string							fileName;
+	std::vector<BoxROI*>				rois;
+	vtkCamera*							camera = nullptr;
+	vtkCustomInteractorStyleCamera*		style = nullptr;
+
+	bool Save(vtkRenderWindowInteractor* iren) const
+	{
+		bool actorMode = iren->GetInteractorStyle() == this->style->ActorStyle.Get();
+		auto start = std::chrono::steady_clock::now();
+		bool saved = Session::Save(this->fileName, this->rois, this->camera, actorMode);
+		std::cout << (saved ? "session saved to " : "cannot save session to ") << this->fileName << " in "
+			<< std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+		return saved;
+	}
+
+	bool Restore(vtkRenderWindowInteractor* iren) const
+	{
+		auto start = std::chrono::steady_clock::now();
+		bool actorMode = false;
+		if (!Session::Load(this->fileName, this->rois, this->camera, actorMode))
+			return false;
+		// The undo history starts again from the restored boxes, and linked
+		// views redraw them.
+		this->style->SetROIs(this->rois);
+		this->style->ActorStyle->NotifyBoxesChanged();
+		iren->SetInteractorStyle(actorMode ? static_cast<vtkInteractorStyle*>(this->style->ActorStyle) : this->style);
+		this->style->ActorStyle->ModeToggled(actorMode);
+		std::cout << "session restored from " << this->fileName << " in "
+			<< std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms"
+			<< (actorMode ? " (actor mode)" : "") << std::endl;
+		return true;
+	}
+};
+
+static void SessionKeyPress(vtkObject* caller, unsigned long, void* clientData, void*)
+{
+	vtkRenderWindowInteractor* iren = vtkRenderWindowInteractor::SafeDownCast(caller);
+	const SessionContext* session = static_cast<const SessionContext*>(clientData);
+	std::string key = iren->GetKeySym();
+	if (key == "F5") // Press F5 to save the session
+		session->Save(iren);
+	else if (key == "F9" && session->Restore(iren)) // Press F9 to go back to the saved session
+		iren->Render();
+}
+
+// Frame streaming.  In --serve mode test4 renders off screen and sends each
+// frame over a local socket, as the 64x64 tiles that changed since the
+// previous frame, each run-length encoded (or raw when that is smaller).
+// The client sends mouse and key events back; they are fed to the
+// interactor as if they came from a window, and every frame carries the
+// sequence number of the last event it reflects, so the client can time
+// the round trip.  --connect runs a scripted stand-in client.
+// The address is a TCP port on 127.0.0.1 or, if not a number, a Unix
+// socket path.  Streaming uses POSIX sockets and is not built on Windows.
+namespace FrameStream
+{
+	enum InputType : uint32_t { MouseMove, LeftButtonDown, LeftButtonUp, KeyPress, Quit };
+
+	struct Input
+	{
+		uint32_t	type;
+		int32_t		x;
+		int32_t		y;
+		uint32_t	sequence;
+		char		keySym[16];
+	};
+
+	const uint32_t	FrameMagic = 0x464b5456;	// "VTKF"
+	const int		TileSize = 64;
+
+	struct FrameHeader
+	{
+		uint32_t	magic;
+		uint32_t	sequence;		// last input applied before this frame
+		uint16_t	width;
+		uint16_t	height;
+		uint16_t	tileSize;
+		uint16_t	tiles;			// number of tiles that follow
+		uint32_t	payloadBytes;	// bytes of tile data after the header
+		float		renderMilliseconds;
+		float		encodeMilliseconds;
+	};
+
+	struct TileHeader
+	{
+		uint16_t	x;				// tile column and row
+		uint16_t	y;
+		uint32_t	size;			// encoded bytes; top bit set when run-length encoded
+	};
+
+	const uint32_t	RunLengthFlag = 0x80000000u;
+
+#ifndef _WIN32
+	static bool SendAll(int fd, const void* data, size_t size)
+	{
+		const char* bytes = static_cast<const char*>(data);
+		while (size > 0) {
+			ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+			if (sent <= 0)
+				return false;
+			bytes += sent;
+			size -= (size_t)sent;
+		}
+		return true;
+	}
+
+	static bool ReceiveAll(int fd, void* data, size_t size)
+	{
+		char* bytes = static_cast<char*>(data);
+		while (size > 0) {
+			ssize_t received = recv(fd, bytes, size, 0);
+			if (received <= 0)
+				return false;
+			bytes += received;
+			size -= (size_t)received;
+		}
+		return true;
+	}
+
+	static bool IsPort(const std::string& address)
+	{
+		return !address.empty() && address.find_first_not_of("0123456789") == std::string::npos;
+	}
+
+	// Listens on the address and waits for one client.
+	static int AcceptClient(const std::string& address)
+	{
+		int listener = -1;
+		if (IsPort(address)) {
+			listener = socket(AF_INET, SOCK_STREAM, 0);
+			int reuse = 1;
+			setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+			sockaddr_in addr{};
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			addr.sin_port = htons((uint16_t)std::stoi(address));
+			if (bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0) {
+				close(listener);
+				return -1;
+			}
+		}
+		else {
+			listener = socket(AF_UNIX, SOCK_STREAM, 0);
+			sockaddr_un addr{};
+			addr.sun_family = AF_UNIX;
+			std::strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path) - 1);
+			unlink(address.c_str());
+			if (bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0) {
+				close(listener);
+				return -1;
+			}
+		}
+		std::cout << "stream: waiting for a client on " << address << std::endl;
+		int client = listen(listener, 1) == 0 ? accept(listener, nullptr, nullptr) : -1;
+		close(listener);
+		if (client >= 0 && IsPort(address)) {
+			int noDelay = 1;
+			setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+		}
+		return client;
+	}
+
+	static int Connect(const std::string& address)
+	{
+		int fd = -1;
+		if (IsPort(address)) {
+			fd = socket(AF_INET, SOCK_STREAM, 0);
+			sockaddr_in addr{};
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			addr.sin_port = htons((uint16_t)std::stoi(address));
+			if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+				close(fd);
+				return -1;
+			}
+			int noDelay = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+		}
+		else {
+			fd = socket(AF_UNIX, SOCK_STREAM, 0);
+			sockaddr_un addr{};
+			addr.sun_family = AF_UNIX;
+			std::strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path) - 1);
+			if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+				close(fd);
+				return -1;
+			}
+		}
+		return fd;
+	}
+#endif
+
+	// Run-length encodes RGB pixels as (count, r, g, b) runs of up to 255.
+	static void EncodeRuns(const std::vector<uint8_t>& pixels, std::vector<uint8_t>& out)
+	{
+		out.clear();
+		size_t count = pixels.size() / 3;
+		for (size_t p = 0; p < count;) {
+			size_t run = 1;
+			while (p + run < count && run < 255 && std::memcmp(&pixels[3 * p], &pixels[3 * (p + run)], 3) == 0)
+				run++;
+			out.push_back((uint8_t)run);
+			out.insert(out.end(), &pixels[3 * p], &pixels[3 * p] + 3);
+			p += run;
+		}
+	}
+
+	static bool DecodeRuns(const uint8_t* data, size_t size, std::vector<uint8_t>& pixels)
+	{
+		pixels.clear();
+		for (size_t i = 0; i + 4 <= size; i += 4) {
+			for (int n = 0; n < data[i]; n++)
+				pixels.insert(pixels.end(), data + i + 1, data + i + 4);
+		}
+		return size % 4 == 0;
+	}
+
+	// Keeps the last frame sent and encodes the next one against it.
+	class Encoder
+	{
+	public:
+		// frame is width * height RGB pixels, rows bottom to top.
+		void Encode(const uint8_t* frame, int width, int height, std::vector<uint8_t>& payload, int& tiles)
+		{
+			bool resized = width != this->Width || height != this->Height;
+			if (resized) {
+				this->Width = width;
+				this->Height = height;
+				this->Previous.assign((size_t)width * height * 3, 0);
+			}
+			payload.clear();
+			tiles = 0;
+			for (int ty = 0; ty * TileSize < height; ty++) {
+				for (int tx = 0; tx * TileSize < width; tx++) {
+					int x0 = tx * TileSize, y0 = ty * TileSize;
+					int w = std::min(TileSize, width - x0), h = std::min(TileSize, height - y0);
+					bool changed = resized;
+					for (int y = y0; y < y0 + h && !changed; y++) {
+						size_t row = ((size_t)y * width + x0) * 3;
+						changed = std::memcmp(frame + row, &this->Previous[row], (size_t)w * 3) != 0;
+					}
+					if (!changed)
+						continue;
+					this->Tile.clear();
+					for (int y = y0; y < y0 + h; y++) {
+						size_t row = ((size_t)y * width + x0) * 3;
+						this->Tile.insert(this->Tile.end(), frame + row, frame + row + (size_t)w * 3);
+						std::memcpy(&this->Previous[row], frame + row, (size_t)w * 3);
+					}
+					EncodeRuns(this->Tile, this->Runs);
+					bool useRuns = this->Runs.size() < this->Tile.size();
+					const std::vector<uint8_t>& data = useRuns ? this->Runs : this->Tile;
+					TileHeader header{ (uint16_t)tx, (uint16_t)ty, (uint32_t)data.size() | (useRuns ? RunLengthFlag : 0) };
+					const uint8_t* headerBytes = reinterpret_cast<const uint8_t*>(&header);
+					payload.insert(payload.end(), headerBytes, headerBytes + sizeof(header));
+					payload.insert(payload.end(), data.begin(), data.end());
+					tiles++;
+				}
+			}
+		}
+
+	private:
+		int						Width = 0;
+		int						Height = 0;
+		std::vector<uint8_t>	Previous;
+		std::vector<uint8_t>	Tile;
+		std::vector<uint8_t>	Runs;
+	};
+
+	// Applies a frame's tiles to the client's copy of the image.
+	static bool DecodeFrame(const FrameHeader& header, const std::vector<uint8_t>& payload, std::vector<uint8_t>& image)
+	{
+		image.resize((size_t)header.width * header.height * 3);
+		std::vector<uint8_t> pixels;
+		size_t offset = 0;
+		for (int t = 0; t < header.tiles; t++) {
+			if (offset + sizeof(TileHeader) > payload.size())
+				return false;
+			TileHeader tile;
+			std::memcpy(&tile, &payload[offset], sizeof(tile));
+			offset += sizeof(tile);
+			size_t size = tile.size & ~RunLengthFlag;
+			if (offset + size > payload.size())
+				return false;
+			if (tile.size & RunLengthFlag)
+				DecodeRuns(&payload[offset], size, pixels);
+			else
+				pixels.assign(payload.begin() + offset, payload.begin() + offset + size);
+			offset += size;
+			int x0 = tile.x * header.tileSize, y0 = tile.y * header.tileSize;
+			int w = std::min((int)header.tileSize, header.width - x0), h = std::min((int)header.tileSize, header.height - y0);
+			if (pixels.size() != (size_t)w * h * 3)
+				return false;
+			for (int y = 0; y < h; y++)
+				std::memcpy(&image[(((size_t)(y0 + y)) * header.width + x0) * 3], &pixels[(size_t)y * w * 3], (size_t)w * 3);
+		}
+		return offset == payload.size();
+	}
+}
+
+// Serves frames of the window to one client until it quits or disconnects.
+static bool RunFrameServer(const DemoOptions& options, vtkRenderWindow* renWin, vtkRenderWindowInteractor* iren)
+{
+#ifdef _WIN32
+	std::cerr << "Frame streaming is not available on Windows" << std::endl;
+	return false;
+#else
+	using namespace FrameStream;
+	int client = AcceptClient(options.serveAddress);
+	if (client < 0) {
+		std::cerr << "Cannot serve on " << options.serveAddress << std::endl;
+		return false;
+	}
+	// The server renders once per batch of input, not once per event.
+	iren->EnableRenderOff();
+
+	Encoder encoder;
+	vtkNew<vtkUnsignedCharArray> pixels;
+	std::vector<uint8_t> payload;
+	uint32_t sequence = 0;
+	long frames = 0, tilesSent = 0;
+	double bytesSent = 0, encodeSeconds = 0, renderSeconds = 0;
+	bool running = true;
+	while (running) {
+		auto renderStart = std::chrono::steady_clock::now();
+		renWin->Render();
+		const int* size = renWin->GetSize();
+		renWin->GetPixelData(0, 0, size[0] - 1, size[1] - 1, 0, pixels);
+		auto encodeStart = std::chrono::steady_clock::now();
+		int tiles = 0;
+		encoder.Encode(pixels->GetPointer(0), size[0], size[1], payload, tiles);
+		auto encodeEnd = std::chrono::steady_clock::now();
+
+		FrameHeader header{ FrameMagic, sequence, (uint16_t)size[0], (uint16_t)size[1], (uint16_t)TileSize,
+			(uint16_t)tiles, (uint32_t)payload.size(),
+			(float)std::chrono::duration<double, std::milli>(encodeStart - renderStart).count(),
+			(float)std::chrono::duration<double, std::milli>(encodeEnd - encodeStart).count() };
+		if (!SendAll(client, &header, sizeof(header)) || !SendAll(client, payload.data(), payload.size()))
+			break;
+		frames++;
+		tilesSent += tiles;
+		bytesSent += sizeof(header) + payload.size();
+		renderSeconds += std::chrono::duration<double>(encodeStart - renderStart).count();
+		encodeSeconds += std::chrono::duration<double>(encodeEnd - encodeStart).count();
+
+		// Wait for input, then take everything that has arrived.
+		pollfd poller{ client, POLLIN, 0 };
+		if (poll(&poller, 1, -1) <= 0)
+			break;
+		do {
+			Input input;
+			if (!ReceiveAll(client, &input, sizeof(input))) {
+				running = false;
+				break;
+			}
+			input.keySym[sizeof(input.keySym) - 1] = 0;
+			sequence = input.sequence;
+			iren->SetEventInformation(input.x, input.y, 0, 0, input.keySym[0], 0, input.keySym);
+			switch (input.type) {
+			case MouseMove: iren->InvokeEvent(vtkCommand::MouseMoveEvent, nullptr); break;
+			case LeftButtonDown: iren->InvokeEvent(vtkCommand::LeftButtonPressEvent, nullptr); break;
+			case LeftButtonUp: iren->InvokeEvent(vtkCommand::LeftButtonReleaseEvent, nullptr); break;
+			case KeyPress: iren->InvokeEvent(vtkCommand::KeyPressEvent, nullptr); break;
+			default: running = false; break;
+			}
+			poller.revents = 0;
+		} while (running && poll(&poller, 1, 0) > 0);
+	}
+	close(client);
+
+	if (frames > 0) {
+		const int* size = renWin->GetSize();
+		std::cout << "stream: " << frames << " frames, " << bytesSent / frames << " bytes/frame (raw "
+			<< size[0] * size[1] * 3 << "), " << (double)tilesSent / frames << " tiles/frame, "
+			<< 1000 * renderSeconds / frames << " ms render, " << 1000 * encodeSeconds / frames << " ms encode" << std::endl;
+	}
+	return true;
+#endif
+}
+
+// Stand-in client: hovers, drags whatever face is under the window centre,
+// undoes and redoes the drag, and reports bytes per frame and input latency.
+static bool RunStreamClient(const DemoOptions& options)
+{
+#ifdef _WIN32
+	std::cerr << "Frame streaming is not available on Windows" << std::endl;
+	return false;
+#else
+	using namespace FrameStream;
+	int fd = -1;
+	for (int attempt = 0; attempt < 50 && fd < 0; attempt++) {
+		fd = Connect(options.connectAddress);
+		if (fd < 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	if (fd < 0) {
+		std::cerr << "Cannot connect to " << options.connectAddress << std::endl;
+		return false;
+	}
+
+	std::vector<uint8_t> image, payload;
+	FrameHeader header{};
+	long frames = 0, tiles = 0;
+	double bytes = 0, encodeMilliseconds = 0;
+	// Reads frames until one reflects input sequence (or later).
+	auto waitForFrame = [&](uint32_t sequence) {
+		do {
+			if (!ReceiveAll(fd, &header, sizeof(header)) || header.magic != FrameMagic)
+				return false;
+			payload.resize(header.payloadBytes);
+			if (!ReceiveAll(fd, payload.data(), payload.size()) || !DecodeFrame(header, payload, image))
+				return false;
+			frames++;
+			tiles += header.tiles;
+			bytes += sizeof(header) + payload.size();
+			encodeMilliseconds += header.encodeMilliseconds;
+		} while (header.sequence < sequence);
+		return true;
+	};
+	if (!waitForFrame(0)) {
+		close(fd);
+		return false;
+	}
+
+	int cx = header.width / 2, cy = header.height / 2;
+	std::vector<Input> script;
+	script.push_back(Input{ KeyPress, cx, cy, 0, "c" });	// actor mode, so the drag moves a face
+	script.push_back(Input{ MouseMove, cx, cy, 0, "" });
+	script.push_back(Input{ LeftButtonDown, cx, cy, 0, "" });
+	for (int step = 1; step <= 40; step++)
+		script.push_back(Input{ MouseMove, cx, cy + 2 * step, 0, "" });
+	script.push_back(Input{ LeftButtonUp, cx, cy + 80, 0, "" });
+	script.push_back(Input{ KeyPress, cx, cy + 80, 0, "z" });
+	script.push_back(Input{ KeyPress, cx, cy + 80, 0, "y" });
+
+	std::vector<double> latencies;
+	uint32_t sequence = 0;
+	for (Input& input : script) {
+		input.sequence = ++sequence;
+		auto sent = std::chrono::steady_clock::now();
+		if (!SendAll(fd, &input, sizeof(input)) || !waitForFrame(input.sequence))
+			break;
+		latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent).count());
+	}
+	Input quit{ Quit, 0, 0, ++sequence, "" };
+	SendAll(fd, &quit, sizeof(quit));
+	close(fd);
+
+	if (latencies.empty())
+		return false;
+	std::sort(latencies.begin(), latencies.end());
+	double total = 0;
+	for (double latency : latencies)
+		total += latency;
+	std::cout << "client: " << frames << " frames " << header.width << "x" << header.height << ", "
+		<< bytes / frames << " bytes/frame, " << (double)tiles / frames << " tiles/frame, "
+		<< encodeMilliseconds / frames << " ms encode; input round trip " << total / latencies.size()
+		<< " ms mean, " << latencies[latencies.size() / 2] << " ms median, " << latencies.back() << " ms max" << std::endl;
+	return latencies.size() == script.size();
+#endif
+}
 
 int test4(int argc, char* argv[])
 {
 	vtkObject::GlobalWarningDisplayOff();
 
+	DemoOptions options;
+	if (!ParseOptions(argc, argv, options))
+		return EXIT_FAILURE;
+	if (!options.connectAddress.empty())
+		return RunStreamClient(options) ? EXIT_SUCCESS : EXIT_FAILURE;
+	AllocationStats::Enabled = options.allocStats;
+
 	vtkNew<vtkNamedColors> colors;
 	colors->SetColor("BkgColor", bkg[0], bkg[1], bkg[2], bkg[2]);
 
@@ -855,79 +5706,81 @@ int test4(int argc, char* argv[])
 
 	aRenderer->SetBackground(colors->GetColor3d("BkgColor").GetData());
 	renWin->SetSize(640, 480);
+	// Depth peeling, one of the translucency modes, needs alpha planes and no MSAA.
+	renWin->SetAlphaBitPlanes(1);
+	renWin->SetMultiSamples(0);
+	// Batch snapshots and streamed frames never show the window.
+	if (!options.batchFile.empty() || !options.serveAddress.empty() || options.allocCheck)
+		renWin->SetOffScreenRendering(1);
 
-	std::array<vtkNew<vtkPlaneSource>, NUMOFPLANES> planes;
-	std::array<vtkNew<vtkPolyDataMapper>, NUMOFPLANES> polyDataMapperList;
-	std::array<vtkSmartPointer<vtkActor>, NUMOFPLANES> ActorList;
-	std::array<vtkNew<vtkVertexGlyphFilter>, NUMOFPLANES> vertexGlyphFilterList;
-
-
+	// The boxes sit on a grid in the XY plane, 120 apart; each starts as a
+	// 100 cube.  Box 0 is the one centred at the origin when there is one box.
 	double halfLength = 50.0; // Since edge length is 100, half is 50
-	double pBounds[6] = { -50, 50, -50, 50, -50, 50 };
-	for (int i = 0; i < 6; i++) {
-		planes[i]->SetXResolution(10);
-		planes[i]->SetYResolution(10);
-
-		switch (i) {
-		case 0: // Back face (XY plane, Z = -50)
-			planes[i]->SetOrigin(-halfLength + offset, -halfLength + offset, -halfLength);
-			planes[i]->SetPoint1(halfLength - offset, -halfLength + offset, -halfLength);
-			planes[i]->SetPoint2(-halfLength + offset, halfLength - offset, -halfLength);
-			break;
-		case 1: // Front face (XY plane, Z = +50)
-			planes[i]->SetOrigin(-halfLength + offset, -halfLength + offset, halfLength);
-			planes[i]->SetPoint1(halfLength - offset, -halfLength + offset, halfLength);
-			planes[i]->SetPoint2(-halfLength + offset, halfLength - offset, halfLength);
-			break;
-		case 2: // Left face (YZ plane, X = -50)
-			planes[i]->SetOrigin(-halfLength, -halfLength + offset, -halfLength + offset);
-			planes[i]->SetPoint1(-halfLength, halfLength - offset, -halfLength + offset);
-			planes[i]->SetPoint2(-halfLength, -halfLength + offset, halfLength - offset);
-			break;
-		case 3: // Right face (YZ plane, X = +50)
-			planes[i]->SetOrigin(halfLength, -halfLength + offset, -halfLength + offset);
-			planes[i]->SetPoint1(halfLength, halfLength - offset, -halfLength + offset);
-			planes[i]->SetPoint2(halfLength, -halfLength + offset, halfLength - offset);
-			break;
-		case 4: // Bottom face (XZ plane, Y = -50)
-			planes[i]->SetOrigin(-halfLength + offset, -halfLength, -halfLength + offset);
-			planes[i]->SetPoint1(halfLength - offset, -halfLength, -halfLength + offset);
-			planes[i]->SetPoint2(-halfLength + offset, -halfLength, halfLength - offset);
-			break;
-		case 5: // Top face (XZ plane, Y = +50)
-			planes[i]->SetOrigin(-halfLength + offset, halfLength, -halfLength + offset);
-			planes[i]->SetPoint1(halfLength - offset, halfLength, -halfLength + offset);
-			planes[i]->SetPoint2(-halfLength + offset, halfLength, halfLength - offset);
-			break;
-		}
+	std::vector<std::unique_ptr<BoxROI>> rois;
+	int columns = (int)std::ceil(std::sqrt((double)options.rois));
+	int rows = (options.rois + columns - 1) / columns;
+	for (int r = 0; r < options.rois; r++) {
+		double center[2] = { 120.0 * (r % columns - 0.5 * (columns - 1)), 120.0 * (r / columns - 0.5 * (rows - 1)) };
+		double roiBounds[6] = { center[0] - halfLength, center[0] + halfLength,
+			center[1] - halfLength, center[1] + halfLength, -halfLength, halfLength };
+		rois.emplace_back(new BoxROI);
+		rois.back()->Build(aRenderer, roiBounds, options.composite);
 	}
-
-	for (int i = 0; i < NUMOFPLANES; i++) {
-		int res = std::max(planes[i]->GetXResolution(), planes[i]->GetYResolution());
-		if (res > length)
-			length = res;
+	std::vector<BoxROI*>			roiList;
+	std::vector<vtkActor*>			actors;
+	std::vector<vtkPlaneSource*>	planeSources;
+	for (auto& roi : rois) {
+		roiList.push_back(roi.get());
+		for (int i = 0; i < NUMOFPLANES; i++) {
+			actors.push_back(roi->GetFaceActor(i));
+			planeSources.push_back(roi->GetPlaneSource(i));
+		}
 	}
 
-	//std::cout << "length = " << length << std::endl;
+	// Point cloud mode: the scan is fitted into the widget cube and drawn
+	// through the octree, cropped by the box.
+	PointCloudOctree octree;
+	vtkNew<vtkPolyData> pointCloud;
+	vtkNew<vtkPointGaussianMapper> pointCloudMapper;
+	vtkNew<vtkActor> pointCloudActor;
+	vtkNew<vtkPointCloudLODCallback> pointCloudLOD;
+	vtkNew<vtkCallbackCommand> pointCloudKeys;
+	if (!options.pointCloudFile.empty() || options.syntheticPoints > 0) {
+		std::vector<float> xyz;
+		if (options.syntheticPoints > 0) {
+			MakeSyntheticPointCloud(options.syntheticPoints, xyz);
+		}
+		else if (!ReadPointCloud(options.pointCloudFile, xyz)) {
+			std::cerr << "Cannot read point cloud " << options.pointCloudFile << std::endl;
+			return EXIT_FAILURE;
+		}
+		octree.Build(xyz, rois[0]->GetBounds(), 16384);
+		std::cout << "point cloud: " << octree.NumberOfPoints() << " points, " << octree.NumberOfNodes()
+			<< " nodes (" << octree.NumberOfLeaves() << " leaves), built in " << octree.GetBuildMilliseconds()
+			<< " ms" << std::endl;
 
-	for (int i = 0; i < NUMOFPLANES; i++) {
-		planes[i]->Update();
-	}
+		vtkNew<vtkFloatArray> coords;
+		coords->SetNumberOfComponents(3);
+		vtkNew<vtkPoints> points;
+		points->SetData(coords);
+		pointCloud->SetPoints(points);
+		pointCloudMapper->SetInputData(pointCloud);
+		pointCloudMapper->SetScaleFactor(0.0);
+		pointCloudActor->SetMapper(pointCloudMapper);
+		pointCloudActor->GetProperty()->SetColor(colors->GetColor3d("Ivory").GetData());
+		pointCloudActor->PickableOff();
+		aRenderer->AddActor(pointCloudActor);
 
-	std::array<double, 6> bounds;
-	for (int i = 0; i < NUMOFPLANES; i++) {
-		planes[i]->GetOutput()->GetBounds(bounds.data());
-		for (int j = 0; j < 6; j++)
-			std::cout << bounds[j] << " ";
-		std::cout << std::endl;
-	}
+		pointCloudLOD->Octree = &octree;
+		pointCloudLOD->Output = pointCloud;
+		pointCloudLOD->ROI = rois[0].get();
+		pointCloudLOD->PointsPerPixel = options.pointsPerPixel;
+		pointCloudLOD->Budget = options.pointBudget;
+		aRenderer->AddObserver(vtkCommand::StartEvent, pointCloudLOD);
 
-	for (int i = 0; i < NUMOFPLANES; i++) {
-		polyDataMapperList[i]->SetInputConnection(planes[i]->GetOutputPort());
-		ActorList[i] = vtkSmartPointer<vtkActor>::New();
-		ActorList[i]->SetMapper(polyDataMapperList[i]);
-		ActorList[i]->GetProperty()->SetOpacity(0.3);
-		aRenderer->AddActor(ActorList[i]);
+		pointCloudKeys->SetCallback(PointCloudKeyPress);
+		pointCloudKeys->SetClientData(pointCloudLOD);
+		iren->AddObserver(vtkCommand::KeyPressEvent, pointCloudKeys);
 	}
 
 	vtkNew<vtkCamera> aCamera;
@@ -939,24 +5792,451 @@ int test4(int argc, char* argv[])
 	aCamera->Elevation(30.0);
 
 	aRenderer->SetActiveCamera(aCamera);
+	StartupProfile startup;
+	startup.Mark("scene setup");
+	renWin->Initialize();
+	startup.Mark("window creation");
 	renWin->Render();
+	startup.Mark("first render");
 
 	aRenderer->ResetCamera();
 	aCamera->Dolly(1.5);
 	aRenderer->ResetCameraClippingRange();
 
 	vtkNew<vtkCustomInteractorStyleCamera> style;
-	std::vector<vtkActor*>			actors(ActorList.begin(), ActorList.end());
-	std::vector<vtkPlaneSource*>	planeSources(planes.begin(), planes.end());
 	style->SetRenderer(aRenderer);
-	style->SetBounds(pBounds);
-	style->SetPlanes(actors);
-	style->SetPlaneSource(planeSources);
+	style->SetROIs(roiList);
+
+	// Four-up layout: axial, sagittal and coronal views of the boxes next to
+	// the 3D view, redrawn only when what they show has changed.
+	std::array<vtkNew<vtkRenderer>, 3> sliceRenderers;
+	vtkNew<vtkLinkedViewsCallback> linkedViews;
+	vtkNew<vtkCallbackCommand> linkedViewsKeys;
+	if (options.fourUp) {
+		static const double viewports[3][4] = { { 0, 0.5, 0.5, 1 }, { 0.5, 0.5, 1, 1 }, { 0, 0, 0.5, 0.5 } };
+		// Axial looks down z, sagittal down x, coronal down y.
+		static const double directions[3][3] = { { 0, 0, -1 }, { -1, 0, 0 }, { 0, 1, 0 } };
+		static const double viewUps[3][3] = { { 0, 1, 0 }, { 0, 0, 1 }, { 0, 0, 1 } };
+		aRenderer->SetViewport(0.5, 0, 1, 0.5);
+		for (int v = 0; v < 3; v++) {
+			vtkRenderer* renderer = sliceRenderers[v];
+			renderer->SetViewport(viewports[v]);
+			renderer->SetBackground(colors->GetColor3d("BkgColor").GetData());
+			for (vtkActor* actor : actors)
+				renderer->AddActor(actor);
+			renWin->AddRenderer(renderer);
+			vtkCamera* camera = renderer->GetActiveCamera();
+			camera->ParallelProjectionOn();
+			camera->SetFocalPoint(0, 0, 0);
+			camera->SetPosition(-directions[v][0], -directions[v][1], -directions[v][2]);
+			camera->SetViewUp(viewUps[v]);
+			renderer->ResetCamera();
+		}
+		linkedViews->SetViews(renWin, { aRenderer, sliceRenderers[0], sliceRenderers[1], sliceRenderers[2] },
+			{ -1, 2, 0, 1 });
+		linkedViews->Observe(style->ActorStyle);
+		linkedViewsKeys->SetCallback(LinkedViewsKeyPress);
+		linkedViewsKeys->SetClientData(linkedViews);
+		iren->AddObserver(vtkCommand::KeyPressEvent, linkedViewsKeys);
+	}
 	iren->SetInteractorStyle(style);
 
+	// Face resolution follows the faces' size on screen.
+	vtkNew<vtkPlaneTessellationCallback> tessellation;
+	tessellation->PixelsPerCell = options.faceDetail;
+	tessellation->SetFaces(aRenderer, actors, planeSources);
+
+	// The faces are built on the pipeline thread from here on.
+	BoxPipelineThread pipelineThread;
+	vtkNew<vtkBoxPipelineCallback> pipelineResults;
+	if (options.pipelineThread) {
+		pipelineThread.Start(options.rois);
+		for (int r = 0; r < options.rois; r++)
+			rois[r]->SetPipeline(&pipelineThread, r);
+		style->ActorStyle->SetPipelineThread(&pipelineThread);
+		bool synchronous = !options.batchFile.empty() || !options.serveAddress.empty() || options.allocCheck;
+		pipelineResults->Observe(iren, aRenderer, &pipelineThread, roiList, style->ActorStyle, synchronous);
+	}
+
+	// Reopening a case puts the boxes, camera and mode back where they were.
+	SessionContext session;
+	vtkNew<vtkCallbackCommand> sessionKeys;
+	if (!options.sessionFile.empty()) {
+		session.fileName = options.sessionFile;
+		session.rois = roiList;
+		session.camera = aCamera;
+		session.style = style;
+		if (std::ifstream(options.sessionFile).good() && !session.Restore(iren))
+			std::cerr << "Cannot restore session " << options.sessionFile << std::endl;
+		sessionKeys->SetCallback(SessionKeyPress);
+		sessionKeys->SetClientData(&session);
+		iren->AddObserver(vtkCommand::KeyPressEvent, sessionKeys);
+	}
+
+	// Frame-time budget: drags aim for the interactive rate, idle frames for
+	// the still rate.  Costly features are scaled down while dragging.
+	iren->SetDesiredUpdateRate(options.interactiveRate);
+	iren->SetStillUpdateRate(options.stillRate);
+	renWin->SetDesiredUpdateRate(options.stillRate);
+	aRenderer->SetUseFXAA(true);
+	vtkNew<vtkFrameRateController> frameRate;
+	frameRate->AddFeature("smoothing", [&](int level) {
+		aRenderer->SetUseFXAA(level == 0);
+	});
+	frameRate->AddFeature("mesh resolution", [&](int level) {
+		tessellation->Coarsening = 1 << level;
+	});
+	frameRate->AddFeature("translucency", [&](int level) {
+		double opacity = level >= 2 ? 1.0 : 0.3;
+		for (auto& roi : rois) {
+			for (int i = 0; i < NUMOFPLANES; i++) {
+				vtkActor* actor = roi->GetFaceActor(i);
+				if (level >= 2)
+					actor->GetProperty()->SetRepresentationToWireframe();
+				else
+					actor->GetProperty()->SetRepresentationToSurface();
+				actor->GetProperty()->SetOpacity(opacity);
+				if (roi->IsComposite())
+					roi->GetCompositeMapper()->SetBlockOpacity(i + 1, opacity);
+			}
+		}
+	});
+	if (pointCloudLOD->Octree) {
+		frameRate->AddFeature("point density", [&](int level) {
+			pointCloudLOD->PointsPerPixel = options.pointsPerPixel / (1 << level);
+			pointCloudLOD->Budget = options.pointBudget >> level;
+			pointCloudLOD->Invalidate();
+		});
+	}
+	// A streamed session has no event loop to run the restore timer.
+	if (options.serveAddress.empty())
+		frameRate->Observe(iren, { style, style->ActorStyle });
+
+	// Order the translucent faces back to front each frame instead of peeling.
+	// Batched faces share one actor and cannot be reordered that way.
+	vtkNew<vtkFaceSortCallback> faceSort;
+	if (options.composite) {
+		faceSort->SetFaces(aRenderer, {}, {});
+		if (options.translucencyMode == vtkFaceSortCallback::Sorted)
+			options.translucencyMode = vtkFaceSortCallback::DepthPeeling;
+	}
+	else {
+		faceSort->SetFaces(aRenderer, actors, planeSources);
+	}
+	faceSort->SetMode(options.translucencyMode);
+	vtkNew<vtkCallbackCommand> faceSortKeys;
+	faceSortKeys->SetCallback(FaceSortKeyPress);
+	faceSortKeys->SetClientData(faceSort);
+	iren->AddObserver(vtkCommand::KeyPressEvent, faceSortKeys);
+	DrawStats drawStats;
+	drawStats.Renderer = aRenderer;
+	drawStats.FrameRate = frameRate;
+	vtkNew<vtkCallbackCommand> drawStatsKeys;
+	drawStatsKeys->SetCallback(DrawStatsKeyPress);
+	drawStatsKeys->SetClientData(&drawStats);
+	iren->AddObserver(vtkCommand::KeyPressEvent, drawStatsKeys);
+
+	// Nothing of the volume is loaded until it is first shown.
+	VolumeSurface volume;
+	vtkNew<vtkCallbackCommand> volumeKeys;
+	if (!options.volumeFile.empty()) {
+		volume.FileName = options.volumeFile;
+		volume.Renderer = aRenderer;
+		if (options.clipSurface)
+			volume.ClipBox = rois[0].get();
+		volume.RayCast = options.rayCast;
+		volume.CropBox = rois[0].get();
+		volume.IsoValue = options.isoValue;
+		if (options.keepComponents > 0 || options.minComponent > 0) {
+			volume.Components.reset(new SurfaceComponents);
+			volume.Components->Largest = options.keepComponents;
+			volume.Components->MinTriangles = options.minComponent;
+		}
+		frameRate->AddFeature("volume sampling", [&](int level) {
+			volume.SetQualityLevel(level);
+		});
+		volumeKeys->SetCallback(VolumeKeyPress);
+		volumeKeys->SetClientData(&volume);
+		iren->AddObserver(vtkCommand::KeyPressEvent, volumeKeys);
+	}
+
+	vtkNew<vtkCallbackCommand> exportKeys;
+	if (!options.volumeFile.empty() && !options.exportFile.empty()) {
+		volume.ExportFile = options.exportFile;
+		exportKeys->SetCallback(ExportKeyPress);
+		exportKeys->SetClientData(&volume);
+		iren->AddObserver(vtkCommand::KeyPressEvent, exportKeys);
+	}
+
+	// 'g' grows a region from the voxel under the mouse, inside box 0.
+	RegionGrowTool regionGrow;
+	vtkNew<vtkCallbackCommand> regionGrowKeys;
+	if (!options.volumeFile.empty()) {
+		regionGrow.FileName = options.volumeFile;
+		regionGrow.Renderer = aRenderer;
+		regionGrow.ROI = rois[0].get();
+		std::copy(options.growRange, options.growRange + 2, regionGrow.Range);
+		regionGrowKeys->SetCallback(RegionGrowKeyPress);
+		regionGrowKeys->SetClientData(&regionGrow);
+		iren->AddObserver(vtkCommand::KeyPressEvent, regionGrowKeys);
+	}
+
+	vtkNew<vtkPipelineTraceCallback> tracer;
+	if (!options.traceFile.empty()) {
+		tracer->FileName = options.traceFile;
+		tracer->Observe(renWin);
+	}
+
+	vtkNew<vtkMemoryBudgetCallback> memoryBudget;
+	vtkNew<vtkCallbackCommand> memoryBudgetKeys;
+	if (options.memoryBudget >= 0) {
+		memoryBudget->BudgetMegabytes = options.memoryBudget;
+		memoryBudget->Observe(renWin);
+		memoryBudgetKeys->SetCallback(MemoryBudgetKeyPress);
+		memoryBudgetKeys->SetClientData(memoryBudget);
+		iren->AddObserver(vtkCommand::KeyPressEvent, memoryBudgetKeys);
+	}
+
+	vtkNew<vtkCallbackCommand> allocationKeys;
+	if (options.allocStats) {
+		allocationKeys->SetCallback(AllocationStatsKeyPress);
+		iren->AddObserver(vtkCommand::KeyPressEvent, allocationKeys);
+	}
+
+	startup.Mark("interaction setup");
+	if (options.startupProfile)
+		startup.Print();
+
+	if (options.allocCheck)
+		return RunAllocationCheck(iren, aRenderer, style->ActorStyle, rois[0].get()) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	if (!options.serveAddress.empty())
+		return RunFrameServer(options, renWin, iren) ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (!options.batchFile.empty())
+		return RunBatchSnapshots(options, renWin, aRenderer, rois[0].get()) ? EXIT_SUCCESS : EXIT_FAILURE;
+
 	// interact with data
 	iren->Initialize();
 	iren->Start();
 
+	if (pipelineThread.IsRunning()) {
+		pipelineThread.Stop();
+		pipelineThread.PrintStatistics();
+	}
+	if (!options.sessionFile.empty())
+		session.Save(iren);
+	if (options.allocStats)
+		AllocationStats::Print();
+
 	return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+#ifdef MEDICALDEMO3_BENCHMARK
+// Micro-benchmarks of the interaction primitives on the demo's one-box scene,
+// drawn off screen.  Each step runs in batches of about a millisecond after a
+// warm-up, and the median and fastest batch are reported in nanoseconds per
+// step, one JSON object per line on stdout.  --save-baseline <file> keeps
+// those lines; --baseline <file> compares the medians with them and fails if
+// any is more than --tolerance (a fraction, 0.25 by default) slower.
+struct BenchmarkResult
+{
+	std::string	name;
+	size_t		iterations = 0;
+	double		medianNs = 0;
+	double		minNs = 0;
+
+	std::string ToJson() const
+	{
+		std::ostringstream line;
+		line << std::fixed << std::setprecision(1) << "{\"benchmark\": \"" << this->name << "\", \"iterations\": "
+			<< this->iterations << ", \"median_ns\": " << this->medianNs << ", \"min_ns\": " << this->minNs << "}";
+		return line.str();
+	}
+
+	// Reads a line written by ToJson.
+	bool FromJson(const std::string& line)
+	{
+		const std::string nameKey = "\"benchmark\": \"", medianKey = "\"median_ns\": ";
+		size_t name = line.find(nameKey), median = line.find(medianKey);
+		if (name == std::string::npos || median == std::string::npos)
+			return false;
+		name += nameKey.size();
+		this->name = line.substr(name, line.find('"', name) - name);
+		this->medianNs = std::atof(line.c_str() + median + medianKey.size());
+		return true;
+	}
+};
+
+template <class Step>
+static BenchmarkResult RunBenchmark(const std::string& name, Step step)
+{
+	using Clock = std::chrono::steady_clock;
+	const int samples = 21;
+	auto timeBatch = [&step](size_t batch) {
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < batch; i++)
+			step();
+		return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+	};
+	// Doubling the batch until it takes a millisecond doubles as the warm-up.
+	size_t batch = 1;
+	while (timeBatch(batch) < 1e6 && batch < ((size_t)1 << 24))
+		batch *= 2;
+	std::vector<double> perStep(samples);
+	for (double& ns : perStep)
+		ns = timeBatch(batch) / batch;
+	std::sort(perStep.begin(), perStep.end());
+
+	BenchmarkResult result;
+	result.name = name;
+	result.iterations = samples * batch;
+	result.medianNs = perStep[samples / 2];
+	result.minNs = perStep.front();
+	std::cout << result.ToJson() << std::endl;
+	return result;
+}
+
+int RunBenchmarks(int argc, char* argv[])
+{
+	vtkObject::GlobalWarningDisplayOff();
+	std::string baselineFile, saveFile;
+	double tolerance = 0.25;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--baseline" && i + 1 < argc)
+			baselineFile = argv[++i];
+		else if (arg == "--save-baseline" && i + 1 < argc)
+			saveFile = argv[++i];
+		else if (arg == "--tolerance" && i + 1 < argc) {
+			if (!ParseNumber(argv[++i], tolerance)) {
+				std::cerr << "Bad value for " << arg << std::endl;
+				return EXIT_FAILURE;
+			}
+		}
+		else {
+			std::cerr << "Unknown option " << arg << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	// The demo's scene with one box: a 100 cube at the origin, seen from the
+	// default camera.
+	vtkNew<vtkRenderer> renderer;
+	vtkNew<vtkRenderWindow> renWin;
+	renWin->AddRenderer(renderer);
+	renWin->SetSize(640, 480);
+	renWin->SetOffScreenRendering(1);
+	vtkNew<vtkRenderWindowInteractor> iren;
+	iren->SetRenderWindow(renWin);
+	const double bounds[6] = { -50, 50, -50, 50, -50, 50 };
+	BoxROI roi;
+	roi.Build(renderer, bounds, false);
+	vtkCamera* camera = renderer->GetActiveCamera();
+	camera->SetViewUp(0, 0, -1);
+	camera->SetPosition(0, -1, 0);
+	camera->SetFocalPoint(0, 0, 0);
+	camera->ComputeViewPlaneNormal();
+	camera->Azimuth(30.0);
+	camera->Elevation(30.0);
+	renderer->ResetCamera();
+	camera->Dolly(1.5);
+	renderer->ResetCameraClippingRange();
+	renWin->Render();
+
+	vtkNew<vtkCustomInteractorStyle> style;
+	style->SetRenderer(renderer);
+	style->SetROIs({ &roi });
+	iren->SetInteractorStyle(style);
+
+	renderer->SetWorldPoint(0, 0, 0, 1);
+	renderer->WorldToDisplay();
+	double center[3];
+	renderer->GetDisplayPoint(center);
+
+	std::vector<BenchmarkResult> results;
+	vtkNew<vtkPropPicker> picker;
+	results.push_back(RunBenchmark("prop_pick", [&]() {
+		picker->Pick(center[0], center[1], 0, renderer);
+	}));
+
+	// Display to world and back, as a drag converts each mouse position.
+	results.push_back(RunBenchmark("display_to_world", [&]() {
+		double world[4], display[3];
+		renderer->SetDisplayPoint(center[0], center[1], 0);
+		renderer->DisplayToWorld();
+		renderer->GetWorldPoint(world);
+		renderer->SetWorldPoint(world);
+		renderer->WorldToDisplay();
+		renderer->GetDisplayPoint(display);
+	}));
+
+	// A face translation written in place, as a drag does, and the actor
+	// matrix recomputed from it.
+	vtkActor* faceActor = roi.GetFaceActor(0);
+	int steps = 0;
+	results.push_back(RunBenchmark("face_matrix", [&]() {
+		faceActor->GetUserMatrix()->SetElement(2, 3, (double)(steps++ % 2));
+		faceActor->GetMatrix();
+	}));
+	faceActor->GetUserMatrix()->SetElement(2, 3, 0);
+
+	// One face step and the plane sources it changes, brought up to date.
+	results.push_back(RunBenchmark("face_update", [&]() {
+		roi.MoveFace(0, steps++ % 2 ? -increamentXYZ : increamentXYZ);
+		for (int i = 0; i < NUMOFPLANES; i++)
+			roi.GetPlaneSource(i)->Update();
+	}));
+
+	// A drag event through the style: pick conversion, face move and render.
+	auto send = [&iren](double x, double y, unsigned long event) {
+		iren->SetEventInformation((int)x, (int)y);
+		iren->InvokeEvent(event, nullptr);
+	};
+	send(center[0], center[1], vtkCommand::LeftButtonPressEvent);
+	results.push_back(RunBenchmark("mouse_move", [&]() {
+		double angle = 2 * vtkMath::Pi() * (steps++ % 50) / 50;
+		send(center[0] + 20 * std::cos(angle), center[1] + 20 * std::sin(angle), vtkCommand::MouseMoveEvent);
+	}));
+	send(center[0], center[1], vtkCommand::LeftButtonReleaseEvent);
+
+	if (!saveFile.empty()) {
+		std::ofstream out(saveFile);
+		for (const BenchmarkResult& result : results)
+			out << result.ToJson() << "\n";
+		if (!out) {
+			std::cerr << "Cannot write " << saveFile << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (baselineFile.empty())
+		return EXIT_SUCCESS;
+	std::ifstream in(baselineFile);
+	if (!in) {
+		std::cerr << "Cannot read baseline " << baselineFile << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::map<std::string, double> baseline;
+	std::string line;
+	while (std::getline(in, line)) {
+		BenchmarkResult stored;
+		if (stored.FromJson(line))
+			baseline[stored.name] = stored.medianNs;
+	}
+	int regressions = 0;
+	for (const BenchmarkResult& result : results) {
+		auto stored = baseline.find(result.name);
+		if (stored == baseline.end()) {
+			std::cerr << result.name << ": not in the baseline" << std::endl;
+			continue;
+		}
+		double change = stored->second > 0 ? result.medianNs / stored->second - 1 : 0;
+		if (change > tolerance) {
+			std::cerr << result.name << ": " << result.medianNs << " ns against " << stored->second
+				<< " ns in the baseline (+" << 100 * change << "%)" << std::endl;
+			regressions++;
+		}
+	}
+	return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif